@@ -115,6 +115,31 @@ const USB_Descriptor_HIDReport_Datatype_t PROGMEM KeyboardReport[] =
 		HID_RI_END_COLLECTION(0),
 	};
 
+#if USB_NKRO
+/** NKRO keyboard HID report descriptor: a modifier byte followed by a bitmap of keys 0x00 - 0xDF,
+ *  matching KeyboardReportBitmap.
+ */
+const USB_Descriptor_HIDReport_Datatype_t PROGMEM NKROReport[] =
+	{
+		HID_RI_USAGE_PAGE(8, 0x01), /* Generic Desktop */
+		HID_RI_USAGE(8, 0x06), /* Keyboard */
+		HID_RI_COLLECTION(8, 0x01), /* Application */
+		HID_RI_USAGE_PAGE(8, 0x07), /* Key Codes */
+		HID_RI_USAGE_MINIMUM(8, 0xE0), /* Keyboard Left Control */
+		HID_RI_USAGE_MAXIMUM(8, 0xE7), /* Keyboard Right GUI */
+		HID_RI_LOGICAL_MINIMUM(8, 0x00),
+		HID_RI_LOGICAL_MAXIMUM(8, 0x01),
+		HID_RI_REPORT_SIZE(8, 0x01),
+		HID_RI_REPORT_COUNT(8, 0x08),
+		HID_RI_INPUT(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
+		HID_RI_USAGE_MINIMUM(8, 0x00), /* Reserved (no event indicated) */
+		HID_RI_USAGE_MAXIMUM(8, 0xDF),
+		HID_RI_REPORT_COUNT(8, KEYBOARDBITMAP_SIZE * 8),
+		HID_RI_INPUT(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
+		HID_RI_END_COLLECTION(0),
+	};
+#endif
+
 /** Device descriptor structure. This descriptor, located in FLASH memory, describes the overall
  *  device characteristics, including the supported USB version, control endpoint size and the
  *  number of device configurations. The descriptor is read out by the USB host when the enumeration
@@ -149,7 +174,7 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
 		.Header                 = {.Size = sizeof(USB_Descriptor_Configuration_Header_t), .Type = DTYPE_Configuration},
 
 		.TotalConfigurationSize = sizeof(USB_Descriptor_Configuration_t),
-		.TotalInterfaces        = 2,
+		.TotalInterfaces        = 2 + USB_NKRO,
 
 		.ConfigurationNumber    = 1,
 		.ConfigurationStrIndex  = NO_DESCRIPTOR,
@@ -231,8 +256,46 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
 		.Attributes             = (EP_TYPE_INTERRUPT | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
 		.EndpointSize           = HID_EPSIZE,
 		.PollingIntervalMS      = 0x18
-	}
+	},
+
+#if USB_NKRO
+	.HID3_NKROInterface =
+	{
+		.Header                 = {.Size = sizeof(USB_Descriptor_Interface_t), .Type = DTYPE_Interface},
+
+		.InterfaceNumber        = 0x02,
+		.AlternateSetting       = 0x00,
+
+		.TotalEndpoints         = 1,
 
+		.Class                  = HID_CSCP_HIDClass,
+		.SubClass               = HID_CSCP_NonBootSubclass,
+		.Protocol               = HID_CSCP_NonBootProtocol,
+
+		.InterfaceStrIndex      = NO_DESCRIPTOR
+	},
+
+	.HID3_NKROHID =
+	{
+		.Header                 = {.Size = sizeof(USB_HID_Descriptor_HID_t), .Type = HID_DTYPE_HID},
+
+		.HIDSpec                = VERSION_BCD(01.11),
+		.CountryCode            = 0x00,
+		.TotalReportDescriptors = 1,
+		.HIDReportType          = HID_DTYPE_Report,
+		.HIDReportLength        = sizeof(NKROReport)
+	},
+
+	.HID3_ReportINEndpoint =
+	{
+		.Header                 = {.Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint},
+
+		.EndpointAddress        = (ENDPOINT_DESCRIPTOR_DIR_IN | NKRO_IN_EPNUM),
+		.Attributes             = (EP_TYPE_INTERRUPT | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+		.EndpointSize           = NKRO_EPSIZE,
+		.PollingIntervalMS      = 0x01
+	},
+#endif
 };
 
 #define USB_STRING_LEN_OF(x) (sizeof(USB_Descriptor_Header_t) + sizeof(x) - 2)
@@ -334,6 +397,13 @@ uint16_t CALLBACK_USB_GetDescriptor(const uint16_t wValue,
 				Address = &ConfigurationDescriptor.HID1_KeyboardHID;
 				Size    = sizeof(USB_HID_Descriptor_HID_t);
 			}
+#if USB_NKRO
+			else if (wIndex == 2)
+			{
+				Address = &ConfigurationDescriptor.HID3_NKROHID;
+				Size    = sizeof(USB_HID_Descriptor_HID_t);
+			}
+#endif
 			else
 			{
 				Address = &ConfigurationDescriptor.HID2_MouseHID;
@@ -346,6 +416,13 @@ uint16_t CALLBACK_USB_GetDescriptor(const uint16_t wValue,
 				Address = &KeyboardReport;
 				Size    = sizeof(KeyboardReport);
 			}
+#if USB_NKRO
+			else if (wIndex == 2)
+			{
+				Address = &NKROReport;
+				Size    = sizeof(NKROReport);
+			}
+#endif
 			else
 			{
 				Address = &MouseReport;
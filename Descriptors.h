@@ -56,6 +56,23 @@
 		#include <LUFA_compat.h> // Stripped types from LUFA headers
 #endif
 
+	/* Options: */
+		/** Add a third HID interface reporting keys as a bitmap (N-key rollover) once the host has
+		 *  selected the report protocol, leaving the boot keyboard interface empty. The report needs
+		 *  a full speed endpoint, so this is only available with LUFA.
+		 */
+		#ifndef USB_NKRO
+			#ifdef BUILD_FOR_LUFA
+				#define USB_NKRO 1
+			#else
+				#define USB_NKRO 0
+			#endif
+		#endif
+
+		#if USB_NKRO && !defined(BUILD_FOR_LUFA)
+			#error "USB_NKRO requires a full speed USB device (LUFA)"
+		#endif
+
 	/* Type Defines: */
 		/** Type define for the device configuration descriptor structure. This must be defined in the
 		 *  application code, as the configuration descriptor contains several sub-descriptors which
@@ -70,6 +87,11 @@
 			USB_Descriptor_Interface_t            HID2_MouseInterface;
 			USB_HID_Descriptor_HID_t              HID2_MouseHID;
 			USB_Descriptor_Endpoint_t             HID2_ReportINEndpoint;
+#if USB_NKRO
+			USB_Descriptor_Interface_t            HID3_NKROInterface;
+			USB_HID_Descriptor_HID_t              HID3_NKROHID;
+			USB_Descriptor_Endpoint_t             HID3_ReportINEndpoint;
+#endif
 		} USB_Descriptor_Configuration_t;
 
 		typedef struct
@@ -91,6 +113,18 @@
 			uint8_t KeyCode[KEYBOARDREPORT_KEY_COUNT]; /**< Key codes of the currently pressed keys. */
 		} __attribute__((packed)) KeyboardReport_Data_t;
 
+		/** Pressed keys (0x00 - 0xDF) and modifiers, as composed from the key state, macros and
+		 *  programs. Converted to KeyboardReport_Data_t for the boot keyboard interface, and sent
+		 *  as is on the NKRO interface.
+		 */
+		#define KEYBOARDBITMAP_SIZE (0xE0 / 8)
+
+		typedef struct
+		{
+			uint8_t Modifier;
+			uint8_t Keys[KEYBOARDBITMAP_SIZE];
+		} __attribute__((packed)) KeyboardReportBitmap;
+
 	/* Macros: */
 		/** Endpoint number of the Keyboard HID reporting IN endpoint. */
 		#define KEYBOARD_IN_EPNUM               1
@@ -101,5 +135,11 @@
 		/** Size in bytes of the Keyboard HID reporting IN and OUT endpoints. */
 		#define HID_EPSIZE           8
 
+		/** Endpoint number of the NKRO keyboard HID reporting IN endpoint. */
+		#define NKRO_IN_EPNUM             2
+
+		/** Size in bytes of the NKRO keyboard HID reporting IN endpoint: the whole report in one packet. */
+		#define NKRO_EPSIZE          32
+
 
 #endif
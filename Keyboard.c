@@ -58,6 +58,8 @@
 #include "interpreter.h"
 #include "macro_index.h"
 #include "macro.h"
+#include "extrareport.h"
+#include "stats.h"
 
 #include "sort.h"
 
@@ -68,6 +70,11 @@
 /** Buffer to hold the previously generated Keyboard HID report, for comparison purposes inside the HID class driver. */
 KeyboardReport_Data_t PrevKeyboardHIDReportBuffer;
 
+#if USB_NKRO
+/** Buffer to hold the previously generated NKRO HID report, for comparison purposes. */
+KeyboardReportBitmap PrevNKROHIDReportBuffer;
+#endif
+
 /** Buffer to hold the previously generated Mouse HID report, for comparison purposes inside the HID class driver. */
 MouseReport_Data_t PrevMouseHIDReportBuffer;
 
@@ -79,6 +86,21 @@ static state current_state = STATE_NORMAL;
 // state to transition to when next action is complete:
 // used for STATE_WAITING, STATE_PRINTING and STATE_EEWRITE which might transition into multiple states
 static state next_state;
+// state in which the last keyboard report was filled
+static state report_state;
+
+// Macro and program triggers are only evaluated when the set of pressed
+// keys has changed, detected by the key event ring moving past this
+// cursor. While a chord stays held, the program it triggered (if any) is
+// restarted from the cached result rather than by repeating the lookup.
+static key_event_cursor trigger_cursor;
+#if PROGRAM_SIZE > 0
+static struct {
+	bool valid;
+	uint8_t idx;
+	logical_keycode l_key;
+} held_program;
+#endif
 
 // Predeclarations
 static void handle_state_normal(void);
@@ -95,18 +117,33 @@ void __attribute__((noreturn)) Keyboard_Main(void)
 	ports_init();
 	keystate_init();
 	config_init();
+	macro_idx_init();
+	trigger_cursor = keystate_event_cursor();
 	vm_init();
+	stats_reset();
+
+#if MATRIX_SCAN_ISR
+	matrix_scan_timer_start();
+#endif
 
 	// Low pitched buzz on startup
 	buzzer_start_f(200, 200);
 
 	struct { int keys:1; int mouse:1; } update;
 
+	uint16_t loop_ticks = stats_ticks();
+
 	for (;;) {
-		// update key state once per 2ms slice
+		uint16_t now_ticks = stats_ticks();
+		stats_record(&stats_get_latency()->loop, now_ticks - loop_ticks);
+		loop_ticks = now_ticks;
+
+		// scan the matrix (unless scanned by interrupt) once per 2ms slice
 		uint8_t slice = (uptimems() & 0x1);
 		if(!slice && update.keys){
-			keystate_update();
+#if !MATRIX_SCAN_ISR
+			keystate_scan();
+#endif
 			ledstate_update();
 			update.keys = 0;
 		}
@@ -114,6 +151,10 @@ void __attribute__((noreturn)) Keyboard_Main(void)
 			update.keys = 1;
 		}
 
+		keystate_update();
+
+		storage_job_task();
+
 		switch(current_state){
 		case STATE_NORMAL:
 			handle_state_normal();
@@ -143,6 +184,9 @@ void __attribute__((noreturn)) Keyboard_Main(void)
 		case STATE_MACRO_PLAY:
 			// macro playback is handled entirely by macros_fill_next_report()
 			break;
+		case STATE_EEWRITE:
+			// left by the completion callback of the storage job
+			break;
 		default: {
 			printing_set_buffer(CONST_MSG("Unexpected state"), CONSTANT_STORAGE);
 			current_state = STATE_PRINTING;
@@ -159,7 +203,43 @@ void __attribute__((noreturn)) Keyboard_Main(void)
 	}
 }
 
+/**
+ * Completion callback for storage jobs started by key combinations in
+ * the normal state: buzz to signal the result, and on failure print
+ * the error message left in print_buffer.
+ */
+static void storage_job_reported(bool success){
+	if(success){
+		buzzer_start_f(200, BUZZER_SUCCESS_TONE); // high buzz for success
+	}
+	else{
+		buzzer_start_f(200, BUZZER_FAILURE_TONE); // low buzz for error
+		current_state = STATE_PRINTING;
+		next_state = STATE_NORMAL;
+	}
+}
+
 static void handle_state_normal(void){
+	// Keep typing, but don't start anything new until storage has been written
+	if(storage_job_busy()){
+		return;
+	}
+
+	key_event_cursor cursor = keystate_event_cursor();
+	if(cursor == trigger_cursor){
+		// same keys as last time: nothing new to evaluate
+#if PROGRAM_SIZE > 0
+		if(held_program.valid){
+			vm_start(held_program.idx, held_program.l_key);
+		}
+#endif
+		return;
+	}
+	trigger_cursor = cursor;
+#if PROGRAM_SIZE > 0
+	held_program.valid = false;
+#endif
+
 	if(key_press_count == 0 || key_press_count > MACRO_MAX_KEYS){
 		return;
 	}
@@ -241,10 +321,22 @@ static void handle_state_normal(void){
 					bool success;
 					switch(hid_keys[0]){
 					case HID_KEYBOARD_SC_S:
-						success = config_save_layout(index);
+						// saved in the background: the job reports the result
+						if(config_save_layout(index, storage_job_reported)){
+							current_state = STATE_WAITING;
+							next_state = STATE_NORMAL;
+							return;
+						}
+						success = false;
 						break;
 					case HID_KEYBOARD_SC_L:
-						success = config_load_layout(index);
+						// loaded in the background: the job reports the result
+						if(config_load_layout(index, storage_job_reported)){
+							current_state = STATE_WAITING;
+							next_state = STATE_NORMAL;
+							return;
+						}
+						success = false;
 						break;
 					case HID_KEYBOARD_SC_D:
 						success = config_delete_layout(index);
@@ -284,7 +376,10 @@ static void handle_state_normal(void){
 		switch(md.type){
 		case PROGRAM: {
 #if PROGRAM_SIZE > 0
-			vm_start(md.data, macro_key.keys[0]); // TODO: l_key is no longer relevant, is not great to use just the first.
+			held_program.valid = true;
+			held_program.idx = md.data;
+			held_program.l_key = macro_key.keys[0]; // TODO: l_key is no longer relevant, is not great to use just the first.
+			vm_start(held_program.idx, held_program.l_key);
 #endif
 			break;
 		}
@@ -363,6 +458,14 @@ static void handle_state_programming(void){
 	}
 }
 
+#if MACROS_SIZE > 0
+// Completion callback of macros_start_macro()
+static void macro_record_started(bool success){
+	current_state = STATE_WAITING;
+	next_state = success ? STATE_MACRO_RECORD : STATE_NORMAL;
+}
+#endif
+
 static void handle_state_macro_record_trigger(){
 #if MACROS_SIZE > 0 // Allow macro recording only if there's storage for it.
 	static macro_idx_key key;
@@ -395,9 +498,8 @@ static void handle_state_macro_record_trigger(){
 		if(!valid){
 			return; // only keypad shift was pressed: keep trying to record a trigger.
 		}
-		else if(macros_start_macro(&key)){
-			current_state = STATE_WAITING;
-			next_state = STATE_MACRO_RECORD;
+		else if(macros_start_macro(&key, macro_record_started)){
+			current_state = STATE_EEWRITE;
 		}
 		else{
 #else
@@ -452,7 +554,7 @@ static void handle_state_macro_record(){
  * current state returns true if the report must be sent, false if it
  * may be compared to the previous report before sending.
  */
-void Fill_KeyboardReport(KeyboardReport_Data_t* KeyboardReport){
+void Fill_KeyboardReport(KeyboardReportBitmap* KeyboardReport){
 	switch(current_state){
 	case STATE_NORMAL:
 		keystate_Fill_KeyboardReport(KeyboardReport);
@@ -480,6 +582,46 @@ void Fill_KeyboardReport(KeyboardReport_Data_t* KeyboardReport){
 	}
 }
 
+static void fill_keyboard_bitmap(KeyboardReportBitmap* bitmap){
+	memset(bitmap, 0x0, sizeof(KeyboardReportBitmap));
+	report_state = current_state;
+	Fill_KeyboardReport(bitmap);
+	stats_press_reported();
+}
+
+/**
+ * Fills the argument buffer with a 6-key boot protocol report for the
+ * keyboard interface.
+ */
+void Fill_KeyboardHIDReport(KeyboardReport_Data_t* report){
+	KeyboardReportBitmap bitmap;
+	fill_keyboard_bitmap(&bitmap);
+	KeyboardReportBitmap_to_boot(&bitmap, report);
+}
+
+#if USB_NKRO
+/**
+ * Fills the argument buffer with a bitmap report for the NKRO interface.
+ */
+void Fill_NKROHIDReport(KeyboardReportBitmap* report){
+	fill_keyboard_bitmap(report);
+	KeyboardReportBitmap_to_nkro(report);
+}
+#endif
+
+/**
+ * Called by the USB driver when a new report filled by
+ * Fill_KeyboardHIDReport() or Fill_NKROHIDReport() has been sent on an
+ * interrupt endpoint. Not called for GET_REPORT requests or repeats of
+ * the previous report, so that states which send a sequence of reports
+ * advance once per report the host receives.
+ */
+void Complete_KeyboardHIDReport(void){
+	if(report_state == STATE_PRINTING && current_state == STATE_PRINTING){
+		printing_report_sent();
+	}
+}
+
 void Fill_MouseReport(MouseReport_Data_t* MouseReport){
 	switch(current_state){
 	case STATE_NORMAL:{
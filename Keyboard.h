@@ -67,6 +67,7 @@ typedef enum _state {
 	STATE_MACRO_RECORD_TRIGGER,
 	STATE_MACRO_RECORD,
 	STATE_MACRO_PLAY,
+	STATE_EEWRITE,   // waiting for a storage job, whose completion selects the next state
 } state;
 
 /** Interface provided to USB driver */
@@ -76,11 +77,15 @@ void __attribute__((noreturn)) Keyboard_Main(void);
 void Update_USBState(USB_State state);
 void Update_Millis(uint8_t increment);
 void Fill_MouseReport(MouseReport_Data_t* MouseReport);
-void Fill_KeyboardReport(KeyboardReport_Data_t* report);
+void Fill_KeyboardReport(KeyboardReportBitmap* report);
+void Fill_KeyboardHIDReport(KeyboardReport_Data_t* report);
+void Fill_NKROHIDReport(KeyboardReportBitmap* report);
+void Complete_KeyboardHIDReport(void);
 void Process_KeyboardLEDReport(uint8_t report);
 
 /** Buffer to hold the previously generated Keyboard/Mouse HID reports, for comparison purposes inside the HID class driver. */
 extern KeyboardReport_Data_t PrevKeyboardHIDReportBuffer;
+extern KeyboardReportBitmap PrevNKROHIDReportBuffer;
 extern MouseReport_Data_t PrevMouseHIDReportBuffer;
 
 #endif
@@ -43,6 +43,13 @@
   this software.
 */
 
+#ifdef DEBUG
+
+// standalone binary harness
+#include "config_harness.c"
+
+#else
+
 #include "config.h"
 
 #include "hardware.h"
@@ -61,6 +68,8 @@
 #include <stdlib.h>
 #include <util/delay.h>
 
+#endif
+
 // Eeprom sentinel value - if this is not set at startup, re-initialize the eeprom.
 #define EEPROM_SENTINEL 43
 uint8_t eeprom_sentinel_byte STORAGE(MAPPING_STORAGE);
@@ -71,10 +80,27 @@ configuration_flags eeprom_flags STORAGE(MAPPING_STORAGE);
 // Key configuration is stored in eeprom. If the sentinel is not valid, initialize from the defaults.
 hid_keycode logical_to_hid_map[NUM_LOGICAL_KEYS] STORAGE(MAPPING_STORAGE);
 
+#if MAPPING_CACHE
+// The mapping is consulted for every key on every scan, so a copy is kept in
+// SRAM. All writes to the stored mapping must go through to this cache (or
+// be followed by config_reload_mapping()).
+static hid_keycode logical_to_hid_cache[NUM_LOGICAL_KEYS];
+#define config_cached_definition(l_key) (logical_to_hid_cache[l_key])
+#else
+#define config_cached_definition(l_key) storage_read_byte(MAPPING_STORAGE, &logical_to_hid_map[l_key])
+#endif
+
 hid_keycode* config_get_mapping(void){
 	return &logical_to_hid_map[0];
 }
 
+void config_reload_mapping(void){
+#if MAPPING_CACHE
+	storage_read(MAPPING_STORAGE, logical_to_hid_map, logical_to_hid_cache, NUM_LOGICAL_KEYS);
+#endif
+	keystate_update_mapping();
+}
+
 // We support saving up to 10 keyboard remappings as their differences from the default.
 // These (variable sized) mappings are stored in the fixed-size buffer saved_key_mappings,
 // indexed by saved_key_mapping_indices. The buffer is kept packed (subsequent mappings
@@ -99,37 +125,73 @@ uint8_t* config_get_programs(){
 }
 
 hid_keycode config_get_definition(logical_keycode l_key){
-	return storage_read_byte(MAPPING_STORAGE, &logical_to_hid_map[l_key]);
+	return config_cached_definition(l_key);
 }
 
 hid_keycode config_get_default_definition(logical_keycode l_key){
 	return storage_read_byte(CONSTANT_STORAGE, &logical_to_hid_map_default[l_key]);
 }
 
-void config_save_definition(logical_keycode l_key, hid_keycode h_key){
+// Writes a key's definition without updating the keystate, for callers
+// writing several keys to follow with a single keystate_update_mapping()
+static void config_write_definition(logical_keycode l_key, hid_keycode h_key){
 	storage_write_byte(MAPPING_STORAGE, &logical_to_hid_map[l_key], h_key);
+#if MAPPING_CACHE
+	logical_to_hid_cache[l_key] = h_key;
+#endif
+}
+
+void config_save_definition(logical_keycode l_key, hid_keycode h_key){
+	config_write_definition(l_key, h_key);
+	keystate_update_mapping();
+}
+
+static storage_job_status config_reset_defaults_step(storage_job* job){
+	// Reset one key per step
+	if(job->cursor < NUM_LOGICAL_KEYS){
+		logical_keycode l = job->cursor++;
+		hid_keycode default_key = storage_read_byte(CONSTANT_STORAGE, &logical_to_hid_map_default[l]);
+		config_write_definition(l, default_key);
+		return STORAGE_JOB_CONTINUE;
+	}
+	keystate_update_mapping();
+
+	buzzer_start_f(200, 80); // finish at high to signify end
+	return STORAGE_JOB_DONE;
 }
 
 // reset the current layout to the default layout
-void config_reset_defaults(void){
+bool config_reset_defaults(void){
+	if(!storage_job_submit(config_reset_defaults_step, NULL)){
+		return false;
+	}
+
 	buzzer_start_f(1000, 100); // Start buzzing at low pitch
 	_delay_ms(20); // delay so that the two tones are always heard, even if no writes need be done
+	return true;
+}
 
-	for(int i = 0; i < NUM_LOGICAL_KEYS; ++i){
-		hid_keycode default_key = storage_read_byte(CONSTANT_STORAGE, &logical_to_hid_map_default[i]);
-		storage_write_byte(MAPPING_STORAGE, &logical_to_hid_map[i], default_key);
-		USB_KeepAlive(false);
-	}
+static storage_job_status config_reset_fully_step(storage_job* job){
+	// Once all reset, update the sentinel
+	storage_write_byte(MAPPING_STORAGE, &eeprom_sentinel_byte, EEPROM_SENTINEL);
 
-	buzzer_start_f(200, 80); // finish at high to signify end
+	// Higher pitched buzz to signify full reset
+	buzzer_start_f(200, 60);
+	return STORAGE_JOB_DONE;
 }
 
 // reset the keyboard, including saved layouts
-void config_reset_fully(void){
+bool config_reset_fully(void){
+	// The reset takes three jobs, which must all be queued
+	if(storage_job_busy()){
+		return false;
+	}
+
 	buzzer_start_f(2000, 120); // start buzzing low
 
 	// reset configuration flags
 	storage_write_byte(MAPPING_STORAGE, (uint8_t*)&eeprom_flags, 0x0);
+	keystate_set_debounce_mode(DEBOUNCE_DEFAULT);
 
 	// reset key mapping index
 	storage_memset(SAVED_MAPPING_STORAGE, (uint8_t*)saved_key_mapping_indices, NO_KEY, sizeof(saved_key_mapping_indices));
@@ -145,11 +207,9 @@ void config_reset_fully(void){
 	// now reset the layout and configuration defaults
 	config_reset_defaults();
 
-	// Once all reset, update the sentinel
-	storage_write_byte(MAPPING_STORAGE, &eeprom_sentinel_byte, EEPROM_SENTINEL);
-
-	// Higher pitched buzz to signify full reset
-	buzzer_start_f(200, 60);
+	// and write the sentinel once the jobs are done
+	storage_job_submit(config_reset_fully_step, NULL);
+	return true;
 }
 
 
@@ -170,6 +230,7 @@ void config_save_flags(configuration_flags state){
 	} r;
 	r.s = state;
 	storage_write_byte(MAPPING_STORAGE, (uint8_t*)&eeprom_flags, r.b);
+	keystate_set_debounce_mode(state.debounce_mode);
 }
 
 
@@ -220,90 +281,131 @@ bool config_delete_layout(uint8_t num){
 	return true;
 }
 
-bool config_save_layout(uint8_t num){
-	if(num >= NUM_KEY_MAPPING_INDICES){
-		printing_set_buffer(MSG_NO_LAYOUT, CONSTANT_STORAGE);
-		return false;
-	}
-
-	// remove old layout
-	config_delete_layout(num);
-
-	// find last offset
-	int16_t old_end = -1;
-	for(int i = 0; i < NUM_KEY_MAPPING_INDICES; ++i){
-		uint8_t i_start = storage_read_byte(SAVED_MAPPING_STORAGE, &saved_key_mapping_indices[i].start);
-		if(i_start == NO_KEY) continue;
-		uint8_t i_end = storage_read_byte(SAVED_MAPPING_STORAGE, &saved_key_mapping_indices[i].end);
-		if(i_end > old_end) old_end = i_end;
-	}
-
-	uint8_t start = (uint8_t) (old_end + 1);
-	uint8_t cursor = start;
-
-	for(logical_keycode l = 0; l < NUM_LOGICAL_KEYS; ++l){
-		hid_keycode h = storage_read_byte(MAPPING_STORAGE, &logical_to_hid_map[l]);
+static struct {
+	uint8_t num;
+	uint8_t start;  // first saved_key_mappings entry of the layout
+	uint8_t cursor; // next saved_key_mappings entry to write
+} save_layout_state;
+
+static storage_job_status config_save_layout_step(storage_job* job){
+	// Each step saves at most one key which differs from the default
+	while(job->cursor < NUM_LOGICAL_KEYS){
+		logical_keycode l = job->cursor++;
+		hid_keycode h = config_cached_definition(l);
 		hid_keycode d = storage_read_byte(CONSTANT_STORAGE, &logical_to_hid_map_default[l]);
 		if(h != d){
+			uint8_t cursor = save_layout_state.cursor;
 			if(cursor >= SAVED_MAPPING_COUNT - 1){
 				printing_set_buffer(CONST_MSG("Fail: no space"), CONSTANT_STORAGE);
-				return false; // no space!
+				return STORAGE_JOB_FAILED; // no space!
 			}
 			storage_write_byte(SAVED_MAPPING_STORAGE, &saved_key_mappings[cursor].l_key, l);
 			storage_write_byte(SAVED_MAPPING_STORAGE, &saved_key_mappings[cursor].h_key, h);
-			USB_KeepAlive(false);
-			++cursor;
+			++save_layout_state.cursor;
+			return STORAGE_JOB_CONTINUE;
 		}
 	}
+
+	uint8_t num = save_layout_state.num;
+	uint8_t start = save_layout_state.start;
+	uint8_t cursor = save_layout_state.cursor;
 	if(start != cursor){
 		storage_write_byte(SAVED_MAPPING_STORAGE, &saved_key_mapping_indices[num].start, start);
 		storage_write_byte(SAVED_MAPPING_STORAGE, &saved_key_mapping_indices[num].end,   cursor - 1);
-		return true;
+		return STORAGE_JOB_DONE;
 	}
 	else{
 		// same as default layout: nothing to save.
 		printing_set_buffer(CONST_MSG("No change"), CONSTANT_STORAGE);
-		return false;
+		return STORAGE_JOB_FAILED;
 	}
 }
 
-bool config_load_layout(uint8_t num){
+bool config_save_layout(uint8_t num, storage_job_complete complete){
 	if(num >= NUM_KEY_MAPPING_INDICES){
 		printing_set_buffer(MSG_NO_LAYOUT, CONSTANT_STORAGE);
 		return false;
 	}
 
-	uint8_t start = storage_read_byte(SAVED_MAPPING_STORAGE, &saved_key_mapping_indices[num].start);
-	if(start == NO_KEY){
-		printing_set_buffer(MSG_NO_LAYOUT, CONSTANT_STORAGE);
+	// Queue the job first, so that nothing is deleted if it can't be. It
+	// doesn't run until the next storage_job_task().
+	if(!storage_job_submit(config_save_layout_step, complete)){
 		return false;
 	}
-	uint8_t end = storage_read_byte(SAVED_MAPPING_STORAGE, &saved_key_mapping_indices[num].end);
 
-	uint8_t offset = start;
+	// remove old layout
+	config_delete_layout(num);
+
+	// find last offset
+	int16_t old_end = -1;
+	for(int i = 0; i < NUM_KEY_MAPPING_INDICES; ++i){
+		uint8_t i_start = storage_read_byte(SAVED_MAPPING_STORAGE, &saved_key_mapping_indices[i].start);
+		if(i_start == NO_KEY) continue;
+		uint8_t i_end = storage_read_byte(SAVED_MAPPING_STORAGE, &saved_key_mapping_indices[i].end);
+		if(i_end > old_end) old_end = i_end;
+	}
+
+	save_layout_state.num = num;
+	save_layout_state.start = (uint8_t) (old_end + 1);
+	save_layout_state.cursor = save_layout_state.start;
+	return true;
+}
 
-	logical_keycode next_key = storage_read_byte(SAVED_MAPPING_STORAGE, &saved_key_mappings[offset].l_key);
-	logical_keycode next_val = storage_read_byte(SAVED_MAPPING_STORAGE, &saved_key_mappings[offset].h_key);
-	++offset;
+static struct {
+	uint8_t offset;          // next saved_key_mappings entry to read
+	uint8_t end;             // last saved_key_mappings entry of the layout
+	logical_keycode next_key; // next saved key, or a key already passed if none
+	hid_keycode next_val;
+} load_layout_state;
+
+static void config_load_next_saved_key(void){
+	uint8_t offset = load_layout_state.offset;
+	if(offset <= load_layout_state.end){
+		load_layout_state.next_key = storage_read_byte(SAVED_MAPPING_STORAGE, &saved_key_mappings[offset].l_key);
+		load_layout_state.next_val = storage_read_byte(SAVED_MAPPING_STORAGE, &saved_key_mappings[offset].h_key);
+		load_layout_state.offset = offset + 1;
+	}
+}
 
-	for(logical_keycode lkey = 0; lkey < NUM_LOGICAL_KEYS; ++lkey){
-		if(lkey != next_key){
+static storage_job_status config_load_layout_step(storage_job* job){
+	// Load one key per step
+	if(job->cursor < NUM_LOGICAL_KEYS){
+		logical_keycode lkey = job->cursor++;
+		if(lkey != load_layout_state.next_key){
 			// use default
 			hid_keycode def_val = storage_read_byte(CONSTANT_STORAGE, &logical_to_hid_map_default[lkey]);
-			storage_write_byte(MAPPING_STORAGE, &logical_to_hid_map[lkey], def_val);
+			config_write_definition(lkey, def_val);
 		}
 		else{
 			// use saved
-			storage_write_byte(MAPPING_STORAGE, &logical_to_hid_map[lkey], next_val);
-			if(offset <= end){
-				next_key = storage_read_byte(SAVED_MAPPING_STORAGE, &saved_key_mappings[offset].l_key);
-				next_val = storage_read_byte(SAVED_MAPPING_STORAGE, &saved_key_mappings[offset].h_key);
-				++offset;
-			}
+			config_write_definition(lkey, load_layout_state.next_val);
+			config_load_next_saved_key();
 		}
-		USB_KeepAlive(false);
+		return STORAGE_JOB_CONTINUE;
 	}
+	keystate_update_mapping();
+	return STORAGE_JOB_DONE;
+}
 
+bool config_load_layout(uint8_t num, storage_job_complete complete){
+	if(num >= NUM_KEY_MAPPING_INDICES){
+		printing_set_buffer(MSG_NO_LAYOUT, CONSTANT_STORAGE);
+		return false;
+	}
+
+	uint8_t start = storage_read_byte(SAVED_MAPPING_STORAGE, &saved_key_mapping_indices[num].start);
+	if(start == NO_KEY){
+		printing_set_buffer(MSG_NO_LAYOUT, CONSTANT_STORAGE);
+		return false;
+	}
+
+	if(!storage_job_submit(config_load_layout_step, complete)){
+		return false;
+	}
+
+	load_layout_state.offset = start;
+	load_layout_state.end = storage_read_byte(SAVED_MAPPING_STORAGE, &saved_key_mapping_indices[num].end);
+	config_load_next_saved_key();
 	return true;
 }
 
@@ -322,6 +424,17 @@ const program* config_get_program(uint8_t idx){
 	return (const program*) &programs_data[program_offset];
 }
 
+uint16_t config_get_program_length(uint8_t idx){
+	uint16_t program_len;
+	if(-1 == storage_read(PROGRAM_STORAGE,
+						  (uint8_t*)&programs_index[idx].len,
+						  (uint8_t*)&program_len,
+						  sizeof(uint16_t))){
+		return 0;
+	}
+	return program_len;
+}
+
 void config_reset_program_defaults(){
 	// reset program index
 	uint8_t sz = PROGRAM_COUNT * sizeof(program_idx);
@@ -333,4 +446,6 @@ void config_init(void){
 	if(sentinel != EEPROM_SENTINEL){
 		config_reset_fully();
 	}
+	config_reload_mapping();
+	keystate_set_debounce_mode(config_get_flags().debounce_mode);
 }
@@ -48,26 +48,37 @@
 
 #include "hardware.h"
 #include "keystate.h"
+#include "storage.h"
 
 // Configuration is saved in the eeprom
 typedef struct _configuration_flags {
 	unsigned char key_sound_enabled:1;
-	unsigned char packing:7;
+	unsigned char debounce_mode:2; // debounce_mode_t
+	unsigned char packing:5;
 } configuration_flags;
 
 // returns eeprom address of logical_to_hid_map
 hid_keycode* config_get_mapping(void);
 
+// re-reads the SRAM copy of the mapping after it has been written directly
+void config_reload_mapping(void);
+
 hid_keycode config_get_definition(logical_keycode l_key);
 hid_keycode config_get_default_definition(logical_keycode l_key);
 void config_save_definition(logical_keycode l_key, hid_keycode h_key);
 
 void config_init(void);
-void config_reset_defaults(void);
-void config_reset_fully(void);
+
+// queue storage jobs to reset the layout, or everything. Return false if
+// the jobs could not be queued: a full reset needs the queue to be empty.
+bool config_reset_defaults(void);
+bool config_reset_fully(void);
 bool config_delete_layout(uint8_t num);
-bool config_save_layout(uint8_t num);
-bool config_load_layout(uint8_t num);
+
+// queue a storage job to save or load the layout, which calls complete
+// when done. Return false if the job could not be started.
+bool config_save_layout(uint8_t num, storage_job_complete complete);
+bool config_load_layout(uint8_t num, storage_job_complete complete);
 
 configuration_flags config_get_flags(void);
 void config_save_flags(configuration_flags state);
@@ -76,6 +87,7 @@ uint8_t* config_get_programs(void);
 
 struct _program;
 const struct _program* config_get_program(uint8_t idx);
+uint16_t config_get_program_length(uint8_t idx);
 void config_reset_program_defaults(void);
 
 #endif // __CONFIG_H
@@ -0,0 +1,217 @@
+// Fake API for test harness. Build with
+//   gcc -DDEBUG -std=gnu99 -fshort-enums -o config config.c
+// and run "config" to check that the SRAM copy of the mapping follows
+// every write to the stored mapping, and to count the storage reads made
+// by the mapping lookups of a simulated typing session.
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+// config.h's own includes are replaced by the definitions below
+#define __HARDWARE_H
+#define __KEYSTATE_H
+#define __STORAGE_H
+
+#define NUM_LOGICAL_KEYS 172
+#define SAVED_MAPPING_COUNT 256
+#define PROGRAM_SIZE 1024
+#define PROGRAM_COUNT 6
+#define NO_KEY 0xFF
+#define MAPPING_CACHE 1
+#define PROGMEM
+
+typedef uint8_t hid_keycode;
+typedef uint8_t logical_keycode;
+typedef struct _program program;
+
+typedef enum _debounce_mode_t { DEBOUNCE_DEFAULT = 0 } debounce_mode_t;
+
+// fake storage: every storage type is plain memory, with reads counted
+static unsigned long harness_reads = 0;
+
+#define STORAGE(storage_type)
+#define storage_read(storage_type, addr, buf, len) harness_read(addr, buf, len)
+#define storage_read_byte(storage_type, addr) (++harness_reads, *(addr))
+#define storage_write_byte(storage_type, dst, b) (*(dst) = (b))
+#define storage_memset(storage_type, dst, c, len) memset(dst, c, len)
+
+typedef enum _storage_type { sram } storage_type;
+#define CONSTANT_STORAGE sram
+
+static int16_t harness_read(const void* addr, void* buf, int16_t len){
+	++harness_reads;
+	memcpy(buf, addr, len);
+	return len;
+}
+
+typedef enum _storage_job_status {
+	STORAGE_JOB_CONTINUE,
+	STORAGE_JOB_DONE,
+	STORAGE_JOB_FAILED,
+} storage_job_status;
+
+typedef struct _storage_job storage_job;
+typedef storage_job_status (*storage_job_step)(storage_job* job);
+typedef void (*storage_job_complete)(bool success);
+
+struct _storage_job {
+	storage_job_step step;
+	storage_job_complete complete;
+	uint16_t cursor;
+};
+
+// the job queue, run to completion by harness_finish_jobs()
+#define HARNESS_JOB_COUNT 4
+static storage_job harness_jobs[HARNESS_JOB_COUNT];
+static uint8_t harness_job_count = 0;
+
+bool storage_job_submit(storage_job_step step, storage_job_complete complete){
+	if(harness_job_count == HARNESS_JOB_COUNT) return false;
+	storage_job* job = &harness_jobs[harness_job_count++];
+	job->step = step;
+	job->complete = complete;
+	job->cursor = 0;
+	return true;
+}
+
+bool storage_job_busy(void){
+	return harness_job_count != 0;
+}
+
+static void harness_finish_jobs(void){
+	// completions may queue more jobs behind the one that's finishing
+	while(harness_job_count){
+		storage_job* job = &harness_jobs[0];
+		storage_job_status s;
+		while((s = job->step(job)) == STORAGE_JOB_CONTINUE);
+		storage_job_complete complete = job->complete;
+		memmove(&harness_jobs[0], &harness_jobs[1], --harness_job_count * sizeof(storage_job));
+		if(complete) complete(s == STORAGE_JOB_DONE);
+	}
+}
+
+// counts the keystate recomputes made for mapping changes
+static unsigned long harness_mapping_updates = 0;
+void keystate_update_mapping(void){ ++harness_mapping_updates; }
+void keystate_set_debounce_mode(debounce_mode_t mode){}
+void buzzer_start_f(uint16_t ms, uint8_t freq){}
+void USB_KeepAlive(bool poll){}
+bool macro_idx_reset_defaults(void){ return true; }
+void macros_reset_defaults(void){}
+static void _delay_ms(double ms){}
+
+#define CONST_MSG(x) (x)
+void printing_set_buffer(const char* buf, storage_type typ){
+	printf("Message: %s\n", buf);
+}
+
+const hid_keycode logical_to_hid_map_default[NUM_LOGICAL_KEYS] = {
+#define D(x) (4 + (x) % 0x60)
+#define D8(x) D(x), D(x + 1), D(x + 2), D(x + 3), D(x + 4), D(x + 5), D(x + 6), D(x + 7)
+	D8(0), D8(8), D8(16), D8(24), D8(32), D8(40), D8(48), D8(56), D8(64), D8(72), D8(80),
+	D8(88), D8(96), D8(104), D8(112), D8(120), D8(128), D8(136), D8(144), D8(152), D8(160),
+	D(168), D(169), D(170), D(171)
+#undef D8
+#undef D
+};
+
+#include "config.h"
+
+static void check_mapping(const char* after){
+	hid_keycode* stored = config_get_mapping();
+	for(int i = 0; i < NUM_LOGICAL_KEYS; ++i){
+		if(config_get_definition(i) != stored[i]){
+			printf("FAIL: after %s, key %d maps to %d but %d is stored\n",
+				   after, i, config_get_definition(i), stored[i]);
+			exit(1);
+		}
+	}
+	printf("ok: mapping copy matches storage after %s\n", after);
+}
+
+// The lookup made before the mapping was cached
+static hid_keycode uncached_definition(logical_keycode l_key){
+	return storage_read_byte(MAPPING_STORAGE, &config_get_mapping()[l_key]);
+}
+
+#define SCANS 100000
+#define MAX_HELD 6
+
+// Simulates typing: each scan looks up every held key (as the report
+// fill does) and every key that changed state (as keystate_update_cell
+// and the keypad layer do), and returns the number of storage reads.
+static unsigned long typing_session(hid_keycode (*lookup)(logical_keycode)){
+	logical_keycode held[MAX_HELD];
+	uint8_t nheld = 0;
+	uint32_t seed = 1;
+	volatile hid_keycode sink;
+
+	harness_reads = 0;
+	for(long scan = 0; scan < SCANS; ++scan){
+		seed = seed * 1103515245 + 12345;
+		uint8_t r = (seed >> 16) & 0xff;
+		if(r < 8 && nheld < MAX_HELD){
+			held[nheld] = (seed >> 24) % NUM_LOGICAL_KEYS;
+			sink = lookup(held[nheld++]);
+		}
+		else if(r >= 248 && nheld){
+			sink = lookup(held[--nheld]);
+		}
+		for(uint8_t i = 0; i < nheld; ++i){
+			sink = lookup(held[i]);
+		}
+	}
+	(void) sink;
+	return harness_reads;
+}
+
+int main(int argc, const char** argv){
+	config_init();
+	harness_finish_jobs();
+	check_mapping("config_init");
+
+	config_save_definition(3, 0x42);
+	check_mapping("config_save_definition");
+
+	if(!config_save_layout(0, NULL)){
+		printf("FAIL: could not save layout\n");
+		exit(1);
+	}
+	harness_finish_jobs();
+	config_reset_defaults();
+	harness_finish_jobs();
+	check_mapping("config_reset_defaults");
+	if(config_get_definition(3) == 0x42){
+		printf("FAIL: config_reset_defaults did not restore key 3\n");
+		exit(1);
+	}
+
+	unsigned long updates = harness_mapping_updates;
+	if(!config_load_layout(0, NULL)){
+		printf("FAIL: could not load layout\n");
+		exit(1);
+	}
+	harness_finish_jobs();
+	check_mapping("config_load_layout");
+	if(harness_mapping_updates - updates != 1){
+		printf("FAIL: config_load_layout updated the keystate %lu times\n", harness_mapping_updates - updates);
+		exit(1);
+	}
+	if(config_get_definition(3) != 0x42){
+		printf("FAIL: config_load_layout did not restore key 3\n");
+		exit(1);
+	}
+
+	config_get_mapping()[5] = 0x43; // as the WRITE_MAPPING vendor request
+	config_reload_mapping();
+	check_mapping("config_reload_mapping");
+
+	unsigned long before = typing_session(&uncached_definition);
+	unsigned long after = typing_session(&config_get_definition);
+	printf("storage reads per scan: %.3f from storage, %.3f from the SRAM copy\n",
+		   (double) before / SCANS, (double) after / SCANS);
+	return 0;
+}
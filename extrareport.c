@@ -108,23 +108,55 @@ void ExtraKeyboardReport_toggle(ExtraKeyboardReport* r, hid_keycode key){
 	}
 }
 
-void ExtraKeyboardReport_append(ExtraKeyboardReport* extra, KeyboardReport_Data_t* report){
-	// find free slots in the report
-	uint8_t report_next, report_start;
-	for(report_next = 0; report_next < KEYBOARDREPORT_KEY_COUNT && report->KeyCode[report_next]; ++report_next);
-	report_start = report_next;
-
+void ExtraKeyboardReport_append(ExtraKeyboardReport* extra, KeyboardReportBitmap* report){
 	// add in modifier keys
 	report->Modifier |= extra->modifiers;
 
-	// as long as there are free slots, add in keys from extra report that are not already present.
-	for(uint8_t k = 0; report_next < KEYBOARDREPORT_KEY_COUNT && k < EXTRA_REPORT_KEY_COUNT; ++k){
-		hid_keycode keycode = extra->keys[k];
-		if(keycode == NO_KEY) continue;
-		for(uint8_t j = 0; j < report_start; ++j){
-			if(report->KeyCode[j] == keycode) goto next_vk; // already pressed: labelled-continue
+	// and the keys: keys already pressed in the report are unaffected
+	for(uint8_t k = 0; k < EXTRA_REPORT_KEY_COUNT; ++k){
+		KeyboardReportBitmap_add(report, extra->keys[k]);
+	}
+}
+
+void KeyboardReportBitmap_add(KeyboardReportBitmap* r, hid_keycode key){
+	if(key == 0 || key >= SPECIAL_HID_KEYS_START){
+		return; // no output for empty or special keys
+	}
+	else if(key >= HID_KEYBOARD_SC_LEFT_CONTROL){
+		r->Modifier |= 1 << (key - HID_KEYBOARD_SC_LEFT_CONTROL);
+	}
+	else{
+		r->Keys[key >> 3] |= 1 << (key & 0x7);
+	}
+}
+
+#define ROLLOVER_BIT (1 << HID_KEYBOARD_SC_ERROR_ROLLOVER)
+
+void KeyboardReportBitmap_to_boot(const KeyboardReportBitmap* r, KeyboardReport_Data_t* report){
+	report->Modifier = r->Modifier;
+	report->Reserved = 0;
+	memset(report->KeyCode, 0, KEYBOARDREPORT_KEY_COUNT);
+
+	if(r->Keys[0] & ROLLOVER_BIT) goto rollover;
+
+	uint8_t used = 0;
+	for(uint8_t i = 0; i < KEYBOARDBITMAP_SIZE; ++i){
+		uint8_t bits = r->Keys[i];
+		for(uint8_t j = 0; bits; ++j, bits >>= 1){
+			if(!(bits & 1)) continue;
+			if(used == KEYBOARDREPORT_KEY_COUNT) goto rollover;
+			report->KeyCode[used++] = (i << 3) | j;
 		}
-		report->KeyCode[report_next++] = keycode;
-	next_vk:;
+	}
+	return;
+
+ rollover:
+	memset(report->KeyCode, HID_KEYBOARD_SC_ERROR_ROLLOVER, KEYBOARDREPORT_KEY_COUNT);
+}
+
+void KeyboardReportBitmap_to_nkro(KeyboardReportBitmap* r){
+	if(r->Keys[0] & ROLLOVER_BIT){
+		memset(r->Keys, 0, KEYBOARDBITMAP_SIZE);
+		r->Keys[0] = ROLLOVER_BIT;
 	}
 }
@@ -59,6 +59,20 @@ void ExtraKeyboardReport_clear(ExtraKeyboardReport* r);
 void ExtraKeyboardReport_add(ExtraKeyboardReport* r, hid_keycode key);
 void ExtraKeyboardReport_remove(ExtraKeyboardReport* r, hid_keycode key);
 void ExtraKeyboardReport_toggle(ExtraKeyboardReport* r, hid_keycode key);
-void ExtraKeyboardReport_append(ExtraKeyboardReport* extra, KeyboardReport_Data_t* report);
+void ExtraKeyboardReport_append(ExtraKeyboardReport* extra, KeyboardReportBitmap* report);
+
+void KeyboardReportBitmap_add(KeyboardReportBitmap* r, hid_keycode key);
+
+/**
+ * Convert a composed key bitmap to the 6-key boot protocol report,
+ * reporting ERROR_ROLLOVER if too many keys are pressed.
+ */
+void KeyboardReportBitmap_to_boot(const KeyboardReportBitmap* r, KeyboardReport_Data_t* report);
+
+/**
+ * Prepare a composed key bitmap for sending as the NKRO report: if
+ * ERROR_ROLLOVER is set, no other keys are reported.
+ */
+void KeyboardReportBitmap_to_nkro(KeyboardReportBitmap* r);
 
 #endif // __EXTRAREPORT_H
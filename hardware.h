@@ -117,4 +117,48 @@
 #error "Program interpreter count not defined"
 #endif
 
+// Keep a copy of the key mapping in SRAM (NUM_LOGICAL_KEYS bytes), rather
+// than reading the mapping storage for each lookup. Layout loads update
+// the keystate once either way.
+#ifndef MAPPING_CACHE
+#define MAPPING_CACHE 1
+#endif
+
+// Slots in the SRAM macro trigger lookup table, two bytes each: a power of
+// two greater than MACRO_INDEX_COUNT. Defaults to at least twice
+// MACRO_INDEX_COUNT; fuller tables take longer to search.
+// #define MACRO_INDEX_HASH_SIZE
+
+// Size of the key event ring, six bytes per event: a power of two <= 128.
+#ifndef KEY_EVENT_COUNT
+#define KEY_EVENT_COUNT 16
+#endif
+
+// Size in bytes of the SRAM arena into which running programs are
+// copied if they fit. Of programs that don't, only the largest loop (or
+// the method containing it) that fits is copied, and the rest is run
+// from storage.
+#ifndef PROGRAM_ARENA_SIZE
+#define PROGRAM_ARENA_SIZE 0
+#endif
+
+// Each main loop pass, each running program executes up to this many
+// instructions, stopping early when it blocks...
+#ifndef PROGRAM_SLICE_INSTRUCTIONS
+#define PROGRAM_SLICE_INSTRUCTIONS 16
+#endif
+
+// ...or when all programs together have run for this many Timer1
+// ticks (F_CPU/64), so that matrix scanning and USB aren't starved.
+#ifndef PROGRAM_SLICE_TICKS
+#define PROGRAM_SLICE_TICKS (F_CPU / 64000 / 2) // 0.5ms
+#endif
+
+// Dispatch program instructions through a table of label addresses
+// (a GCC extension, costing 512 bytes of flash) instead of a switch.
+// Off unless interpreter_harness.c's simavr benchmark shows it's faster.
+#ifndef VM_THREADED_DISPATCH
+#define VM_THREADED_DISPATCH 0
+#endif
+
 #endif // __HARDWARE_H
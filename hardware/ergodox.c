@@ -226,37 +226,7 @@ const hid_keycode logical_to_hid_map_default[NUM_LOGICAL_KEYS] PROGMEM = {
 	HID_KEYBOARD_SC_SPACE,							   //	LOGICAL_KEY_KP_SPACE,
 };
 
-#define twi_write_byte_checked(x) if(ACK != twi_write_byte(x)) goto err;
-
-static uint8_t init_mcp23018(void){
-	// Set up IO direction
-	// Rows (output direction) are GPA 0-6
-	// Columns (input direction) are GPB0-5
-	twi_start();
-	twi_write_byte_checked(MCP23018_ADDR | MCP23018_WRITE);
-	twi_write_byte(MCP23018_IODIRA);
-	twi_write_byte(0b10000000); // A0-6 output
-	twi_stop(WAIT);
-
-	// set up pull-up registers on input columns
-	twi_start();
-	twi_write_byte_checked(MCP23018_ADDR | MCP23018_WRITE);
-	twi_write_byte(MCP23018_GPPUB);
-	twi_write_byte(0b00111111); // pull-ups on on inputs
-	twi_stop(WAIT);
-
-	// set up outputs to high-z
-	twi_start();
-	twi_write_byte_checked(MCP23018_ADDR | MCP23018_WRITE);
-	twi_write_byte(MCP23018_OLATA);
-	twi_write_byte(0b01111111);
-	twi_stop(WAIT);
-
-	return 1;
- err:
-	twi_stop(NOWAIT);
-	return 0;
-}
+static void mcp_scan_init(void);
 
 void ports_init(void){
 	// Set up input
@@ -293,12 +263,180 @@ void ports_init(void){
 	DDRD  |= (1<<6);  // output
 	PORTD &= ~(1<<6); // off
 
-	// initialize the MCP23018
-	init_mcp23018();
+	// The MCP23018 is initialized by the first scan
+	mcp_scan_init();
 }
 
+// The left hand side is read through the MCP23018 by queued TWI
+// transactions, run from the TWI interrupt while the main loop continues.
+//
+// While no key on the left is pressed, all of its rows are driven low and
+// the expander flags any column which differs from its released state in
+// INTFB, so each scan only needs to read INTFB. Once a flag is seen, and
+// for as long as any key is pressed, every row is selected and read in a
+// single bus transaction. A key pressed after a row has been read is still
+// flagged when the rows are driven low again, so the left hand side can go
+// back to idle as soon as every row reads released.
+//
+// matrix_read_row() returns the most recently read columns, so the left
+// hand side may lag the right by up to one scan.
+#define MCP_COLUMNS_RELEASED 0b00111111
+
+typedef enum _mcp_state { MCP_UNINITIALIZED, MCP_IDLE, MCP_ACTIVE } mcp_state;
+
+static volatile mcp_state mcp_scan_state = MCP_UNINITIALIZED;
+static volatile bool mcp_scanning = false; // the current scan's transactions are queued
+
+// Registers IODIRA to GPPUB, written in one sequential transaction
+static const uint8_t mcp_config[] = {
+	MCP23018_IODIRA,
+	0b10000000,           // IODIRA: rows GPA0-6 are outputs
+	0b11111111,           // IODIRB: columns GPB0-5 are inputs
+	0, 0,                 // IPOLA, IPOLB
+	0,                    // GPINTENA
+	MCP_COLUMNS_RELEASED, // GPINTENB: flag the columns when they differ...
+	0,                    // DEFVALA
+	MCP_COLUMNS_RELEASED, // DEFVALB: ...from released
+	0,                    // INTCONA
+	MCP_COLUMNS_RELEASED, // INTCONB
+	0, 0,                 // IOCON: bank 0, sequential, flags cleared by reading GPIO
+	0,                    // GPPUA
+	MCP_COLUMNS_RELEASED, // GPPUB: pull-ups on on input columns
+};
+
+static const uint8_t mcp_all_rows[2] = { MCP23018_GPIOA, 0 }; // drive every row low
+static const uint8_t mcp_intf_reg = MCP23018_INTFB;
+static uint8_t mcp_intf;
+
+static twi_transaction mcp_config_txn;
+static twi_transaction mcp_idle_txn;
+static twi_transaction mcp_poll_txn;
+static twi_transaction mcp_row_txns[MATRIX_ROWS];
+static uint8_t mcp_row_select[MATRIX_ROWS][2];
+
 // Init high
-static uint8_t cached_mcp_columns = 0b00111111;
+static volatile uint8_t mcp_columns[MATRIX_ROWS] = {
+	MCP_COLUMNS_RELEASED, MCP_COLUMNS_RELEASED, MCP_COLUMNS_RELEASED, MCP_COLUMNS_RELEASED,
+	MCP_COLUMNS_RELEASED, MCP_COLUMNS_RELEASED, MCP_COLUMNS_RELEASED
+};
+
+static uint8_t selected_row = 0;
+
+// The MCP23018 isn't responding (e.g. the left hand side is unplugged):
+// report its keys as released and reinitialize it on the next scan.
+static void mcp_failed(void){
+	for(uint8_t row = 0; row < MATRIX_ROWS; ++row){
+		mcp_columns[row] = MCP_COLUMNS_RELEASED;
+	}
+	mcp_scan_state = MCP_UNINITIALIZED;
+}
+
+// Transaction callbacks, called from the TWI interrupt
+
+static void mcp_idle_complete(twi_transaction* t){
+	if(t->status == TWI_SUCCESS){
+		mcp_scan_state = MCP_IDLE;
+	}
+	else{
+		mcp_failed();
+	}
+	mcp_scanning = false;
+}
+
+static void mcp_poll_complete(twi_transaction* t){
+	if(t->status != TWI_SUCCESS){
+		mcp_failed();
+	}
+	else if(mcp_intf){
+		// A key has been pressed: read the rows straight away
+		mcp_scan_state = MCP_ACTIVE;
+		for(uint8_t row = 0; row < MATRIX_ROWS; ++row){
+			twi_submit(&mcp_row_txns[row]);
+		}
+		return;
+	}
+	mcp_scanning = false;
+}
+
+static void mcp_row_complete(twi_transaction* t){
+	if(t->status != TWI_SUCCESS){
+		mcp_failed();
+	}
+	if(t != &mcp_row_txns[MATRIX_ROWS - 1]){
+		return;
+	}
+
+	// All rows read: if nothing is pressed, go back to idle
+	if(mcp_scan_state == MCP_ACTIVE){
+		bool released = true;
+		for(uint8_t row = 0; row < MATRIX_ROWS; ++row){
+			if(mcp_columns[row] != MCP_COLUMNS_RELEASED) released = false;
+		}
+		if(released){
+			twi_submit(&mcp_idle_txn);
+			return;
+		}
+	}
+	mcp_scanning = false;
+}
+
+static void mcp_scan_init(void){
+	// (Re)initialization is followed by driving every row low for idle
+	mcp_config_txn.address = MCP23018_ADDR | MCP23018_WRITE;
+	mcp_config_txn.write_buf = mcp_config;
+	mcp_config_txn.write_len = sizeof(mcp_config);
+	mcp_config_txn.hold = true;
+
+	mcp_idle_txn.address = MCP23018_ADDR | MCP23018_WRITE;
+	mcp_idle_txn.write_buf = mcp_all_rows;
+	mcp_idle_txn.write_len = sizeof(mcp_all_rows);
+	mcp_idle_txn.callback = mcp_idle_complete;
+
+	mcp_poll_txn.address = MCP23018_ADDR | MCP23018_WRITE;
+	mcp_poll_txn.write_buf = &mcp_intf_reg;
+	mcp_poll_txn.write_len = 1;
+	mcp_poll_txn.read_buf = &mcp_intf;
+	mcp_poll_txn.read_len = 1;
+	mcp_poll_txn.callback = mcp_poll_complete;
+
+	for(uint8_t row = 0; row < MATRIX_ROWS; ++row){
+		// Write GPIOA to select the row, after which the register address
+		// has advanced to GPIOB: read it back for the columns.
+		mcp_row_select[row][0] = MCP23018_GPIOA;
+		mcp_row_select[row][1] = 0xFF & ~(1 << row);
+
+		twi_transaction* t = &mcp_row_txns[row];
+		t->address = MCP23018_ADDR | MCP23018_WRITE;
+		t->write_buf = mcp_row_select[row];
+		t->write_len = 2;
+		t->read_buf = (uint8_t*) &mcp_columns[row];
+		t->read_len = 1;
+		t->hold = (row != MATRIX_ROWS - 1);
+		t->callback = mcp_row_complete;
+	}
+}
+
+static void mcp_scan_start(void){
+	if(mcp_scanning){
+		return; // previous scan still in progress
+	}
+	mcp_scanning = true;
+
+	switch(mcp_scan_state){
+	case MCP_UNINITIALIZED:
+		twi_submit(&mcp_config_txn);
+		twi_submit(&mcp_idle_txn);
+		break;
+	case MCP_IDLE:
+		twi_submit(&mcp_poll_txn);
+		break;
+	case MCP_ACTIVE:
+		for(uint8_t row = 0; row < MATRIX_ROWS; ++row){
+			twi_submit(&mcp_row_txns[row]);
+		}
+		break;
+	}
+}
 
 void matrix_select_row(uint8_t matrix_row){
 	// Set on right hand side
@@ -319,44 +457,23 @@ void matrix_select_row(uint8_t matrix_row){
 		RIGHT_MATRIX_OUT_3_DDR |= RIGHT_MATRIX_OUT_3_MASK;
 	}
 
-	// Set on left hand side
-	if(matrix_row == 0){
-		init_mcp23018(); // reinitialize the MCP23018: it may have been unplugged
+	// Left hand side: start the next scan when a new scan starts here
+	if(matrix_row <= selected_row){
+		mcp_scan_start();
 	}
+	selected_row = matrix_row;
+}
 
-	twi_start();
-	twi_write_byte_checked(MCP23018_ADDR | MCP23018_WRITE);
-	twi_write_byte(MCP23018_GPIOA);
-	twi_write_byte(0xFF & ~(1 << matrix_row));
+matrix_row_bits matrix_read_row(void){
+	// Right hand side: columns 0-5, with a hole in the input port between
+	// bits 1 and 4.
+	uint8_t right = ~RIGHT_MATRIX_IN_PIN & RIGHT_MATRIX_IN_MASK;
+	right = (right & 0x3) | (right >> 2);
 
-	twi_start();
-	twi_write_byte_checked(MCP23018_ADDR | MCP23018_READ);
-	cached_mcp_columns = twi_read_byte(NACK);
-	twi_stop(WAIT);
+	// Left hand side: columns 6-11 via the io expander
+	uint8_t left = ~mcp_columns[selected_row] & 0x3F;
 
-	return;
- err:
-	twi_stop(NOWAIT);
-}
-
-uint8_t matrix_read_column(uint8_t matrix_column){
-	if(matrix_column < 6){
-		// Right hand side
-		uint8_t shift = matrix_column;
-		if(shift > 1){
-			shift += 2; // Handle hole in input port
-		}
-		uint8_t val = (RIGHT_MATRIX_IN_PIN & (1<<shift)) == 0;
-		return val;
-	}
-	else{
-		uint8_t shift = matrix_column - 6;
-		uint8_t val = (cached_mcp_columns & (1<<shift)) == 0;
-		/* if(matrix_column == 7) */
-			return val; // temporarily: this column includes 'q' if row 2
-		/* else */
-			/* return 0; */
-	}
+	return ((matrix_row_bits)left << 6) | right;
 }
 
 
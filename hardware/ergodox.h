@@ -84,8 +84,12 @@
 	#define PROGRAM_STORAGE            i2c_eeprom
 	#define PROGRAM_SIZE               1024
 	#define PROGRAM_COUNT              6
+	#define PROGRAM_ARENA_SIZE         128
+	#define MACRO_INDEX_HASH_SIZE      64           // for 50 entries
 #endif
 
+#define KEY_EVENT_COUNT            8
+
 #define NUM_PHYSICAL_KEYS 76
 #define NUM_LOGICAL_KEYS  NUM_PHYSICAL_KEYS * 2
 #define KEYPAD_LAYER_SIZE NUM_PHYSICAL_KEYS
@@ -100,6 +104,8 @@
 #define MATRIX_COLS 12 // 6 on lhs, 6 on rhs via io expander
 #define MATRIX_ROWS 7  // 7 on each side driven synchronously
 
+typedef uint16_t matrix_row_bits; // one bit per column
+
 // Logical keys we have: logical keys represent a key-position+keypad-layer combination.
 enum logical_keys {
 	// Main key blocks
@@ -275,8 +281,13 @@ extern const hid_keycode logical_to_hid_map_default[NUM_LOGICAL_KEYS] PROGMEM;
 
 #define MCP23018_IODIRA 0x00  // ~ DDR
 #define MCP23018_IODIRB 0x01
+#define MCP23018_GPINTENB 0x05 // interrupt-on-change enable
+#define MCP23018_DEFVALB  0x07 // interrupt-on-change compare value
+#define MCP23018_INTCONB  0x09 // interrupt-on-change against DEFVAL (1) or previous value (0)
 #define MCP23018_GPPUA  0x0C  // pull-up config
 #define MCP23018_GPPUB  0x0D
+#define MCP23018_INTFB  0x0F  // interrupt flags
+#define MCP23018_INTCAPB 0x11 // port value captured at interrupt
 #define MCP23018_GPIOA  0x12  // ~ PIN
 #define MCP23018_GPIOB  0x13
 #define MCP23018_OLATA  0x14  // ~ PORT
@@ -286,10 +297,20 @@ extern const hid_keycode logical_to_hid_map_default[NUM_LOGICAL_KEYS] PROGMEM;
 void ports_init(void);
 
 /**
- * Gets the current physical input for a given physical position
+ * Selects a matrix row, then gets the current physical input for each column
+ * of that row as a bitmask (bit n set if column n is pressed)
  */
 void matrix_select_row(uint8_t matrix_row);
-uint8_t matrix_read_column(uint8_t matrix_column);
+matrix_row_bits matrix_read_row(void);
+
+// Default debounce algorithm and its parameters: see keystate.h
+#define DEBOUNCE_DEFAULT_MODE DEBOUNCE_DEFERRED
+#define DEBOUNCE_SAMPLES 3 // consecutive readings
+#define DEBOUNCE_MS 6      // at most 255
+
+// The left half is read over the TWI bus, which is shared with the external
+// eeprom, so the matrix must be scanned from the main loop.
+#define MATRIX_SCAN_ISR 0
 
 /* Macros: */
 /** LED mask for the library LED driver, to indicate that the USB interface is not ready. */
@@ -42,6 +42,7 @@
 */
 
 #include <util/delay.h>     /* for _delay_ms() */
+#include <avr/interrupt.h>
 #include "twi.h"
 
 #define KEY_NONE NO_KEY
@@ -277,6 +278,34 @@ void ports_init(void){
 }
 
 
+#if MATRIX_SCAN_ISR
+
+#define MATRIX_SCAN_TIMER_TICKS ((F_CPU / 256) * MATRIX_SCAN_INTERVAL_US / 1000000)
+#if MATRIX_SCAN_TIMER_TICKS < 1 || MATRIX_SCAN_TIMER_TICKS > 256
+#error "MATRIX_SCAN_INTERVAL_US out of range for Timer0"
+#endif
+
+void matrix_scan_timer_start(void){
+	// Timer0 in CTC mode at clk/256
+	OCR0  = MATRIX_SCAN_TIMER_TICKS - 1;
+	TCNT0 = 0;
+	TCCR0 = (1<<WGM01) | (1<<CS02);
+	TIMSK |= (1<<OCIE0);
+}
+
+// V-USB requires that its interrupt is never delayed for long, so the scan
+// runs with interrupts enabled. Mask our own interrupt meanwhile so that the
+// scan can't reenter itself.
+ISR(TIMER0_COMP_vect){
+	TIMSK &= ~(1<<OCIE0);
+	sei();
+	keystate_scan();
+	cli();
+	TIMSK |= (1<<OCIE0);
+}
+
+#endif // MATRIX_SCAN_ISR
+
 void matrix_select_row(uint8_t matrix_row){
 	// Select output using four bits starting at MATRIX_SELECT_A
 	// set output with MATRIX_DDR - 0 means high (high-z input, external pullup), 1 means low (output low, current sink)
@@ -299,28 +328,18 @@ void matrix_select_row(uint8_t matrix_row){
 }
 
 
-uint8_t matrix_read_column(uint8_t matrix_column){
-	/*
-	if(matrix_column >= MATRIX_COLS){
-		panic();
-	}
-	*/
-
-	if(matrix_column == 0){
-		// read pin5
-		uint8_t val = (INPUT_PIN5_PIN & INPUT_PIN5) == 0; // if high, button not pressed, if low, button pressed
-		return val;
-	}
-	else if(matrix_column == 1){
-		// read pin6
-		uint8_t val = (INPUT_PIN6_PIN & INPUT_PIN6) == 0; // if high, button not pressed, if low, button pressed
-		return val;
+matrix_row_bits matrix_read_row(void){
+	// Inputs are high if button not pressed, low if button pressed.
+	// Column 0 is pin5, column 1 is pin6, and the remaining columns are the
+	// eight INPUT_REST pins.
+	matrix_row_bits val = (matrix_row_bits)(uint8_t)~INPUT_REST_PIN << 2;
+	if((INPUT_PIN5_PIN & INPUT_PIN5) == 0){
+		val |= 0x1;
 	}
-	else{
-		uint8_t shift = matrix_column - 2;
-		uint8_t val = (INPUT_REST_PIN & (1<<shift)) == 0;
-		return val;
+	if((INPUT_PIN6_PIN & INPUT_PIN6) == 0){
+		val |= 0x2;
 	}
+	return val;
 }
 
 void set_all_leds(uint8_t led_mask){
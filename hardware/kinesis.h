@@ -73,6 +73,13 @@
 #define PROGRAM_SIZE               1024
 #define PROGRAM_COUNT              6
 
+/* SRAM budget: the atmega32 has only 2KB, most of it the VMs' stacks */
+#define MAPPING_CACHE              0            // scans read the mapping from internal eeprom, which is cheap
+#define MACRO_INDEX_HASH_SIZE      64           // for 50 entries
+#define KEY_EVENT_COUNT            8
+#define I2C_EEPROM_CACHE_LINES     2
+#define PROGRAM_ARENA_SIZE         0            // programs run from the external eeprom's read cache
+
 /* Kinesis Matrix */
 
 // The Kinesis has few physical keys, so has a "keypad layer" toggle
@@ -86,6 +93,8 @@
 #define MATRIX_COLS 10 // 8 demultiplexer selected matrix columns, and two direct button inputs (pins 5 and 6)
 #define MATRIX_ROWS 16 // 2 74LS138 1-of-8 demultiplexers
 
+typedef uint16_t matrix_row_bits; // one bit per column
+
 // Logical keys we have
 enum logical_keys {
 	LOGICAL_KEY_PROGRAM, // PG
@@ -351,10 +360,24 @@ extern const hid_keycode logical_to_hid_map_default[NUM_LOGICAL_KEYS] PROGMEM;
 void ports_init(void);
 
 /**
- * Gets the current physical input for a given physical position
+ * Selects a matrix row, then gets the current physical input for each column
+ * of that row as a bitmask (bit n set if column n is pressed)
  */
 void matrix_select_row(uint8_t matrix_row);
-uint8_t matrix_read_column(uint8_t matrix_column);
+matrix_row_bits matrix_read_row(void);
+
+// Default debounce algorithm and its parameters: see keystate.h
+#define DEBOUNCE_DEFAULT_MODE DEBOUNCE_DEFERRED
+#define DEBOUNCE_SAMPLES 3 // consecutive readings
+#define DEBOUNCE_MS 6      // at most 255
+
+// Scan the matrix from the Timer0 compare interrupt, every
+// MATRIX_SCAN_INTERVAL_US (at most 4096), rather than from the main loop.
+#define MATRIX_SCAN_ISR 1
+#define MATRIX_SCAN_INTERVAL_US 2000
+
+/** Starts the matrix scan timer interrupt */
+void matrix_scan_timer_start(void);
 
 /* Macros: */
 /** LED mask for the library LED driver, to indicate that the USB interface is not ready. */
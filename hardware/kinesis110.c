@@ -42,6 +42,7 @@
 */
 
 #include <util/delay.h>     /* for _delay_ms() */
+#include <avr/interrupt.h>
 #include "kinesis110.h"
 
 #define KEY_NONE NO_KEY
@@ -281,6 +282,34 @@ void ports_init(void){
 }
 
 
+#if MATRIX_SCAN_ISR
+
+#define MATRIX_SCAN_TIMER_TICKS ((F_CPU / 256) * MATRIX_SCAN_INTERVAL_US / 1000000)
+#if MATRIX_SCAN_TIMER_TICKS < 1 || MATRIX_SCAN_TIMER_TICKS > 256
+#error "MATRIX_SCAN_INTERVAL_US out of range for Timer0"
+#endif
+
+void matrix_scan_timer_start(void){
+	// Timer0 in CTC mode at clk/256
+	OCR0  = MATRIX_SCAN_TIMER_TICKS - 1;
+	TCNT0 = 0;
+	TCCR0 = (1<<WGM01) | (1<<CS02);
+	TIMSK |= (1<<OCIE0);
+}
+
+// V-USB requires that its interrupt is never delayed for long, so the scan
+// runs with interrupts enabled. Mask our own interrupt meanwhile so that the
+// scan can't reenter itself.
+ISR(TIMER0_COMP_vect){
+	TIMSK &= ~(1<<OCIE0);
+	sei();
+	keystate_scan();
+	cli();
+	TIMSK |= (1<<OCIE0);
+}
+
+#endif // MATRIX_SCAN_ISR
+
 void matrix_select_row(uint8_t matrix_row){
 	// Select output using four bits starting at MATRIX_SELECT_A
 	// set output with MATRIX_PORT: 1 means high, 0 means low
@@ -302,9 +331,9 @@ void matrix_select_row(uint8_t matrix_row){
 	MATRIX_PORT = (MATRIX_PORT & ~MATRIX_MASK) | output_port_val;
 }
 
-uint8_t matrix_read_column(uint8_t matrix_column){
-	uint8_t val = (INPUT_PIN & (1 << matrix_column)) == 0;
-	return val;
+matrix_row_bits matrix_read_row(void){
+	// high if button not pressed, low if button pressed
+	return ~INPUT_PIN;
 }
 
 void set_all_leds(uint8_t led_mask){
@@ -69,6 +69,8 @@
 #define MATRIX_COLS 8 // 8 demultiplexer selected matrix columns
 #define MATRIX_ROWS 13 // 2 74LS138 1-of-8 demultiplexers
 
+typedef uint8_t matrix_row_bits; // one bit per column
+
 // Logical keys we have
 enum logical_keys {
 	LOGICAL_KEY_PROGRAM, // PG
@@ -222,10 +224,24 @@ extern const hid_keycode logical_to_hid_map_default[NUM_LOGICAL_KEYS] PROGMEM;
 void ports_init(void);
 
 /**
- * Gets the current physical input for a given physical position
+ * Selects a matrix row, then gets the current physical input for each column
+ * of that row as a bitmask (bit n set if column n is pressed)
  */
 void matrix_select_row(uint8_t matrix_row);
-uint8_t matrix_read_column(uint8_t matrix_column);
+matrix_row_bits matrix_read_row(void);
+
+// Default debounce algorithm and its parameters: see keystate.h
+#define DEBOUNCE_DEFAULT_MODE DEBOUNCE_DEFERRED
+#define DEBOUNCE_SAMPLES 3 // consecutive readings
+#define DEBOUNCE_MS 6      // at most 255
+
+// Scan the matrix from the Timer0 compare interrupt, every
+// MATRIX_SCAN_INTERVAL_US (at most 4096), rather than from the main loop.
+#define MATRIX_SCAN_ISR 1
+#define MATRIX_SCAN_INTERVAL_US 2000
+
+/** Starts the matrix scan timer interrupt */
+void matrix_scan_timer_start(void);
 
 /* Macros: */
 /** LED mask for the library LED driver, to indicate that the USB interface is not ready. */
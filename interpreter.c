@@ -44,35 +44,82 @@
 */
 
 #include <stdint.h>
+#include <stddef.h>
 
 #ifdef DEBUG
 
 // standalone binary harness
-#define LOG(x...) printf(x)
+#ifdef __AVR__
+// built for simavr, where it only benchmarks
+#define LOG(x...)
+#define COUNT_DISPATCH()
+#else
+#define LOG(x...) do { if(harness_verbose) printf(x); } while(0)
+#define COUNT_DISPATCH() (++harness_dispatches)
+#endif
 #include "interpreter_harness.c"
 
 #else
 
 // keyboard hardware
 #define LOG(x...)
+#define COUNT_DISPATCH()
 #include <string.h>
+#include <avr/pgmspace.h>
+#include "usb.h"
 #include "keystate.h"
 #include "buzzer.h"
 #include "storage.h"
 #include "config.h"
 #include "interpreter.h"
 #include "extrareport.h"
+#include "stats.h"
 
 #endif
 
 static vmstate vms[PROGRAM_COUNT];
 
-static int vm_init_vm(vmstate* vm, const program* p){
+// VMs waiting on a delay_end_ms are kept in a list in order of
+// delay_end_ms, linked by timer_next, so that only the first needs
+// checking against the time. Membership is tracked by timer_linked, as
+// any delay_end_ms, including 0, may be reached when uptimems() wraps.
+#define VM_NONE 0xff
+static uint8_t vm_timer_head = VM_NONE;
+
+// VMs waiting for a key are checked only when the key event ring has
+// moved past this cursor.
+static key_event_cursor vm_key_cursor;
+
+#if PROGRAM_ARENA_SIZE > 0
+// The hot code of running programs is copied here if there's room, so
+// that the interpreter can fetch it from SRAM instead of storage.
+static uint8_t vm_arena[PROGRAM_ARENA_SIZE];
+
+// Offset of the program address within the VM's hot code: at least
+// its length if it's outside.
+#define VM_HOT_OFFSET(vm, addr) ((uintptr_t) ((const bytecode*) (addr) - (vm)->hot_code))
+#endif
+
+// Reads from the VM's program: from the arena if it's all within the
+// VM's copy of its hot code there, otherwise from storage.
+static int16_t vm_read_program(vmstate* vm, const void* addr, void* dst, uint8_t len){
+#if PROGRAM_ARENA_SIZE > 0
+	uintptr_t offset = VM_HOT_OFFSET(vm, addr);
+	if(offset < vm->arena_len && len <= vm->arena_len - offset){
+		memcpy(dst, &vm->arena_code[offset], len);
+		return len;
+	}
+#endif
+	return storage_read(PROGRAM_STORAGE, (uint8_t*)addr, (uint8_t*)dst, len);
+}
+
+static int vm_init_vm(vmstate* vm, const program* p, uint16_t len){
 	vm->state = VMSTOPPED;
 	memset(vm, 0x0, sizeof(vmstate));
 	ExtraKeyboardReport_clear(&vm->keyboardreport);
 
 	vm->program = p;
+	vm->program_len = len;
 
 	uint8_t nmethods;
 	if(storage_read(PROGRAM_STORAGE, (uint8_t*)&p->nmethods, (uint8_t*)&nmethods, 1) != 1){
@@ -84,6 +131,443 @@ static int vm_init_vm(vmstate* vm, const program* p){
 	return 0;
 }
 
+#if PROGRAM_ARENA_SIZE > 0
+static bool vm_arena_overlaps(const vmstate* vm, const uint8_t* start, uint16_t len){
+	const uint8_t* p = vm->arena_code;
+	return vm->arena_len && p < start + len && start < p + vm->arena_len;
+}
+
+/**
+ * Copies the VM's hot code into the arena, at the first place that
+ * isn't in use by another running VM. Leaves it in storage if there's
+ * no room.
+ */
+static void vm_arena_load(vmstate* vm){
+	if(vm->arena_len) return; // still there from the last run
+
+	uint16_t len = vm->hot_len;
+	if(len == 0) return;
+
+	uint8_t* start = vm_arena;
+	for(uint8_t i = 0; i < PROGRAM_COUNT; ){
+		vmstate* other = &vms[i];
+		if(other != vm && other->state >= VMRUNNING && vm_arena_overlaps(other, start, len)){
+			// skip past it and check again from the first VM
+			start = (uint8_t*) other->arena_code + other->arena_len;
+			if(start + len > vm_arena + PROGRAM_ARENA_SIZE) return;
+			i = 0;
+		}
+		else{
+			++i;
+		}
+	}
+
+	// stopped VMs whose copies we overwrite will have to reload
+	for(uint8_t i = 0; i < PROGRAM_COUNT; ++i){
+		if(vm_arena_overlaps(&vms[i], start, len)){
+			vms[i].arena_len = 0;
+		}
+	}
+
+	if(storage_read(PROGRAM_STORAGE, (uint8_t*)vm->hot_code, start, len) != len){
+		return;
+	}
+	vm->arena_code = start;
+	vm->arena_len = len;
+}
+#endif
+
+// Programs are verified when the VMs are initialized, so that the
+// interpreter needn't check them as it runs. Each method's stack depth
+// is computed by abstract interpretation over the jump targets.
+
+static vm_program_status vm_status[PROGRAM_COUNT];
+
+vm_program_status* vm_get_program_status(void){
+	return vm_status;
+}
+
+// Stack effect (bytes popped and pushed) and immediate operand size of
+// each instruction. CALL's stack effect depends on the method called.
+#define VM_EFFECT(pops, pushes, imm) ((pops) | ((pushes) << 3) | ((imm) << 6))
+#define VM_EFFECT_POPS(e) ((e) & 0x7)
+#define VM_EFFECT_PUSHES(e) (((e) >> 3) & 0x7)
+#define VM_EFFECT_IMM(e) ((e) >> 6)
+#define VM_EFFECT_INVALID 0xff
+
+static const uint8_t vm_effects[RELEASEMOUSEBUTTONS + 1] PROGMEM = {
+	[0 ... RELEASEMOUSEBUTTONS] = VM_EFFECT_INVALID,
+	[BSTORE] = VM_EFFECT(1, 0, 1),
+	[BSTORE_0 ... BSTORE_3] = VM_EFFECT(1, 0, 0),
+	[SSTORE] = VM_EFFECT(2, 0, 1),
+	[SSTORE_0 ... SSTORE_3] = VM_EFFECT(2, 0, 0),
+	[BLOAD] = VM_EFFECT(0, 1, 1),
+	[BLOAD_0 ... BLOAD_3] = VM_EFFECT(0, 1, 0),
+	[SLOAD] = VM_EFFECT(0, 2, 1),
+	[SLOAD_0 ... SLOAD_3] = VM_EFFECT(0, 2, 0),
+	[GBSTORE] = VM_EFFECT(1, 0, 1),
+	[GBLOAD] = VM_EFFECT(0, 1, 1),
+	[GSSTORE] = VM_EFFECT(2, 0, 1),
+	[GSLOAD] = VM_EFFECT(0, 2, 1),
+	[BCONST] = VM_EFFECT(0, 1, 1),
+	[BCONST_0 ... BCONST_3] = VM_EFFECT(0, 1, 0),
+	[SCONST] = VM_EFFECT(0, 2, 2),
+	[SCONST_0 ... SCONST_3] = VM_EFFECT(0, 2, 0),
+	[DUP] = VM_EFFECT(1, 2, 0),
+	[DUP2] = VM_EFFECT(2, 4, 0),
+	[POP] = VM_EFFECT(1, 0, 0),
+	[POP2] = VM_EFFECT(2, 0, 0),
+	[SWAP] = VM_EFFECT(2, 2, 0),
+	[BADD ... BMOD] = VM_EFFECT(2, 1, 0),
+	[BAND ... BXOR] = VM_EFFECT(2, 1, 0),
+	[BNOT] = VM_EFFECT(1, 1, 0),
+	[BCMP] = VM_EFFECT(2, 1, 0),
+	[BLSHIFT ... BRSHIFT] = VM_EFFECT(2, 1, 0),
+	[SADD ... SXOR] = VM_EFFECT(4, 2, 0),
+	[SNOT] = VM_EFFECT(2, 2, 0),
+	[SCMP] = VM_EFFECT(4, 1, 0),
+	[SLSHIFT ... SRSHIFT] = VM_EFFECT(3, 2, 0),
+	[B2S] = VM_EFFECT(1, 2, 0),
+	[S2B] = VM_EFFECT(2, 1, 0),
+	[IFEQ ... IFLE] = VM_EFFECT(1, 0, 2),
+	[GOTO] = VM_EFFECT(0, 0, 2),
+	[NOP] = VM_EFFECT(0, 0, 0),
+	[CALL] = VM_EFFECT(0, 0, 1),
+	[BRET] = VM_EFFECT(1, 0, 0),
+	[SRET] = VM_EFFECT(2, 0, 0),
+	[RET] = VM_EFFECT(0, 0, 0),
+	[VMEXIT] = VM_EFFECT(0, 0, 0),
+	[PRESSKEY] = VM_EFFECT(1, 0, 0),
+	[RELEASEKEY] = VM_EFFECT(1, 0, 0),
+	[CHECKKEY] = VM_EFFECT(1, 1, 0),
+	[CHECKPHYSKEY] = VM_EFFECT(1, 1, 0),
+	[WAITKEY] = VM_EFFECT(3, 1, 0),
+	[WAITPHYSKEY] = VM_EFFECT(3, 1, 0),
+	[DELAY] = VM_EFFECT(2, 0, 0),
+	[GETUPTIMEMS] = VM_EFFECT(0, 2, 0),
+	[GETUPTIME] = VM_EFFECT(0, 2, 0),
+	[BUZZ] = VM_EFFECT(2, 0, 0),
+	[BUZZAT] = VM_EFFECT(3, 0, 0),
+	[MOVEMOUSE] = VM_EFFECT(2, 0, 0),
+	[PRESSMOUSEBUTTONS] = VM_EFFECT(1, 0, 0),
+	[RELEASEMOUSEBUTTONS] = VM_EFFECT(1, 0, 0),
+};
+
+#define VM_DEPTH_UNKNOWN 0xff
+
+// A jump target and the stack depth there, once known. The table of
+// them is kept in the (not yet used) stack of the VM being verified.
+typedef struct __attribute__((__packed__)) _vm_target {
+	uint16_t pc;
+	uint8_t depth;
+} vm_target;
+
+#if STACK_SIZE / 3 > 255
+#define VM_MAX_TARGETS 255
+#else
+#define VM_MAX_TARGETS (STACK_SIZE / sizeof(vm_target))
+#endif
+
+typedef struct _vm_verifier {
+	const program* program;
+	uint16_t code;      // offset of the code within the program
+	uint16_t code_len;
+	uint8_t nglobals;
+	uint8_t nmethods;
+	vm_target* targets; // of the method being verified
+	uint8_t ntargets;
+	vm_program_status* status;
+#if PROGRAM_ARENA_SIZE > 0
+	uint16_t hot_start; // offset of the hot code within the program
+	uint16_t hot_len;
+#endif
+} vm_verifier;
+
+typedef struct _vm_instruction {
+	uint8_t op;
+	uint8_t effect;
+	uint8_t len;    // including operands
+	int16_t operand; // zero-extended if a byte
+} vm_instruction;
+
+static bool vm_verify_fail(vm_verifier* v, uint8_t result, uint16_t pc){
+	v->status->result = result;
+	v->status->offset = v->code + pc;
+	return false;
+}
+
+static bool vm_verify_read(vm_verifier* v, uint16_t offset, void* dst, uint8_t len){
+	if(storage_read(PROGRAM_STORAGE, (uint8_t*)v->program + offset, (uint8_t*)dst, len) != len){
+		return vm_verify_fail(v, VERIFY_READ_ERROR, offset - v->code);
+	}
+	return true;
+}
+
+// Reads a method's header, and finds the end of its code: the start of
+// the next method's code, or the end of the program.
+static bool vm_verify_method(vm_verifier* v, uint8_t idx, method* m, uint16_t* end){
+	uint16_t header = offsetof(program, methods) + idx * sizeof(method);
+	if(!vm_verify_read(v, header, m, sizeof(method))) return false;
+	if(m->code_offset >= v->code_len || m->nargs > m->nlocals){
+		v->status->method = idx;
+		return vm_verify_fail(v, VERIFY_BAD_HEADER, header - v->code);
+	}
+	*end = v->code_len;
+	for(uint8_t i = 0; i < v->nmethods; ++i){
+		uint16_t start;
+		if(!vm_verify_read(v, offsetof(program, methods) + i * sizeof(method) + offsetof(method, code_offset),
+						   &start, sizeof(uint16_t))) return false;
+		if(start > m->code_offset && start < *end) *end = start;
+	}
+	return true;
+}
+
+static bool vm_verify_decode(vm_verifier* v, uint16_t pc, uint16_t end, vm_instruction* in){
+	uint8_t buf[3];
+	if(!vm_verify_read(v, v->code + pc, buf, 1)) return false;
+	in->op = buf[0];
+	in->effect = in->op <= RELEASEMOUSEBUTTONS ? pgm_read_byte(&vm_effects[in->op]) : VM_EFFECT_INVALID;
+	if(in->effect == VM_EFFECT_INVALID) return vm_verify_fail(v, VERIFY_BAD_INSTRUCTION, pc);
+
+	uint8_t imm = VM_EFFECT_IMM(in->effect);
+	in->len = 1 + imm;
+	if(pc + in->len > end) return vm_verify_fail(v, VERIFY_BAD_INSTRUCTION, pc);
+	if(imm && !vm_verify_read(v, v->code + pc + 1, &buf[1], imm)) return false;
+	in->operand = imm == 2 ? (int16_t) (buf[1] | (buf[2] << 8)) : buf[1];
+	return true;
+}
+
+static bool vm_is_terminal(uint8_t op){
+	return op == GOTO || (op >= BRET && op <= VMEXIT);
+}
+
+#if PROGRAM_ARENA_SIZE > 0
+// A backward jump makes a loop, whose code is run over and over: worth
+// copying into the arena, unlike code that's run once. Keeps the largest
+// loop that fits, taking in the rest of its method if that fits too.
+static void vm_verify_loop(vm_verifier* v, const method* m, uint16_t end, uint16_t start, uint16_t loop_end){
+	if(end - m->code_offset <= PROGRAM_ARENA_SIZE){
+		start = m->code_offset;
+		loop_end = end;
+	}
+	uint16_t len = loop_end - start;
+	if(len <= PROGRAM_ARENA_SIZE && len > v->hot_len){
+		v->hot_start = v->code + start;
+		v->hot_len = len;
+	}
+}
+#endif
+
+// Checks each instruction of a method on its own: opcodes, operands,
+// jump targets and returns.
+static bool vm_verify_instructions(vm_verifier* v, const method* m, uint16_t end){
+	uint8_t ret = NOP;
+	vm_instruction in;
+	for(uint16_t pc = m->code_offset; pc < end; pc += in.len){
+		if(!vm_verify_decode(v, pc, end, &in)) return false;
+		uint8_t op = in.op;
+		if(op <= SLOAD_3){
+			// BSTORE, SSTORE, BLOAD and SLOAD are each followed by their
+			// four _n forms
+			uint8_t local = VM_EFFECT_IMM(in.effect) ? (uint8_t) in.operand : op % 5 - 1;
+			uint8_t size = (op / 5) % 2 ? 2 : 1;
+			if(local > INT8_MAX || local + size > m->nlocals) return vm_verify_fail(v, VERIFY_BAD_LOCAL, pc);
+		}
+		else if(op >= GBSTORE && op <= GSLOAD){
+			uint8_t size = (op == GSSTORE || op == GSLOAD) ? 2 : 1;
+			if(in.operand > INT8_MAX || in.operand + size > v->nglobals) return vm_verify_fail(v, VERIFY_BAD_GLOBAL, pc);
+		}
+		else if(op >= IFEQ && op <= GOTO){
+			int32_t target = (int32_t) pc + in.operand;
+			if(target < m->code_offset || target >= end) return vm_verify_fail(v, VERIFY_BAD_JUMP, pc);
+#if PROGRAM_ARENA_SIZE > 0
+			if(target <= pc) vm_verify_loop(v, m, end, target, pc + in.len);
+#endif
+		}
+		else if(op == CALL){
+			if(in.operand >= v->nmethods) return vm_verify_fail(v, VERIFY_BAD_METHOD, pc);
+		}
+		else if(op >= BRET && op <= RET){
+			if(ret != NOP && ret != op) return vm_verify_fail(v, VERIFY_BAD_RETURN, pc);
+			ret = op;
+		}
+	}
+	return true;
+}
+
+// Finds how many bytes a method returns to its caller, from its first
+// return instruction. Methods that never return are treated as
+// returning nothing.
+static bool vm_verify_return_size(vm_verifier* v, uint8_t idx, method* m, uint8_t* size){
+	uint16_t end;
+	if(!vm_verify_method(v, idx, m, &end)) return false;
+	*size = 0;
+	vm_instruction in;
+	for(uint16_t pc = m->code_offset; pc < end; pc += in.len){
+		if(!vm_verify_decode(v, pc, end, &in)) return false;
+		if(in.op >= BRET && in.op <= RET){
+			*size = VM_EFFECT_POPS(in.effect);
+			break;
+		}
+	}
+	return true;
+}
+
+static vm_target* vm_verify_target(vm_verifier* v, uint16_t pc){
+	for(uint8_t i = 0; i < v->ntargets; ++i){
+		if(v->targets[i].pc == pc) return &v->targets[i];
+	}
+	return 0;
+}
+
+/**
+ * Joins a stack depth into the depth known at a jump target. Returns
+ * false if they differ.
+ */
+static bool vm_verify_join(vm_target* t, uint8_t depth, bool* changed){
+	if(t->depth == VM_DEPTH_UNKNOWN){
+		t->depth = depth;
+		*changed = true;
+		return true;
+	}
+	return t->depth == depth;
+}
+
+// Computes the method's maximum stack depth, checking that the stack
+// can't underflow, that the depth is the same along every path to each
+// instruction, and that execution can't run off the end. Instructions
+// are interpreted in order, passing the depth to jump targets, until
+// the depths at the targets stop changing.
+static bool vm_verify_stack(vm_verifier* v, const method* m, uint16_t end, uint8_t* max_depth){
+	vm_instruction in;
+
+	// collect the jump targets
+	v->ntargets = 0;
+	for(uint16_t pc = m->code_offset; pc < end; pc += in.len){
+		if(!vm_verify_decode(v, pc, end, &in)) return false;
+		if(in.op < IFEQ || in.op > GOTO) continue;
+		uint16_t target = pc + in.operand;
+		if(vm_verify_target(v, target)) continue;
+		if(v->ntargets == VM_MAX_TARGETS) return vm_verify_fail(v, VERIFY_TOO_COMPLEX, pc);
+		v->targets[v->ntargets].pc = target;
+		v->targets[v->ntargets].depth = VM_DEPTH_UNKNOWN;
+		++v->ntargets;
+	}
+
+	*max_depth = 0;
+	bool changed;
+	do{
+		changed = false;
+		uint8_t depth = 0;
+		for(uint16_t pc = m->code_offset; pc < end; pc += in.len){
+			if(!vm_verify_decode(v, pc, end, &in)) return false;
+
+			for(uint8_t i = 0; i < v->ntargets; ++i){
+				uint16_t t = v->targets[i].pc;
+				if(t > pc && t < pc + in.len) return vm_verify_fail(v, VERIFY_BAD_JUMP, pc);
+			}
+			vm_target* target = vm_verify_target(v, pc);
+			if(target){
+				if(depth == VM_DEPTH_UNKNOWN){
+					depth = target->depth;
+				}
+				else if(!vm_verify_join(target, depth, &changed)){
+					return vm_verify_fail(v, VERIFY_STACK_MISMATCH, pc);
+				}
+			}
+			if(depth == VM_DEPTH_UNKNOWN) continue; // not reached (yet)
+
+			uint8_t pops = VM_EFFECT_POPS(in.effect);
+			uint8_t pushes = VM_EFFECT_PUSHES(in.effect);
+			if(in.op == CALL){
+				method callee;
+				if(!vm_verify_return_size(v, in.operand, &callee, &pushes)) return false;
+				pops = callee.nargs;
+			}
+			if(depth < pops) return vm_verify_fail(v, VERIFY_STACK_UNDERFLOW, pc);
+			if(depth - pops + pushes >= VM_DEPTH_UNKNOWN) return vm_verify_fail(v, VERIFY_STACK_OVERFLOW, pc);
+			depth = depth - pops + pushes;
+			if(depth > *max_depth) *max_depth = depth;
+
+			if(in.op >= IFEQ && in.op <= GOTO){
+				if(!vm_verify_join(vm_verify_target(v, pc + in.operand), depth, &changed)){
+					return vm_verify_fail(v, VERIFY_STACK_MISMATCH, pc);
+				}
+			}
+			if(vm_is_terminal(in.op)){
+				depth = VM_DEPTH_UNKNOWN;
+			}
+			else if(pc + in.len == end){
+				return vm_verify_fail(v, VERIFY_FALLS_OFF_END, pc);
+			}
+		}
+		USB_KeepAlive(false);
+	} while(changed);
+
+	return true;
+}
+
+/**
+ * Verifies the VM's program, using its stack as scratch space, and
+ * records the result in status and the program's hot code in the VM.
+ */
+static void vm_verify(vmstate* vm, const program* p, uint16_t len, vm_program_status* status){
+	vm_verifier v;
+	memset(status, 0, sizeof(vm_program_status));
+	v.program = p;
+	v.code = 0;
+	v.targets = (vm_target*) vm->stack;
+	v.status = status;
+
+	if(len < sizeof(program)){
+		status->result = VERIFY_BAD_HEADER;
+		return;
+	}
+	uint8_t header[2];
+	if(!vm_verify_read(&v, 0, header, 2)) return;
+	v.nglobals = header[0];
+	v.nmethods = header[1];
+	v.code = sizeof(program) + sizeof(method) * (v.nmethods - 1);
+	if(v.nmethods == 0 || v.code >= len){
+		status->result = VERIFY_BAD_HEADER;
+		return;
+	}
+	v.code_len = len - v.code;
+
+#if PROGRAM_ARENA_SIZE > 0
+	// Programs that fit are copied whole, method headers and all
+	v.hot_start = 0;
+	v.hot_len = len <= PROGRAM_ARENA_SIZE ? len : 0;
+#endif
+
+	method m;
+	uint16_t end;
+	for(uint8_t i = 0; i < v.nmethods; ++i){
+		status->method = i;
+		if(!vm_verify_method(&v, i, &m, &end) || !vm_verify_instructions(&v, &m, end)) return;
+	}
+	for(uint8_t i = 0; i < v.nmethods; ++i){
+		status->method = i;
+		uint8_t depth;
+		if(!vm_verify_method(&v, i, &m, &end) || !vm_verify_stack(&v, &m, end, &depth)) return;
+		if(depth > status->max_depth) status->max_depth = depth;
+	}
+
+	// main's frame must fit with room for the deepest method. Calls check
+	// for themselves that there's room for the method called.
+	status->method = 0;
+	if(!vm_verify_method(&v, 0, &m, &end)) return;
+	if(v.nglobals + sizeof(stack_frame) + m.nlocals + status->max_depth > STACK_SIZE){
+		status->result = VERIFY_STACK_OVERFLOW;
+		status->offset = v.code + m.code_offset;
+	}
+
+#if PROGRAM_ARENA_SIZE > 0
+	vm->hot_code = (const bytecode*) p + v.hot_start;
+	vm->hot_len = v.hot_len;
+#endif
+}
+
 static uint8_t vm_start_vm(vmstate* vm, logical_keycode trigger_lkey){
 	if(vm->state == VMNOPROGRAM || vm->state >= VMRUNNING){
 		// can't start a VM that doesn't have a program to run, and
@@ -94,13 +578,19 @@ static uint8_t vm_start_vm(vmstate* vm, logical_keycode trigger_lkey){
 	vm->state = VMRUNNING;
 	vm->trigger_lkey = trigger_lkey;
 
+	const program* prog = vm->program;
+#if PROGRAM_ARENA_SIZE > 0
+	vm_arena_load(vm);
+#endif
+
 	// read in the program header (and first method header)
 	// note that this relies on little-endian architecture.
 	program p;
-	if(storage_read(PROGRAM_STORAGE, (uint8_t*)vm->program, (uint8_t*)&p, sizeof(program)) != sizeof(program)){
+	if(vm_read_program(vm, prog, &p, sizeof(program)) != sizeof(program)){
 		return storage_errno;
 	}
 
+	vm->code = &((const bytecode*)prog)[sizeof(program) + sizeof(method) * (p.nmethods - 1)];
 	vm->ip = &vm->code[p.methods[0].code_offset];
 
 	vm->current_frame = (stack_frame*)(vm->stack + p.nglobals);
@@ -113,33 +603,127 @@ static uint8_t vm_start_vm(vmstate* vm, logical_keycode trigger_lkey){
 }
 
 void vm_init(void){
+	vm_timer_head = VM_NONE;
+	vm_key_cursor = keystate_event_cursor();
 	for(uint8_t i = 0; i < PROGRAM_COUNT; ++i){
+		vms[i].timer_linked = false;
 		const program* p = config_get_program(i);
 		if(p){
-			uint8_t r = vm_init_vm(&vms[i], p);
+			uint16_t len = config_get_program_length(i);
+			uint8_t r = vm_init_vm(&vms[i], p, len);
+			vm_verify(&vms[i], p, len, &vm_status[i]);
+			if(vm_status[i].result != VERIFY_OK){
+				vms[i].state = VMNOPROGRAM; // not safe to run
+				continue;
+			}
 			if(r != 0) vms[i].state = VMNOPROGRAM; // failed to read from eeprom
+			vms[i].max_depth = vm_status[i].max_depth;
 		}
 		 else{
+			vm_status[i].result = VERIFY_NO_PROGRAM;
 			vms[i].state = VMNOPROGRAM; // Program not present
 		}
 	}
 }
 
+void vm_stop_all(void){
+	vm_timer_head = VM_NONE;
+	for(uint8_t i = 0; i < PROGRAM_COUNT; ++i){
+		vms[i].state = VMNOPROGRAM;
+		vms[i].timer_linked = false;
+#if PROGRAM_ARENA_SIZE > 0
+		vms[i].arena_len = 0;
+#endif
+		vm_status[i].result = VERIFY_NO_PROGRAM;
+	}
+}
+
 uint8_t vm_start(uint8_t idx, logical_keycode trigger_lkey){
 	return vm_start_vm(&vms[idx], trigger_lkey);
 }
 
-static void vm_step(vmstate* vm);
+static uint8_t vm_run(vmstate* vm, uint8_t budget, uint16_t start);
+static void vm_check_wait(vmstate* vm, bool timed_out);
+
+static bool vm_time_reached(uint32_t end_ms, uint32_t now){
+	return (int32_t)(now - end_ms) > 0;
+}
 
+static void vm_timer_add(vmstate* vm){
+	uint8_t* link = &vm_timer_head;
+	while(*link != VM_NONE && !vm_time_reached(vm->delay_end_ms, vms[*link].delay_end_ms)){
+		link = &vms[*link].timer_next;
+	}
+	vm->timer_next = *link;
+	vm->timer_linked = true;
+	*link = vm - vms;
+}
+
+static void vm_timer_remove(vmstate* vm){
+	if(!vm->timer_linked) return;
+	uint8_t* link = &vm_timer_head;
+	while(*link != VM_NONE){
+		if(&vms[*link] == vm){
+			*link = vm->timer_next;
+			vm->timer_linked = false;
+			return;
+		}
+		link = &vms[*link].timer_next;
+	}
+}
+
+/**
+ * Wakes waiting VMs whose keys or times have come, then runs each
+ * runnable VM for a slice. VMs waiting for anything else aren't
+ * visited.
+ */
 void vm_step_all(void){
-	for(uint8_t i = 0; i < PROGRAM_COUNT; ++i){
-		if(vms[i].state >= VMRUNNING){
-			vm_step(&vms[i]);
+	key_event_cursor cursor = keystate_event_cursor();
+	if(cursor != vm_key_cursor){
+		vm_key_cursor = cursor;
+		for(uint8_t i = 0; i < PROGRAM_COUNT; ++i){
+			if(vms[i].state == VMWAITKEY || vms[i].state == VMWAITPHYSKEY){
+				vm_check_wait(&vms[i], false);
+			}
+		}
+	}
+
+	if(vm_timer_head != VM_NONE){
+		uint32_t now = uptimems();
+		while(vm_timer_head != VM_NONE && vm_time_reached(vms[vm_timer_head].delay_end_ms, now)){
+			vmstate* vm = &vms[vm_timer_head];
+			vm_timer_head = vm->timer_next;
+			vm->timer_linked = false;
+			if(vm->state == VMDELAY){
+				vm->state = VMRUNNING;
+			}
+			else{
+				vm_check_wait(vm, true);
+			}
 		}
 	}
+
+	uint16_t start = stats_ticks();
+	uint16_t steps = 0;
+	bool ran = false;
+
+	for(uint8_t i = 0; i < PROGRAM_COUNT; ++i){
+		vmstate* vm = &vms[i];
+		if(vm->state != VMRUNNING) continue;
+		ran = true;
+
+		// Run until the program blocks (or stops), or uses up its
+		// budget or the slice's time. Each runnable program gets at
+		// least one step.
+		steps += vm_run(vm, PROGRAM_SLICE_INSTRUCTIONS, start);
+	}
+
+	if(ran){
+		stats_vm_slice(stats_ticks() - start, steps);
+	}
 }
 
-void vm_append_KeyboardReport(KeyboardReport_Data_t* report){
+void vm_append_KeyboardReport(KeyboardReportBitmap* report){
 	// iterate VMs and append
 	for(uint8_t i = 0; i < PROGRAM_COUNT; ++i){
 		if(vms[i].state < VMRUNNING) continue;
@@ -175,18 +759,16 @@ void vm_append_MouseReport(MouseReport_Data_t* report){
 }
 
 
-// Macros for reading from eeprom within VM. Assumes that VM is in
-// scope as 'vm', and handles errors by setting state=VMCRASHED and
-// returning.  Requires accurate (sizeof()able) pointer type in first
+// Macros for reading from the program within VM (from eeprom, or the
+// arena if loaded there). Assumes that VM is in scope as 'vm', and
+// handles errors by setting state=VMCRASHED and jumping to vm_run's
+// vm_stop.  Requires accurate (sizeof()able) pointer type in first
 // argument.
 #define READ_EEPROM_TO(DST, ADDR) {										\
-		uint8_t __r = storage_read(PROGRAM_STORAGE,                     \
-		                           (uint8_t*)(ADDR),                    \
-		                           (uint8_t*)(DST),                     \
-		                           sizeof(*(DST)));                     \
+		uint8_t __r = vm_read_program(vm, (ADDR), (DST), sizeof(*(DST))); \
 		if(__r != sizeof(*(DST))){										\
 			vm->state = VMCRASHED;										\
-			return;														\
+			goto vm_stop;												\
 		}}																\
 
 #define READ_EEPROM(TYPE, ADDR) ({										\
@@ -195,8 +777,22 @@ void vm_append_MouseReport(MouseReport_Data_t* report){
 			__v;														\
 		})																\
 
+#if PROGRAM_ARENA_SIZE > 0
+#define NEXTINSTR(vm) ({ uintptr_t __o = VM_HOT_OFFSET(vm, vm->ip);			\
+			__o < vm->arena_len ? (++vm->ip, vm->arena_code[__o])		\
+				: READ_EEPROM(bytecode, vm->ip++); })
+#else
 #define NEXTINSTR(vm) READ_EEPROM(bytecode, vm->ip++)
+#endif
+#if PROGRAM_ARENA_SIZE > 0
+#define NEXTSHORT(vm) ({ vshort __v;									\
+			uintptr_t __o = VM_HOT_OFFSET(vm, vm->ip);					\
+			if(__o + 1 < vm->arena_len) memcpy(&__v, &vm->arena_code[__o], sizeof(__v)); \
+			else READ_EEPROM_TO(&__v, vm->ip);							\
+			vm->ip += 2; __v; })
+#else
 #define NEXTSHORT(vm) ({ vshort __v; READ_EEPROM_TO(&__v, vm->ip); vm->ip += 2; __v; })
+#endif
 
 // Stack manipulation macros
 #define TOP_BYTE(vm) (vm->stack_top[0])
@@ -215,6 +811,39 @@ static void vm_do_return(vmstate* vm){
 	vm->current_frame = vm->current_frame->previous_frame;
 }
 
+/**
+ * Checks whether a VM in VMWAITKEY or VMWAITPHYSKEY has found its key.
+ * If so, or if its timeout has been reached, pushes the result and
+ * makes it runnable.
+ */
+static void vm_check_wait(vmstate* vm, bool timed_out){
+	vbyte result;
+	if(vm->state == VMWAITPHYSKEY){
+		LOG("VM waiting for physkey %d: ", vm->wait_key);
+		result = keystate_check_key(vm->wait_key, LOGICAL);
+	}
+	else{
+		LOG("VM waiting for key %d: ", vm->wait_key);
+		hid_keycode r = keystate_check_hid_key(vm->wait_key);
+		result = (r == NO_KEY) ? 0 : r;
+	}
+
+	if(result){
+		LOG("Wait over, pushing %d\n", result);
+		vm_timer_remove(vm);
+	}
+	else if(timed_out){
+		LOG("Wait timeout expired, returning 0\n");
+	}
+	else{
+		LOG("Not found\n");
+		return;
+	}
+
+	PUSH_BYTE(vm, result);
+	vm->state = VMRUNNING;
+}
+
 static uint8_t vm_if_check(bytecode instr, vbyte val){
 	switch(instr){
 	case IFEQ:
@@ -238,506 +867,632 @@ static uint8_t vm_if_check(bytecode instr, vbyte val){
 static const char* bytecode_name(bytecode b);
 #endif
 
-static void vm_step(vmstate* vm){
-	if(vm->state < VMRUNNING){
-		LOG("Tried to step halted VM");
-		return;
-	}
-
-	if(vm->stack_top > &vm->stack[STACK_SIZE-2]){ // must keep enough stack to push a short
-		LOG("Stack overflow!\n");
-		vm->state = VMCRASHED;
-		return;
-	}
+// Instructions run between checks of the slice budget and time
+#define VM_CHECK_INTERVAL 4
 
-	switch(vm->state){
-	case VMWAITREPORT:
-	case VMWAITMOUSEREPORT: {
-		LOG("VM waiting for report send\n");
-		return; // nothing to do until flag is cleared
-	}
-	case VMWAITPHYSKEY: {
-		if(vm->wait_key == 0){ vm->wait_key = vm->trigger_lkey; }
-		LOG("VM waiting for physkey %d: ", vm->wait_key);
-		uint8_t pressed = keystate_check_key(vm->wait_key, LOGICAL);
-		if(pressed || (vm->delay_end_ms && uptimems() > vm->delay_end_ms)){
-			if(pressed){
-				LOG("Wait over, pushing 1\n");
-			}
-			else{
-				LOG("Wait timeout expired, returning 0\n");
-			}
-			PUSH_BYTE(vm, pressed ? 1 : 0);
-			vm->delay_end_ms = 0;
-			vm->state = VMRUNNING;
-		}
-		else{
-			LOG("Not found\n");
-		}
-		return;
-	}
-	case VMWAITKEY: {
-		LOG("VM waiting for key %d: ", vm->wait_key);
-		hid_keycode r = keystate_check_hid_key(vm->wait_key);
-		if(r != NO_KEY || (vm->delay_end_ms && uptimems() > vm->delay_end_ms)){
-			if(r != NO_KEY){
-				LOG("Wait over, pushing %d\n", r);
-			}
-			else{
-				LOG("Wait timeout expired, returning 0\n");
-				r = 0;
-			}
-			PUSH_BYTE(vm, r);
-			vm->delay_end_ms = 0;
-			vm->state = VMRUNNING;
-		}
-		else{
-			LOG("not found\n");
-		}
-		return;
-	}
-	case VMDELAY: {
-		if(uptimems() > vm->delay_end_ms){
-			vm->delay_end_ms = 0;
-			vm->state = VMRUNNING;
-			break;
-		}
-		else{
-			return;
-		}
-	}
-	default: ;
-	}
+// Instructions taken by a fast path count towards the slice budget, but
+// not towards the interval, so a slice may run over its budget by up to
+// two fused instructions for each one dispatched since the last check.
+#if PROGRAM_SLICE_INSTRUCTIONS > 255 - 2 * VM_CHECK_INTERVAL
+#error "PROGRAM_SLICE_INSTRUCTIONS must fit in a byte, with room for fused instructions"
+#endif
 
-	bytecode current_instr = NEXTINSTR(vm);
+// With VM_THREADED_DISPATCH, each instruction jumps straight to its
+// handler through a table of label addresses, rather than through the
+// switch's bounds check and jump table.
+#if VM_THREADED_DISPATCH
+#define VM_CASE(op) case op: vm_op_##op:
+#define VM_DISPATCH_TARGET(op) ((void*) (uintptr_t) pgm_read_word(&vm_dispatch[op]))
+#else
+#define VM_CASE(op) case op:
+#endif
 
+#define VM_NEXT goto vm_next
+#define VM_STOP goto vm_stop
+
+// Checks the slice budget and time if the interval is up, or else
+// counts an instruction towards it
+#define VM_CHECK_SLICE(stop)											\
+	if(unchecked == 0){													\
+		if(executed >= budget) stop;									\
+		if(executed && (uint16_t)(stats_ticks() - start) >= PROGRAM_SLICE_TICKS) stop; \
+		unchecked = budget - executed;									\
+		if(unchecked > VM_CHECK_INTERVAL) unchecked = VM_CHECK_INTERVAL; \
+	}																	\
+	--unchecked
+
+// Fast paths fetch the next instruction themselves, so that they can
+// handle it without a dispatch. If they don't, it's dispatched as usual
+// with VM_DISPATCH.
+#define VM_FETCH_NEXT() ({ ++executed; current_instr = NEXTINSTR(vm); })
+#define VM_DISPATCH goto vm_fetched
+
+// A compare result is almost always consumed by the IFxx that
+// follows it: test it directly rather than going through the stack
+// and another dispatch. Otherwise push it.
+#define VM_FUSE_BRANCH(r)												\
+	VM_FETCH_NEXT();													\
+	if(current_instr >= IFEQ && current_instr <= IFLE){					\
+		cond = vm_if_check(current_instr, (r));							\
+		goto vm_branch;													\
+	}																	\
+	PUSH_BYTE(vm, (r));													\
+	VM_DISPATCH
+
+/**
+ * Runs a VM until it leaves VMRUNNING, has executed `budget`
+ * instructions, or the slice that began at `start` runs out of
+ * time. Returns the number of instructions executed.
+ */
+static uint8_t vm_run(vmstate* vm, uint8_t budget, uint16_t start){
+#if VM_THREADED_DISPATCH
+	static const void* const vm_dispatch[256] PROGMEM = {
+		[0 ... 255] = &&vm_op_invalid,
+		[BSTORE] = &&vm_op_BSTORE,
+		[BSTORE_0] = &&vm_op_BSTORE_0,
+		[BSTORE_1] = &&vm_op_BSTORE_1,
+		[BSTORE_2] = &&vm_op_BSTORE_2,
+		[BSTORE_3] = &&vm_op_BSTORE_3,
+		[SSTORE] = &&vm_op_SSTORE,
+		[SSTORE_0] = &&vm_op_SSTORE_0,
+		[SSTORE_1] = &&vm_op_SSTORE_1,
+		[SSTORE_2] = &&vm_op_SSTORE_2,
+		[SSTORE_3] = &&vm_op_SSTORE_3,
+		[BLOAD] = &&vm_op_BLOAD,
+		[BLOAD_0] = &&vm_op_BLOAD_0,
+		[BLOAD_1] = &&vm_op_BLOAD_1,
+		[BLOAD_2] = &&vm_op_BLOAD_2,
+		[BLOAD_3] = &&vm_op_BLOAD_3,
+		[SLOAD] = &&vm_op_SLOAD,
+		[SLOAD_0] = &&vm_op_SLOAD_0,
+		[SLOAD_1] = &&vm_op_SLOAD_1,
+		[SLOAD_2] = &&vm_op_SLOAD_2,
+		[SLOAD_3] = &&vm_op_SLOAD_3,
+		[GBSTORE] = &&vm_op_GBSTORE,
+		[GSSTORE] = &&vm_op_GSSTORE,
+		[GBLOAD] = &&vm_op_GBLOAD,
+		[GSLOAD] = &&vm_op_GSLOAD,
+		[BCONST] = &&vm_op_BCONST,
+		[BCONST_0] = &&vm_op_BCONST_0,
+		[BCONST_1] = &&vm_op_BCONST_1,
+		[BCONST_2] = &&vm_op_BCONST_2,
+		[BCONST_3] = &&vm_op_BCONST_3,
+		[SCONST] = &&vm_op_SCONST,
+		[SCONST_0] = &&vm_op_SCONST_0,
+		[SCONST_1] = &&vm_op_SCONST_1,
+		[SCONST_2] = &&vm_op_SCONST_2,
+		[SCONST_3] = &&vm_op_SCONST_3,
+		[DUP] = &&vm_op_DUP,
+		[DUP2] = &&vm_op_DUP2,
+		[POP2] = &&vm_op_POP2,
+		[POP] = &&vm_op_POP,
+		[SWAP] = &&vm_op_SWAP,
+		[BADD] = &&vm_op_BADD,
+		[BSUBTRACT] = &&vm_op_BSUBTRACT,
+		[BMULTIPLY] = &&vm_op_BMULTIPLY,
+		[BDIVIDE] = &&vm_op_BDIVIDE,
+		[BMOD] = &&vm_op_BMOD,
+		[BAND] = &&vm_op_BAND,
+		[BOR] = &&vm_op_BOR,
+		[BXOR] = &&vm_op_BXOR,
+		[BNOT] = &&vm_op_BNOT,
+		[BCMP] = &&vm_op_BCMP,
+		[BLSHIFT] = &&vm_op_BLSHIFT,
+		[BRSHIFT] = &&vm_op_BRSHIFT,
+		[SADD] = &&vm_op_SADD,
+		[SSUBTRACT] = &&vm_op_SSUBTRACT,
+		[SMULTIPLY] = &&vm_op_SMULTIPLY,
+		[SDIVIDE] = &&vm_op_SDIVIDE,
+		[SMOD] = &&vm_op_SMOD,
+		[SAND] = &&vm_op_SAND,
+		[SOR] = &&vm_op_SOR,
+		[SXOR] = &&vm_op_SXOR,
+		[SNOT] = &&vm_op_SNOT,
+		[SCMP] = &&vm_op_SCMP,
+		[SLSHIFT] = &&vm_op_SLSHIFT,
+		[SRSHIFT] = &&vm_op_SRSHIFT,
+		[B2S] = &&vm_op_B2S,
+		[S2B] = &&vm_op_S2B,
+		[IFEQ] = &&vm_op_IFEQ,
+		[IFNE] = &&vm_op_IFNE,
+		[IFLT] = &&vm_op_IFLT,
+		[IFGT] = &&vm_op_IFGT,
+		[IFGE] = &&vm_op_IFGE,
+		[IFLE] = &&vm_op_IFLE,
+		[GOTO] = &&vm_op_GOTO,
+		[NOP] = &&vm_op_NOP,
+		[CALL] = &&vm_op_CALL,
+		[BRET] = &&vm_op_BRET,
+		[SRET] = &&vm_op_SRET,
+		[RET] = &&vm_op_RET,
+		[VMEXIT] = &&vm_op_VMEXIT,
+		[PRESSKEY] = &&vm_op_PRESSKEY,
+		[RELEASEKEY] = &&vm_op_RELEASEKEY,
+		[PRESSMOUSEBUTTONS] = &&vm_op_PRESSMOUSEBUTTONS,
+		[RELEASEMOUSEBUTTONS] = &&vm_op_RELEASEMOUSEBUTTONS,
+		[MOVEMOUSE] = &&vm_op_MOVEMOUSE,
+		[CHECKKEY] = &&vm_op_CHECKKEY,
+		[CHECKPHYSKEY] = &&vm_op_CHECKPHYSKEY,
+		[WAITKEY] = &&vm_op_WAITKEY,
+		[WAITPHYSKEY] = &&vm_op_WAITPHYSKEY,
+		[DELAY] = &&vm_op_DELAY,
+		[BUZZAT] = &&vm_op_BUZZAT,
+		[BUZZ] = &&vm_op_BUZZ,
+		[GETUPTIMEMS] = &&vm_op_GETUPTIMEMS,
+		[GETUPTIME] = &&vm_op_GETUPTIME
+	};
+#endif
+	uint8_t executed = 0;
+	uint8_t unchecked = 0;
+	bytecode current_instr;
+	bool cond;
+	vbyte operand, cmp_a, cmp_b;
+
+ vm_next:
+	// Instructions that leave VMRUNNING jump straight to vm_stop, so
+	// only the budget and time need checking here, and only every few
+	// instructions. The program was verified when loaded, so the
+	// instructions themselves are unchecked: only CALL checks that
+	// there's room for the method's frame and stack.
+	VM_CHECK_SLICE(goto vm_stop);
+	++executed;
+	current_instr = NEXTINSTR(vm);
+
+ vm_dispatch:
+	COUNT_DISPATCH();
 	LOG("vm step: state=%d stackheight = 0x%lx (%d) bytecode = %s (%d)\n",
 		vm->state, vm->stack_top - vm->stack, *vm->stack_top, bytecode_name(current_instr), current_instr);
 
 
 	//(while (search-forward "case " nil t) (upcase-word 1) (forward-word 2))
 
+#if VM_THREADED_DISPATCH
+	goto *VM_DISPATCH_TARGET(current_instr);
+#endif
 	switch(current_instr){
 		// local variable store
-	case BSTORE:{
+	VM_CASE(BSTORE){
 		vbyte local_addr = NEXTINSTR(vm);
 		vm->current_frame->locals[local_addr] = POP_BYTE(vm);
 		LOG("Stored to local %d\n", local_addr);
-		break;
+		VM_NEXT;
 	}
-	case BSTORE_0:
+	VM_CASE(BSTORE_0)
 		vm->current_frame->locals[0] = POP_BYTE(vm);
-		break;
-	case BSTORE_1:
+		VM_NEXT;
+	VM_CASE(BSTORE_1)
 		vm->current_frame->locals[1] = POP_BYTE(vm);
-		break;
-	case BSTORE_2:
+		VM_NEXT;
+	VM_CASE(BSTORE_2)
 		vm->current_frame->locals[2] = POP_BYTE(vm);
-		break;
-	case BSTORE_3:
+		VM_NEXT;
+	VM_CASE(BSTORE_3)
 		vm->current_frame->locals[3] = POP_BYTE(vm);
-		break;
+		VM_NEXT;
 
-	case SSTORE: {
+	VM_CASE(SSTORE) {
 		vbyte local_addr = NEXTINSTR(vm);
 		vshort val = POP_SHORT(vm);
 		AS_SHORT(vm->current_frame->locals[local_addr]) = val;
 		LOG("Stored short %d to locals %d-%d\n", val, local_addr, local_addr+1);
-		break;
+		VM_NEXT;
 	}
-	case SSTORE_0: {
+	VM_CASE(SSTORE_0) {
 		vshort val = POP_SHORT(vm);
 		AS_SHORT(vm->current_frame->locals[0]) = val;
 		LOG("Stored short %d to locals 0-1\n", val);
-		break;
+		VM_NEXT;
 	}
-	case SSTORE_1: {
+	VM_CASE(SSTORE_1) {
 		vshort val = POP_SHORT(vm);
 		AS_SHORT(vm->current_frame->locals[1]) = val;
 		LOG("Stored short %d to locals 1-2\n", val);
-		break;
+		VM_NEXT;
 	}
-	case SSTORE_2: {
+	VM_CASE(SSTORE_2) {
 		vshort val = POP_SHORT(vm);
 		AS_SHORT(vm->current_frame->locals[2]) = val;
 		LOG("Stored short %d to locals 2-3\n", val);
-		break;
+		VM_NEXT;
 	}
-	case SSTORE_3: {
+	VM_CASE(SSTORE_3) {
 		vshort val = POP_SHORT(vm);
 		AS_SHORT(vm->current_frame->locals[3]) = val;
 		LOG("Stored short %d to locals 3-4\n", val);
-		break;
+		VM_NEXT;
 	}
 
 // local variable load
 
-	case BLOAD:{
+	VM_CASE(BLOAD){
 		vbyte addr = NEXTINSTR(vm);
 		PUSH_BYTE(vm, vm->current_frame->locals[addr]);
 		LOG("Pushed local %d: %d\n", addr, vm->current_frame->locals[addr]);
-		break;
-	}
-	case BLOAD_0: {
-		PUSH_BYTE(vm, vm->current_frame->locals[0]);
-		LOG("Pushed local: %d\n", vm->current_frame->locals[0]);
-		break;
-	}
-	case BLOAD_1: {
-		PUSH_BYTE(vm, vm->current_frame->locals[1]);
-		LOG("Pushed local: %d\n", vm->current_frame->locals[1]);
-		break;
-	}
-	case BLOAD_2: {
-		PUSH_BYTE(vm, vm->current_frame->locals[2]);
-		LOG("Pushed local: %d\n", vm->current_frame->locals[2]);
-		break;
-	}
-	case BLOAD_3: {
-		PUSH_BYTE(vm, vm->current_frame->locals[3]);
-		LOG("Pushed local: %d\n", vm->current_frame->locals[3]);
-		break;
-	}
-
-	case SLOAD: {
+		VM_NEXT;
+	}
+	VM_CASE(BLOAD_0)
+		operand = vm->current_frame->locals[0];
+		LOG("Pushed local: %d\n", operand);
+		goto vm_push_operand;
+	VM_CASE(BLOAD_1)
+		operand = vm->current_frame->locals[1];
+		LOG("Pushed local: %d\n", operand);
+		goto vm_push_operand;
+	VM_CASE(BLOAD_2)
+		operand = vm->current_frame->locals[2];
+		LOG("Pushed local: %d\n", operand);
+		goto vm_push_operand;
+	VM_CASE(BLOAD_3)
+		operand = vm->current_frame->locals[3];
+		LOG("Pushed local: %d\n", operand);
+		goto vm_push_operand;
+
+	VM_CASE(SLOAD) {
 		vbyte addr = NEXTINSTR(vm);
 		vshort val = AS_SHORT(vm->current_frame->locals[addr]);
 		LOG("Pushed short from local %d-%d: %d\n", addr, addr+1, val);
 		PUSH_SHORT(vm, val);
-		break;
+		VM_NEXT;
 	}
-	case SLOAD_0: {
+	VM_CASE(SLOAD_0) {
 		vshort val = AS_SHORT(vm->current_frame->locals[0]);
 		PUSH_SHORT(vm, val);
 		LOG("Pushed short from local 0-1: %d\n", val);
-		break;
+		VM_NEXT;
 	}
-	case SLOAD_1: {
+	VM_CASE(SLOAD_1) {
 		vshort val = AS_SHORT(vm->current_frame->locals[1]);
 		PUSH_SHORT(vm, val);
 		LOG("Pushed short from local 1-2: %d\n", val);
-		break;
+		VM_NEXT;
 	}
-	case SLOAD_2: {
+	VM_CASE(SLOAD_2) {
 		vshort val = AS_SHORT(vm->current_frame->locals[2]);
 		PUSH_SHORT(vm, val);
 		LOG("Pushed short from local 2-3: %d\n", val);
-		break;
+		VM_NEXT;
 	}
-	case SLOAD_3: {
+	VM_CASE(SLOAD_3) {
 		vshort val = AS_SHORT(vm->current_frame->locals[3]);
 		PUSH_SHORT(vm, val);
 		LOG("Pushed short from local 3-4: %d\n", val);
-		break;
+		VM_NEXT;
 	}
 
 		// global variable store/load
 
-	case GBSTORE: {
+	VM_CASE(GBSTORE) {
 		vbyte addr = NEXTINSTR(vm);
 		vm->stack[addr] = POP_BYTE(vm);
 		LOG("Stored to global %d\n", addr);
-		break;
+		VM_NEXT;
 	}
-	case GSSTORE: {
+	VM_CASE(GSSTORE) {
 		vbyte addr = NEXTINSTR(vm);
 		vshort val = POP_SHORT(vm);
 		AS_SHORT(vm->stack[addr]) = val;
 		LOG("Stored short %d to global %d-%d\n", val, addr, addr+1);
-		break;
+		VM_NEXT;
 	}
-	case GBLOAD: {
+	VM_CASE(GBLOAD) {
 		vbyte addr = NEXTINSTR(vm);
 		vbyte val = vm->stack[addr];
 		PUSH_BYTE(vm, val);
 		LOG("Pushed %d from global %d\n", val, addr);
-		break;
+		VM_NEXT;
 	}
-	case GSLOAD: {
+	VM_CASE(GSLOAD) {
 		vbyte addr = NEXTINSTR(vm);
 		vshort val = AS_SHORT(vm->stack[addr]);
 		PUSH_SHORT(vm, val);
 		LOG("Pushed short %d from global %d-%d\n", val, addr, addr+1);
-		break;
+		VM_NEXT;
 	}
 
 		// immediate value push
 
-	case BCONST:{
+	VM_CASE(BCONST){
 		vbyte c = NEXTINSTR(vm);
 		PUSH_BYTE(vm, c);
 		LOG("Pushed %d\n", c);
-		break;
-	}
-	case BCONST_0:
-		PUSH_BYTE(vm, 0);
-		break;
-	case BCONST_1:
-		PUSH_BYTE(vm, 1);
-		break;
-	case BCONST_2:
-		PUSH_BYTE(vm, 2);
-		break;
-	case BCONST_3:
-		PUSH_BYTE(vm, 3);
-		break;
-
-	case SCONST: {
+		VM_NEXT;
+	}
+	VM_CASE(BCONST_0)
+		operand = 0;
+		goto vm_push_operand;
+	VM_CASE(BCONST_1)
+		operand = 1;
+		goto vm_push_operand;
+	VM_CASE(BCONST_2)
+		operand = 2;
+		goto vm_push_operand;
+	VM_CASE(BCONST_3)
+		operand = 3;
+		// BLOAD_n and BCONST_n are mostly followed by an add, a compare
+		// or a branch, which can take the operand without it going
+		// through the stack and another dispatch.
+	vm_push_operand:
+		VM_FETCH_NEXT();
+		switch(current_instr){
+		case BADD:
+			LOG("%d + %d = %d\n", TOP_BYTE(vm), operand, (vbyte) (TOP_BYTE(vm) + operand));
+			TOP_BYTE(vm) += operand;
+			VM_NEXT;
+		case BCMP:
+			cmp_b = operand;
+			cmp_a = POP_BYTE(vm);
+			goto vm_bcmp;
+		case IFEQ ... IFLE:
+			cond = vm_if_check(current_instr, operand);
+			goto vm_branch;
+		default:
+			PUSH_BYTE(vm, operand);
+			VM_DISPATCH;
+		}
+
+	VM_CASE(SCONST) {
 		vshort s = NEXTSHORT(vm);
 		PUSH_SHORT(vm, s);
 		LOG("Pushed short %d\n", s);
-		break;
+		VM_NEXT;
 	}
-	case SCONST_0:
+	VM_CASE(SCONST_0)
 		PUSH_SHORT(vm, 0);
-		break;
-	case SCONST_1:
+		VM_NEXT;
+	VM_CASE(SCONST_1)
 		PUSH_SHORT(vm, 1);
-		break;
-	case SCONST_2:
+		VM_NEXT;
+	VM_CASE(SCONST_2)
 		PUSH_SHORT(vm, 2);
-		break;
-	case SCONST_3:
+		VM_NEXT;
+	VM_CASE(SCONST_3)
 		PUSH_SHORT(vm, 3);
-		break;
+		VM_NEXT;
 
 		// Stack manipulation
-	case DUP: {
+	VM_CASE(DUP) {
 		vbyte top = TOP_BYTE(vm);
 		PUSH_BYTE(vm, top);
-		break;
+		VM_NEXT;
 	}
-	case DUP2: {
+	VM_CASE(DUP2) {
 		vshort top = TOP_SHORT(vm);
 		PUSH_SHORT(vm, top);
 		LOG("Dup2 short %d\n", top);
-		break;
+		VM_NEXT;
 	}
 
-	case POP2:
+	VM_CASE(POP2)
 		POP_BYTE(vm);
-	case POP:
+	VM_CASE(POP)
 		POP_BYTE(vm);
-		break;
-	case SWAP: {
+		VM_NEXT;
+	VM_CASE(SWAP) {
 		vbyte top = TOP_BYTE(vm);
 		TOP_BYTE(vm) = (&TOP_BYTE(vm))[-1];
 		(&TOP_BYTE(vm))[-1] = top;
-		break;
+		VM_NEXT;
 	}
 		// Arithmetic
 
-	case BADD: {
+	VM_CASE(BADD) {
 		vbyte b = POP_BYTE(vm);
 		vbyte a = POP_BYTE(vm);
 		LOG("%d + %d = %d\n", a, b, a+b);
 		PUSH_BYTE(vm, a + b);
-		break;
+		VM_NEXT;
 	}
-	case BSUBTRACT: {
+	VM_CASE(BSUBTRACT) {
 		vbyte b = POP_BYTE(vm);
 		vbyte a = POP_BYTE(vm);
 		LOG("%d - %d = %d\n", a, b, a-b);
 		PUSH_BYTE(vm, a - b);
-		break;
+		VM_NEXT;
 	}
-	case BMULTIPLY: {
+	VM_CASE(BMULTIPLY) {
 		vbyte b = POP_BYTE(vm);
 		vbyte a = POP_BYTE(vm);
 		LOG("%d * %d = %d\n", a, b, a*b);
 		PUSH_BYTE(vm, a * b);
-		break;
+		VM_NEXT;
 	}
-	case BDIVIDE: {
+	VM_CASE(BDIVIDE) {
 		vbyte b = POP_BYTE(vm);
 		vbyte a = POP_BYTE(vm);
 		LOG("%d / %d = %d\n", a, b, a/b);
 		PUSH_BYTE(vm, a / b);
-		break;
+		VM_NEXT;
 	}
-	case BMOD: {
+	VM_CASE(BMOD) {
 		vbyte b = POP_BYTE(vm);
 		vbyte a = POP_BYTE(vm);
 		LOG("%d %% %d = %d\n", a, b, a%b);
 		PUSH_BYTE(vm, a % b);
-		break;
+		VM_NEXT;
 	}
-	case BAND: {
+	VM_CASE(BAND) {
 		vbyte b = POP_BYTE(vm);
 		vbyte a = POP_BYTE(vm);
 		LOG("%d & %d = %d\n", a, b, a&b);
 		PUSH_BYTE(vm, a & b);
-		break;
+		VM_NEXT;
 	}
-	case BOR: {
+	VM_CASE(BOR) {
 		vbyte b = POP_BYTE(vm);
 		vbyte a = POP_BYTE(vm);
 		LOG("%d | %d = %d\n", a, b, a|b);
 		PUSH_BYTE(vm, a | b);
-		break;
+		VM_NEXT;
 	}
-	case BXOR: {
+	VM_CASE(BXOR) {
 		vbyte b = POP_BYTE(vm);
 		vbyte a = POP_BYTE(vm);
 		LOG("%d ^ %d = %d\n", a, b, a^b);
 		PUSH_BYTE(vm, a ^ b);
-		break;
+		VM_NEXT;
 	}
-	case BNOT: {
+	VM_CASE(BNOT) {
 		vbyte x = POP_BYTE(vm);
 		LOG("~%d = %d\n", x, ~x);
 		PUSH_BYTE(vm, ~x);
-		break;
+		VM_NEXT;
 	}
-	case BCMP: {
-		vbyte b = POP_BYTE(vm);
-		vbyte a = POP_BYTE(vm);
-		vbyte r = (a > b) ? 1 : (a == b) ? 0 : -1;
-		LOG("%d <> %d = %d\n", a, b, r);
-		PUSH_BYTE(vm, r);
-		break;
+	VM_CASE(BCMP)
+		cmp_b = POP_BYTE(vm);
+		cmp_a = POP_BYTE(vm);
+	vm_bcmp: {
+		vbyte r = (cmp_a > cmp_b) ? 1 : (cmp_a == cmp_b) ? 0 : -1;
+		LOG("%d <> %d = %d\n", cmp_a, cmp_b, r);
+		VM_FUSE_BRANCH(r);
 	}
-	case BLSHIFT: {
+	VM_CASE(BLSHIFT) {
 		vbyte s = POP_BYTE(vm);
 		vbyte v = POP_BYTE(vm);
 		LOG("%d << %d = %d\n", v, s, v << s);
 		PUSH_BYTE(vm, v << s);
-		break;
+		VM_NEXT;
 	}
-	case BRSHIFT: {
+	VM_CASE(BRSHIFT) {
 		vbyte s = POP_BYTE(vm);
 		vbyte v = POP_BYTE(vm);
 		LOG("%d >> %d = %d\n", v, s, v >> s);
 		PUSH_BYTE(vm, v >> s);
-		break;
+		VM_NEXT;
 	}
-	case SADD: {
+	VM_CASE(SADD) {
 		vshort b = POP_SHORT(vm);
 		vshort a = POP_SHORT(vm);
 		LOG("%d + %d = %d\n", a, b, a+b);
 		PUSH_SHORT(vm, a + b);
-		break;
+		VM_NEXT;
 	}
-	case SSUBTRACT: {
+	VM_CASE(SSUBTRACT) {
 		vshort b = POP_SHORT(vm);
 		vshort a = POP_SHORT(vm);
 		LOG("%d - %d = %d\n", a, b, a-b);
 		PUSH_SHORT(vm, a - b);
-		break;
+		VM_NEXT;
 	}
-	case SMULTIPLY: {
+	VM_CASE(SMULTIPLY) {
 		vshort b = POP_SHORT(vm);
 		vshort a = POP_SHORT(vm);
 		LOG("%d * %d = %d\n", a, b, a*b);
 		PUSH_SHORT(vm, a * b);
-		break;
+		VM_NEXT;
 	}
-	case SDIVIDE: {
+	VM_CASE(SDIVIDE) {
 		vshort b = POP_SHORT(vm);
 		vshort a = POP_SHORT(vm);
 		LOG("%d / %d = %d\n", a, b, a/b);
 		PUSH_SHORT(vm, a / b);
-		break;
+		VM_NEXT;
 	}
-	case SMOD: {
+	VM_CASE(SMOD) {
 		vshort b = POP_SHORT(vm);
 		vshort a = POP_SHORT(vm);
 		LOG("%d %% %d = %d\n", a, b, a%b);
 		PUSH_SHORT(vm, a % b);
-		break;
+		VM_NEXT;
 	}
-	case SAND: {
+	VM_CASE(SAND) {
 		vshort b = POP_SHORT(vm);
 		vshort a = POP_SHORT(vm);
 		LOG("%d & %d = %d\n", a, b, a&b);
 		PUSH_SHORT(vm, a & b);
-		break;
+		VM_NEXT;
 	}
-	case SOR: {
+	VM_CASE(SOR) {
 		vshort b = POP_SHORT(vm);
 		vshort a = POP_SHORT(vm);
 		LOG("%d | %d = %d\n", a, b, a|b);
 		PUSH_SHORT(vm, a | b);
-		break;
+		VM_NEXT;
 	}
-	case SXOR: {
+	VM_CASE(SXOR) {
 		vshort b = POP_SHORT(vm);
 		vshort a = POP_SHORT(vm);
 		LOG("%d ^ %d = %d\n", a, b, a^b);
 		PUSH_SHORT(vm, a ^ b);
-		break;
+		VM_NEXT;
 	}
-	case SNOT: {
+	VM_CASE(SNOT) {
 		vshort x = POP_SHORT(vm);
 		LOG("~%d = %d\n", x, ~x);
 		PUSH_SHORT(vm, ~x);
-		break;
+		VM_NEXT;
 	}
-	case SCMP: {
+	VM_CASE(SCMP) {
 		vshort b = POP_SHORT(vm);
 		vshort a = POP_SHORT(vm);
 		vbyte r = (a > b) ? 1 : (a == b) ? 0 : -1;
 		LOG("%d <> %d = %d\n", a, b, r);
-		PUSH_BYTE(vm, r);
-		break;
+		VM_FUSE_BRANCH(r);
 	}
-	case SLSHIFT: {
+	VM_CASE(SLSHIFT) {
 		vbyte s = POP_BYTE(vm);
 		vshort v = POP_SHORT(vm);
 		LOG("%d << %d = %d\n", v, s, v << s);
 		PUSH_SHORT(vm, v << s);
-		break;
+		VM_NEXT;
 	}
-	case SRSHIFT: {
+	VM_CASE(SRSHIFT) {
 		vbyte s = POP_BYTE(vm);
 		vshort v = POP_SHORT(vm);
 		LOG("%d >> %d = %d\n", v, s, v >> s);
 		PUSH_SHORT(vm, v >> s);
-		break;
+		VM_NEXT;
 	}
-	case B2S: {
+	VM_CASE(B2S) {
 		vbyte b = POP_BYTE(vm);
 		vshort s = (vshort) b;
 		LOG("(short)0x%hx = 0x%hhx\n", b, s);
 		PUSH_SHORT(vm, s);
-		break;
+		VM_NEXT;
 	}
-	case S2B: {
+	VM_CASE(S2B) {
 		vshort s = POP_SHORT(vm);
 		vshort b = (vbyte) s;
 		LOG("(byte)0x%hhx = 0x%hx\n", s, b);
 		PUSH_BYTE(vm, b);
-		break;
-	}
-	case IFEQ:
-	case IFNE:
-	case IFLT:
-	case IFGT:
-	case IFGE:
-	case IFLE: {
-		vbyte val = POP_BYTE(vm);
-		if(!vm_if_check(current_instr, val)){
+		VM_NEXT;
+	}
+	VM_CASE(IFEQ)
+		cond = POP_BYTE(vm) == 0;
+		goto vm_branch;
+	VM_CASE(IFNE)
+		cond = POP_BYTE(vm) != 0;
+		goto vm_branch;
+	VM_CASE(IFLT)
+		cond = POP_BYTE(vm) < 0;
+		goto vm_branch;
+	VM_CASE(IFGT)
+		cond = POP_BYTE(vm) > 0;
+		goto vm_branch;
+	VM_CASE(IFGE)
+		cond = POP_BYTE(vm) >= 0;
+		goto vm_branch;
+	VM_CASE(IFLE)
+		cond = POP_BYTE(vm) <= 0;
+	vm_branch:
+		if(!cond){
 			LOG("false\n");
 			vm->ip += 2; // skip the offset values
-			break;
-		}
-		else{
-			LOG("true\n"); // fall through to goto
+			VM_NEXT;
 		}
-	}
-	case GOTO: {
+		LOG("true\n"); // fall through to goto
+	VM_CASE(GOTO) {
 		// read signed little-endian immediate value (signed => can go backwards)
 		vshort offset = NEXTSHORT(vm);
 		LOG("jumping %d instructions from goto\n", offset);
 		vm->ip += offset - 3; // IP is 3 instructions ahead of goto
-		break;
+		VM_NEXT;
 	}
 
-	case NOP:
-		break;
+	VM_CASE(NOP)
+		VM_NEXT;
 
-	case CALL:{
-		vbyte methodid = NEXTINSTR(vm);
+	VM_CASE(CALL){
+		uint8_t methodid = NEXTINSTR(vm); // unsigned, as the verifier checked it
 		method method;
 		READ_EEPROM_TO(&method, &vm->program->methods[methodid]);
 		vbyte args_tmp[method.nargs];
@@ -752,6 +1507,13 @@ static void vm_step(vmstate* vm){
 		}
 		LOG("]\n");
 
+		// room for the frame, and the deepest stack of any method
+		if(vm->stack_top + sizeof(stack_frame) + method.nlocals + vm->max_depth > &vm->stack[STACK_SIZE-1]){
+			LOG("Stack overflow!\n");
+			vm->state = VMCRASHED;
+			VM_STOP;
+		}
+
 		// create new stack frame
 		vm->stack_top++;
 		stack_frame* new_frame = (stack_frame*) vm->stack_top;
@@ -764,65 +1526,65 @@ static void vm_step(vmstate* vm){
 		vm->current_frame = new_frame;
 		vm->stack_top += sizeof(stack_frame) + method.nlocals - 1;
 		vm->ip = &vm->code[method.code_offset];
-		break;
+		VM_NEXT;
 	}
-	case BRET: {
+	VM_CASE(BRET) {
 		if(vm->current_frame->return_addr == 0){
 			LOG("Returning from main, stopping\n");
 			vm->state = VMSTOPPED;
-			return; // return from main
+			VM_STOP; // return from main
 		}
 		vbyte rv = POP_BYTE(vm);
 		LOG("Returning %d\n", rv);
 		vm_do_return(vm);
 		PUSH_BYTE(vm, rv);
-		break;
+		VM_NEXT;
 	}
-	case SRET: {
+	VM_CASE(SRET) {
 		if(vm->current_frame->return_addr == 0){
 			LOG("Returning from main, stopping\n");
 			vm->state = VMSTOPPED;
-			return; // return from main
+			VM_STOP; // return from main
 		}
 		vshort rv = POP_SHORT(vm);
 		LOG("Returning %d\n", rv);
 		vm_do_return(vm);
 		PUSH_SHORT(vm, rv);
-		break;
+		VM_NEXT;
 	}
-	case RET: {
+	VM_CASE(RET) {
 		if(vm->current_frame->return_addr == 0){
 			LOG("Returning from main, stopping\n");
 			vm->state = VMSTOPPED;
-			return; // return from main
+			VM_STOP; // return from main
 		}
 		vm_do_return(vm);
-		break;
+		VM_NEXT;
 	}
-	case VMEXIT:
+	VM_CASE(VMEXIT)
 		LOG("Exit called, stopping");
 		vm->state = VMSTOPPED;
-		return;
-	case PRESSKEY: {
+		VM_STOP;
+	VM_CASE(PRESSKEY) {
 		hid_keycode key = (hid_keycode) POP_BYTE(vm);
 		LOG("Press Key: %d\n", key);
 		if(key >= SPECIAL_HID_KEYS_START){
 			// mouse is handled separately from keys
-			break;
+			VM_NEXT;
 		}
 		ExtraKeyboardReport_add(&vm->keyboardreport, key);
 		vm->state = VMWAITREPORT;
-		break;
+		VM_STOP;
 	}
-	case RELEASEKEY: {
+	VM_CASE(RELEASEKEY) {
 		hid_keycode key = (hid_keycode) POP_BYTE(vm);
 		LOG("Release Key: %d\n", key);
 		ExtraKeyboardReport_remove(&vm->keyboardreport, key);
 		vm->state = VMWAITREPORT;
-		break;
+		VM_STOP;
 	}
-	case PRESSMOUSEBUTTONS:
-	case RELEASEMOUSEBUTTONS: {
+	VM_CASE(PRESSMOUSEBUTTONS)
+	VM_CASE(RELEASEMOUSEBUTTONS) {
 		uint8_t mask = (uint8_t) POP_BYTE(vm);
 		mask &= 0x1f;
 		if(current_instr == PRESSMOUSEBUTTONS){
@@ -832,79 +1594,102 @@ static void vm_step(vmstate* vm){
 			vm->mousereport.Button &= ~mask;
 		}
 		vm->state = VMWAITMOUSEREPORT;
-		break;
+		VM_STOP;
 	}
-	case MOVEMOUSE: {
+	VM_CASE(MOVEMOUSE) {
 		vbyte y = POP_BYTE(vm);
 		vbyte x = POP_BYTE(vm);
 		vm->mousereport.X = x;
 		vm->mousereport.Y = y;
 		vm->state = VMWAITMOUSEREPORT;
-		break;
+		VM_STOP;
 	}
-	case CHECKKEY: {
+	VM_CASE(CHECKKEY) {
 		hid_keycode key = (hid_keycode) POP_BYTE(vm);
 		LOG("Check KEY: %d\n", key);
 		uint8_t foundidx = keystate_check_hid_key(key);
 		PUSH_BYTE(vm, (foundidx != NO_KEY));
-		break;
+		VM_NEXT;
 	}
-	case CHECKPHYSKEY: {
+	VM_CASE(CHECKPHYSKEY) {
 		logical_keycode lkey = (logical_keycode) POP_BYTE(vm);
 		if(lkey == 0){ lkey = vm->trigger_lkey; }
 		uint8_t ispressed = keystate_check_key(lkey, LOGICAL); // keypad should be differentiated
 		PUSH_BYTE(vm, ispressed);
-		break;
+		VM_NEXT;
 	}
-	case WAITKEY:
+	VM_CASE(WAITKEY)
 		LOG("WaitKey:");
 		vm->state = VMWAITKEY;
 		goto wait_rest;
-	case WAITPHYSKEY:
+	VM_CASE(WAITPHYSKEY)
 		LOG("WaitPhysKey:");
 		vm->state = VMWAITPHYSKEY;
 	wait_rest: {
 			vshort delay = POP_SHORT(vm);
 			vm->wait_key = POP_BYTE(vm);
 			LOG("%d (timeout %d)\n", vm->wait_key, delay);
-			if(delay <= 0){
-				vm->delay_end_ms = 0;
+			if(vm->state == VMWAITPHYSKEY && vm->wait_key == 0){
+				vm->wait_key = vm->trigger_lkey;
 			}
-			else{
+
+			// The key may already be down: otherwise wait for it
+			// to be checked again when a key event arrives
+			vm_check_wait(vm, false);
+			if(vm->state == VMRUNNING) VM_NEXT;
+			if(delay > 0){
 				vm->delay_end_ms = uptimems() + delay;
+				vm_timer_add(vm);
 			}
-			break;
+			VM_STOP;
 		}
-	case DELAY: {
+	VM_CASE(DELAY) {
 		vshort delay = POP_SHORT(vm);
 		if(delay < 0) delay = 0;
 		vm->delay_end_ms = uptimems() + delay;
 		vm->state = VMDELAY;
-		break;
+		vm_timer_add(vm);
+		VM_STOP;
 	}
-	case BUZZAT:;
+	VM_CASE(BUZZAT);
 		vbyte freq = POP_BYTE(vm);
 		goto buzz;
-	case BUZZ:
+	VM_CASE(BUZZ)
 		freq = BUZZER_DEFAULT_TONE;
 	buzz: {
 		vshort delay = POP_SHORT(vm);
 		if(delay > 0){
 			buzzer_start_f(delay, (uint8_t) freq);
 		}
-		break;
+		VM_NEXT;
 	}
-	case GETUPTIMEMS: {
+	VM_CASE(GETUPTIMEMS) {
 		vshort ms = uptimems() & 0x7fff;
 		PUSH_SHORT(vm, ms);
-		break;
+		VM_NEXT;
 	}
-	case GETUPTIME: {
+	VM_CASE(GETUPTIME) {
 		vshort ms = (uptimems() / 1000) & 0x7fff;
 		PUSH_SHORT(vm, ms);
-		break;
+		VM_NEXT;
 	}
 	}
+#if VM_THREADED_DISPATCH
+ vm_op_invalid:
+#endif
+	VM_NEXT; // unknown instructions are skipped
+
+ vm_fetched:
+	// An instruction fetched but not taken by a fast path has the checks
+	// it would have had in vm_next, and is left to be fetched again if
+	// they end the slice.
+	--executed;
+	VM_CHECK_SLICE({ --vm->ip; goto vm_stop; });
+	++executed;
+	goto vm_dispatch;
+
+ vm_stop:
+	return executed;
 }
 
 
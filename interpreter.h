@@ -47,10 +47,10 @@
 #define __INTERPRETER_H
 
 #include <stdint.h>
-
-#include "extrareport.h"
+#include <stdbool.h>
 
 #ifndef DEBUG // not used by interpreter debug harness
+#include "extrareport.h"
 #include "keystate.h"
 #endif
 
@@ -237,7 +237,7 @@ typedef struct __attribute__((__packed__)) _stack_frame { // stack frames live w
 	vbyte locals[1];
 } stack_frame;
 
-#ifdef DEBUG
+#if defined(DEBUG) && !defined(__AVR__)
 #define STACK_SIZE 1024 // bytes
 #else
 #define STACK_SIZE 96 // bytes
@@ -247,6 +247,10 @@ typedef struct __attribute__((__packed__)) _vmstate {
 	enum __attribute__((__packed__)) { VMSTOPPED, VMCRASHED, VMNOPROGRAM, VMRUNNING, VMWAITREPORT, VMWAITMOUSEREPORT, VMDELAY, VMWAITKEY, VMWAITPHYSKEY } state;
 	// uptimems at which our current delay or waitkey ends
 	uint32_t delay_end_ms;
+	// whether we're in the timer list, and if so the index of the VM
+	// with the next later delay_end_ms
+	bool timer_linked;
+	uint8_t timer_next;
 	// key that we're waiting for
 	hid_keycode wait_key;
 	// the physical key that triggered this program
@@ -256,9 +260,23 @@ typedef struct __attribute__((__packed__)) _vmstate {
 	MouseReport_Data_t mousereport;
 
 	const program* program;
+	uint16_t program_len;
+#if PROGRAM_ARENA_SIZE > 0
+	// the program's hottest code, found by the verifier: all of it if it
+	// fits the SRAM code arena, otherwise its largest loop that fits, or
+	// the method containing it. Empty if there's no such loop.
+	const bytecode* hot_code;
+	uint16_t hot_len;
+	// copy of the hot code in the arena, and its length: 0 if it's all
+	// run from storage. Kept after the VM stops until the space is reused.
+	const bytecode* arena_code;
+	uint16_t arena_len;
+#endif
 	const bytecode* code;
 
 	const bytecode* ip;
+	// deepest operand stack use of any method, from the verifier
+	uint8_t max_depth;
 
 	vbyte* stack_top;
 	stack_frame* current_frame; // points within stack
@@ -266,11 +284,52 @@ typedef struct __attribute__((__packed__)) _vmstate {
 	vbyte stack[STACK_SIZE];
 } vmstate;
 
+// Result of verifying a program when the VMs are initialized. Programs
+// that fail aren't run.
+typedef enum __attribute__((__packed__)) _vm_verify_result {
+	VERIFY_OK,
+	VERIFY_NO_PROGRAM,
+	VERIFY_READ_ERROR,
+	VERIFY_BAD_HEADER,      // bad method table, or a method with more args than locals
+	VERIFY_BAD_INSTRUCTION, // unknown opcode, or operands past the end of the method
+	VERIFY_BAD_JUMP,        // jump outside the method or into an instruction
+	VERIFY_BAD_LOCAL,
+	VERIFY_BAD_GLOBAL,
+	VERIFY_BAD_METHOD,      // call to a method that doesn't exist
+	VERIFY_BAD_RETURN,      // returns of different sizes in one method
+	VERIFY_FALLS_OFF_END,   // execution can run past the end of a method
+	VERIFY_STACK_UNDERFLOW,
+	VERIFY_STACK_MISMATCH,  // different stack depths where paths join
+	VERIFY_STACK_OVERFLOW,  // main doesn't fit on the stack with the deepest method
+	VERIFY_TOO_COMPLEX,     // too many jump targets in one method to verify
+} vm_verify_result;
+
+// Verification status of each program, readable over USB with the
+// READ_PROGRAM_STATUS vendor request.
+typedef struct __attribute__((__packed__)) _vm_program_status {
+	uint8_t result;    // vm_verify_result
+	uint8_t method;    // method that failed verification
+	uint16_t offset;   // from the start of the program, of the instruction that failed
+	uint8_t max_depth; // deepest operand stack use of any method
+} vm_program_status;
+
 /**
  * Initialize the virtual machines: load programs from eeprom memory and reset each VM to default halted state.
+ * Programs that fail verification are treated as not present.
  */
 void vm_init(void);
 
+/**
+ * Stop every VM and treat its program as not present, while the programs
+ * are rewritten. Only vm_init() can make them runnable again.
+ */
+void vm_stop_all(void);
+
+/**
+ * Verification status of each of the PROGRAM_COUNT programs, as of the last vm_init()
+ */
+vm_program_status* vm_get_program_status(void);
+
 /**
  * Start or restart a VM that has exit or crashed
  */
@@ -284,7 +343,7 @@ void vm_step_all(void);
 /**
  * add the pressed key status of every running VM to an existing keyboard report
  */
-void vm_append_KeyboardReport(KeyboardReport_Data_t* report);
+void vm_append_KeyboardReport(KeyboardReportBitmap* report);
 
 /**
  * Add the mouse status of every running VM to an existing keyboard report
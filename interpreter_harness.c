@@ -1,4 +1,15 @@
-// Fake API for test harness
+// Fake API for test harness. Build with
+//   gcc -DDEBUG -std=gnu99 -fshort-enums -o interpreter interpreter.c
+// and run "interpreter <binary>" to trace a program, or "interpreter -b
+// <binary>" to benchmark it. Add -DPROGRAM_ARENA_SIZE=0 to benchmark it
+// running from storage rather than the arena, or a board's arena size to
+// benchmark it with only its hot code in the arena if it doesn't fit.
+//
+// To count AVR cycles, build the benchmark into an AVR binary with
+//   avr-gcc -mmcu=atmega32u4 -DF_CPU=16000000 -DDEBUG -std=gnu99 -fshort-enums -Os
+//     -DBENCH_PROGRAM="$(xxd -i < <binary> | tr -d '\n')" -o interpreter.elf interpreter.c
+// and run it with "simavr -m atmega32u4 -f 16000000 interpreter.elf".
+// Add -DVM_THREADED_DISPATCH=1 to compare threaded dispatch.
 
 #define HID_KEYBOARD_SC_LEFT_CONTROL 0xE0
 #define SPECIAL_HID_KEYS_START 0xE7
@@ -7,29 +18,114 @@
 typedef uint8_t hid_keycode;
 typedef uint8_t logical_keycode;
 #define NO_KEY 0xFF
-#define KEYBOARDREPORT_KEY_COUNT 6
-typedef struct _kbdr {int Modifier; int KeyCode[KEYBOARDREPORT_KEY_COUNT];} KeyboardReport_Data_t;
+typedef struct _kbdr {uint8_t Modifier; uint8_t Keys[0xE0 / 8];} KeyboardReportBitmap;
 typedef struct _msr {uint8_t X; uint8_t Y; uint8_t Button;} MouseReport_Data_t;
+typedef struct _ekr {uint8_t Keys[0xE0 / 8];} ExtraKeyboardReport;
+
+#define BUZZER_DEFAULT_TONE 110
+
+#define PROGRAM_COUNT 1
+#ifndef PROGRAM_ARENA_SIZE
+#ifdef __AVR__
+#define PROGRAM_ARENA_SIZE 128
+#else
+#define PROGRAM_ARENA_SIZE 1024
+#endif
+#endif
 
 #include "interpreter.h"
 
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#ifdef __AVR__
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#else
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/time.h>
+#endif
+
+static bool harness_verbose = true;
+static unsigned long harness_reads = 0;
+static unsigned long harness_steps = 0;
+static unsigned long harness_dispatches = 0;
+
+#define PROGRAM_SLICE_INSTRUCTIONS 16
+#ifndef __AVR__
+#define PROGMEM
+#define pgm_read_byte(p) (*(p))
+#define pgm_read_word(p) (*(p))
+#endif
+#ifndef VM_THREADED_DISPATCH
+#define VM_THREADED_DISPATCH 0
+#endif
+#define PROGRAM_SLICE_TICKS 125
+
+// fake Timer1 ticks, at 250 per millisecond. The host clock costs far
+// more to read than the AVR's timer, so the benchmark just counts reads,
+// which leaves slices to be ended by their instruction budget.
+static uint16_t stats_ticks(void){
+	static uint16_t bench_ticks = 0;
+	if(!harness_verbose) return ++bench_ticks;
+#ifdef __AVR__
+	return bench_ticks;
+#else
+	struct timeval time;
+	gettimeofday(&time, NULL);
+	return (uint16_t) ((time.tv_sec * 1000000 + time.tv_usec) / 4);
+#endif
+}
+static void stats_vm_slice(uint16_t ticks, uint16_t steps){
+	harness_steps += steps;
+}
+
+static void USB_KeepAlive(uint8_t poll){}
+
+// fake key event ring, in which an event arrives before every pass
+typedef uint8_t key_event_cursor;
+static key_event_cursor keystate_event_cursor(void){
+	static key_event_cursor cursor = 0;
+	return ++cursor;
+}
 
 #define FAKE_OFFSET 100000
 // fake read
 int16_t serial_eeprom_read(const uint8_t* addr, uint8_t* buf, int16_t len){
 	const uint8_t* real_addr = addr - FAKE_OFFSET;
 	memcpy(buf, real_addr, len);
+	++harness_reads;
 	return len;
 }
 int8_t serial_eeprom_errno = 1;
 
+#define PROGRAM_STORAGE fake
+#define storage_read(storage_type, addr, buf, len) serial_eeprom_read(addr, buf, len)
+#define storage_errno serial_eeprom_errno
+
+void ExtraKeyboardReport_clear(ExtraKeyboardReport* r){
+	memset(r, 0, sizeof(ExtraKeyboardReport));
+}
+void ExtraKeyboardReport_add(ExtraKeyboardReport* r, hid_keycode key){
+	LOG("Pressing key %d\n", key);
+}
+void ExtraKeyboardReport_remove(ExtraKeyboardReport* r, hid_keycode key){
+	LOG("Releasing key %d\n", key);
+}
+void ExtraKeyboardReport_append(ExtraKeyboardReport* extra, KeyboardReportBitmap* report){
+}
+
+// Programs' delays never end on the AVR, which only benchmarks
+#ifdef __AVR__
+uint32_t uptimems(){
+	return 0;
+}
+#else
 uint32_t uptimems(){
 	static uint64_t boot_time_ms = 0ll;
 	struct timeval time;
@@ -43,10 +139,10 @@ uint32_t uptimems(){
 
 	return (uint32_t) (time_ms - boot_time_ms);
 }
-
-#define NUM_PROGRAMS 1
+#endif
 
 const program* loaded_program;
+uint16_t loaded_program_length;
 
 const program* config_get_program(int i){
 	if(i == 0){
@@ -57,19 +153,142 @@ const program* config_get_program(int i){
 	}
 }
 
+uint16_t config_get_program_length(int i){
+	return i == 0 ? loaded_program_length : 0;
+}
+
+// Runs the program (restarting it whenever it stops) for a second, and
+// reports the instructions executed per second, host CPU cycles (where
+// the timestamp counter can be read) and program reads per
+// instruction, and how many instructions were dispatched rather than
+// taken by a fast path. Programs that wait for keys, reports or delays will
+// spend their time in restarts rather than instructions.
+static void harness_init(void){
+	vm_init();
+	vm_program_status* status = vm_get_program_status();
+	if(status->result != VERIFY_OK){
+		printf("Program failed verification: error %d in method %d at offset %d\n",
+			   status->result, status->method, status->offset);
+		exit(1);
+	}
+	LOG("Program verified, maximum stack depth %d\n", status->max_depth);
+}
+
+#ifdef __AVR__
+
+// The benchmarked program's bytes, from BENCH_PROGRAM
+static const uint8_t bench_program[] = { BENCH_PROGRAM };
+
+// simavr prints what's sent from the UART
+#ifdef UDR1
+#define HARNESS_UDR UDR1
+#define HARNESS_UCSRA UCSR1A
+#define HARNESS_UCSRB UCSR1B
+#define HARNESS_UDRE UDRE1
+#define HARNESS_TXEN TXEN1
+#else
+#define HARNESS_UDR UDR
+#define HARNESS_UCSRA UCSRA
+#define HARNESS_UCSRB UCSRB
+#define HARNESS_UDRE UDRE
+#define HARNESS_TXEN TXEN
+#endif
+
+static int harness_putchar(char c, FILE* stream){
+	loop_until_bit_is_set(HARNESS_UCSRA, HARNESS_UDRE);
+	HARNESS_UDR = c;
+	return 0;
+}
+static FILE harness_stdout = FDEV_SETUP_STREAM(harness_putchar, NULL, _FDEV_SETUP_WRITE);
+
+// As on the host, but counting CPU cycles with Timer1 at F_CPU/64, read
+// after every hundred slices so that it can't wrap. Slices still end by
+// their instruction budget, so the counts compare with the host's.
+static void benchmark(void){
+	harness_init();
+
+	unsigned long slices = 0;
+	unsigned long ticks = 0;
+	harness_steps = 0;
+	harness_reads = 0;
+	TCCR1A = 0;
+	TCCR1B = _BV(CS11) | _BV(CS10);
+	for(uint8_t batch = 0; batch < 100; ++batch){
+		TCNT1 = 0;
+		for(uint8_t i = 0; i < 100; ++i){
+			vm_start(0, 10);
+			vm_step_all();
+		}
+		ticks += TCNT1;
+		slices += 100;
+	}
+	unsigned long cycles = (uint64_t) ticks * 640 / harness_steps; // tenths
+	unsigned long reads = harness_reads * 100 / harness_steps; // hundredths
+	printf("%s %lu instructions, %lu.%lu cycles/instruction, %lu.%02lu program reads/instruction, %lu instructions/slice, %s dispatch\n",
+		   PROGRAM_ARENA_SIZE ? "arena:" : "storage:", harness_steps, cycles / 10, cycles % 10,
+		   reads / 100, reads % 100, harness_steps / slices, VM_THREADED_DISPATCH ? "threaded" : "switch");
+}
+
+int main(void){
+	HARNESS_UCSRB = _BV(HARNESS_TXEN);
+	stdout = &harness_stdout;
+
+	loaded_program = (const program*) (bench_program + FAKE_OFFSET);
+	loaded_program_length = sizeof(bench_program);
+	harness_verbose = false;
+	benchmark();
+
+	// simavr exits when the CPU sleeps with interrupts disabled
+	cli();
+	sleep_mode();
+	return 0;
+}
+
+#else
+
+static void benchmark(void){
+	harness_init();
+
+	unsigned long slices = 0;
+	harness_steps = 0;
+	harness_reads = 0;
+	harness_dispatches = 0;
+	uint32_t start = uptimems();
+#if defined(__x86_64__) || defined(__i386__)
+	uint64_t start_cycles = __builtin_ia32_rdtsc();
+#endif
+	while(uptimems() - start < 1000){
+		for(int i = 0; i < 10000; ++i){
+			vm_start(0, 10);
+			vm_step_all();
+		}
+		slices += 10000;
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	double cycles = (double) (__builtin_ia32_rdtsc() - start_cycles) / harness_steps;
+#else
+	double cycles = 0;
+#endif
+	printf("%-8s %10lu instructions/s, %.1f cycles/instruction, %.2f program reads/instruction, %.2f dispatches/instruction, %.1f instructions/slice\n",
+		   PROGRAM_ARENA_SIZE ? "arena:" : "storage:", harness_steps, cycles, (double) harness_reads / harness_steps,
+		   (double) harness_dispatches / harness_steps, (double) harness_steps / slices);
+}
+
 int main(int argc, const char** argv){
 	uptimems(); // init boot time
-	if(argc < 2){
-		printf("Usage: interpreter <binary>\n");
+	bool bench = argc == 3 && !strcmp(argv[1], "-b");
+	if(argc != 2 && !bench){
+		printf("Usage: interpreter [-b] <binary>\n");
 		exit(1);
 	}
-	const char* filename = argv[1];
+	const char* filename = argv[argc - 1];
 	struct stat s;
 	if(-1 == stat(filename, &s)){
 		perror("Could not open binary");
 		exit(1);
 	}
 	int size = s.st_size;
+	loaded_program_length = size;
 
 	uint8_t* data = malloc(size);
 	if(!data){
@@ -97,14 +316,20 @@ int main(int argc, const char** argv){
 	const program* prog = (const program*) (data + FAKE_OFFSET);
 	loaded_program = prog;
 
-	vm_init();
+	if(bench){
+		harness_verbose = false;
+		benchmark();
+		exit(0);
+	}
+
+	harness_init();
 	vm_start(0, 10); // 'g'
 
 	unsigned int i = 0;
 	while(1){
 		vm_step_all();
 		if((i++ % 5) == 0){
-			KeyboardReport_Data_t r;
+			KeyboardReportBitmap r;
 			vm_append_KeyboardReport(&r);
 		}
 	}
@@ -112,6 +337,8 @@ int main(int argc, const char** argv){
 	printf("Program terminated\n");
 }
 
+#endif
+
 
 // fake checking for keys
 hid_keycode keystate_check_hid_key(hid_keycode key){
@@ -43,6 +43,13 @@
   this software.
 */
 
+#ifdef DEBUG
+
+// standalone binary harness
+#include "keystate_harness.c"
+
+#else
+
 #include "keystate.h"
 
 #include "Keyboard.h"
@@ -51,16 +58,70 @@
 #include "buzzer.h"
 #include "interpreter.h"
 #include "storage.h"
+#include "extrareport.h"
+#include "stats.h"
+
+#endif
 
 #include <stdarg.h>
 
-// State of active keys. Keep track of all pressed or debouncing keys.
+// State of active keys. Keep track of all pressed keys.
 static key_state key_states[KEYSTATE_COUNT];
 
+// Ring of key events. Written only by keystate_set_key/keystate_clear_key,
+// from keystate_update() in the main loop: key_event_head is a free-running
+// count of events written, and is only advanced once the event is in place.
+// Readers don't lock: they check after copying an event that it wasn't
+// overwritten meanwhile, so events may also be read from an interrupt.
+static volatile key_event key_events[KEY_EVENT_COUNT];
+static volatile uint8_t key_event_head = 0;
+
 static keystate_change_hook keystate_change_hook_fn = 0;
+static key_event_cursor keystate_change_hook_cursor;
 
 uint8_t key_press_count = 0;
 
+// Pressed keys by logical and by HID keycode, one bit per keycode. Kept in
+// step with key_states so that checking for a key is a single bit test.
+#define KEY_BITMAP_SIZE (256 / 8)
+static uint8_t pressed_logical_keys[KEY_BITMAP_SIZE];
+static uint8_t pressed_hid_keys[KEY_BITMAP_SIZE];
+
+static inline bool key_bitmap_test(const uint8_t* bitmap, keycode key){
+	return (bitmap[key >> 3] & (1 << (key & 0x7))) != 0;
+}
+
+static inline void key_bitmap_set(uint8_t* bitmap, keycode key){
+	bitmap[key >> 3] |= (1 << (key & 0x7));
+}
+
+static inline void key_bitmap_clear(uint8_t* bitmap, keycode key){
+	bitmap[key >> 3] &= ~(1 << (key & 0x7));
+}
+
+// Populated cells of matrix_to_logical_map, one bit per column. Derived from
+// the map at startup so that the scan can skip empty rows and never visit
+// empty cells.
+static matrix_row_bits matrix_populated[MATRIX_ROWS];
+
+// Debounced state of each cell, one bit per column
+static matrix_row_bits matrix_debounced[MATRIX_ROWS];
+
+// Cells whose reading differs from their debounced state are tracked in
+// debounce_cells until the change either settles or turns out to be a bounce.
+// matrix_unsettled marks the tracked cells, one bit per column.
+#define DEBOUNCE_CELL_COUNT 8 // maximum cells we debounce at once
+
+typedef struct _debounce_cell {
+	uint8_t matrix_row; // NO_KEY if free
+	uint8_t matrix_col;
+	uint8_t since; // count of differing readings
+	uint16_t started; // stats_ticks() of first differing reading
+} debounce_cell;
+
+static debounce_cell debounce_cells[DEBOUNCE_CELL_COUNT];
+static matrix_row_bits matrix_unsettled[MATRIX_ROWS];
+
 struct {
 	unsigned char toggle:1;
 	unsigned char shift_count:7;
@@ -68,9 +129,22 @@ struct {
 
 void keystate_init(void){
 	for(uint8_t i = 0 ; i < KEYSTATE_COUNT; ++i){
-		key_states[i].l_key    = NO_KEY;
-		key_states[i].state    = 0;
-		key_states[i].debounce = 0;
+		key_states[i].l_key = NO_KEY;
+	}
+
+	for(uint8_t i = 0; i < DEBOUNCE_CELL_COUNT; ++i){
+		debounce_cells[i].matrix_row = NO_KEY;
+	}
+
+	for(uint8_t matrix_row = 0; matrix_row < MATRIX_ROWS; ++matrix_row){
+		matrix_row_bits populated = 0;
+		for(uint8_t matrix_col = 0; matrix_col < MATRIX_COLS; ++matrix_col){
+			logical_keycode l_key = storage_read_byte(CONSTANT_STORAGE, &matrix_to_logical_map[matrix_row][matrix_col]);
+			if(l_key != NO_KEY){
+				populated |= (matrix_row_bits)1 << matrix_col;
+			}
+		}
+		matrix_populated[matrix_row] = populated;
 	}
 }
 
@@ -78,38 +152,81 @@ bool keystate_is_keypad_mode(void){
 	return (keypad_state.toggle != 0) || (keypad_state.shift_count != 0);
 }
 
+static void keystate_push_event(logical_keycode l_key, uint8_t press){
+	uint8_t head = key_event_head;
+	volatile key_event* event = &key_events[head & (KEY_EVENT_COUNT - 1)];
+	event->l_key = l_key;
+	event->press = press;
+	event->time  = uptimems();
+	key_event_head = head + 1;
+}
+
+key_event_cursor keystate_event_cursor(void){
+	return key_event_head;
+}
+
+bool keystate_next_event(key_event_cursor* cursor, key_event* event){
+	uint8_t c = *cursor;
+	for(;;){
+		uint8_t head = key_event_head;
+		if(c == head) return false;
+
+		// If we've been lapped, skip forward to the oldest event still present
+		if((uint8_t)(head - c) > KEY_EVENT_COUNT){
+			c = head - KEY_EVENT_COUNT;
+		}
+
+		*event = key_events[c & (KEY_EVENT_COUNT - 1)];
+
+		// If the event was overwritten while being copied, the producer has
+		// lapped us again: retry from the new oldest event.
+		if((uint8_t)(key_event_head - c) <= KEY_EVENT_COUNT) break;
+	}
+	*cursor = c + 1;
+	return true;
+}
+
+// Passes the events recorded since the last call to the change hook. An
+// update calls this after each change it makes, as one update may record
+// more events than the ring holds.
+static void keystate_run_change_hook(void){
+	key_event event;
+	while(keystate_change_hook_fn && keystate_next_event(&keystate_change_hook_cursor, &event)){
+		keystate_change_hook_fn(event.l_key, event.press);
+	}
+}
+
 static inline void keystate_set_key(key_state* key){
 	++key_press_count;
-	key->state = 1;
-	if(keystate_change_hook_fn) keystate_change_hook_fn(key->l_key, true);
+	key->h_key = config_get_definition(key->l_key);
+	key_bitmap_set(pressed_logical_keys, key->l_key);
+	key_bitmap_set(pressed_hid_keys, key->h_key);
+	keystate_push_event(key->l_key, true);
 	#if USE_BUZZER
 	if(config_get_flags().key_sound_enabled)
 		buzzer_start(3);
 	#endif
 }
 
-static inline uint8_t keystate_clear_key(key_state* key){
-	uint8_t old_state = key->state;
-	logical_keycode old_key = key->l_key;
-
+static inline void keystate_clear_key(key_state* key){
+	key_press_count--;
+	keystate_push_event(key->l_key, false);
+	key_bitmap_clear(pressed_logical_keys, key->l_key);
 	key->l_key = NO_KEY;
-	key->state = 0;
 
-	if(old_state){ // if it had been pressed
-		key_press_count--;
-		if(keystate_change_hook_fn) keystate_change_hook_fn(old_key, false);
+	// More than one pressed key may be mapped to the same HID keycode
+	for(uint8_t i = 0; i < KEYSTATE_COUNT; ++i){
+		if(key_states[i].l_key != NO_KEY && key_states[i].h_key == key->h_key){
+			return;
+		}
 	}
-
-	return old_state;
+	key_bitmap_clear(pressed_hid_keys, key->h_key);
 }
 
-// Called when a keypad key (either toggle or shift) changes state. If the key
-// change causes the keypad mode to be toggled, all currently tracked keys that
-// are no longer valid in the new mode are reset. Returns true if the keypad
-// state changed.
-static uint8_t keystate_update_keypad(hid_keycode keypad_key, uint8_t state){
-	uint8_t prev_keypad_mode = keystate_is_keypad_mode();
-
+// Called when a keypad key (either toggle or shift) changes state. Only the
+// keypad state is updated here: keys that are already pressed are moved to
+// the new layer by keystate_apply_keypad_layer() once the update is complete.
+static void keystate_update_keypad(hid_keycode keypad_key, uint8_t state){
 	switch(keypad_key){
 	case SPECIAL_HID_KEY_KEYPAD_TOGGLE:
 		// Toggle keypad mode on keydown
@@ -120,108 +237,248 @@ static uint8_t keystate_update_keypad(hid_keycode keypad_key, uint8_t state){
 		else      { --keypad_state.shift_count; }
 		break;
 	default:
-		return false;
+		break;
 	}
+}
 
-	uint8_t keypad_mode = keystate_is_keypad_mode();
+// Keypad mode that the pressed keys were last placed in
+static bool keypad_layer_applied = false;
+
+// If the keypad mode has changed, releases each pressed key that takes part
+// in the keypad layer and is not yet in the current layer, and presses it
+// again at the same position in the current layer. However many times the
+// mode changed during an update, held keys are moved at most once.
+static void keystate_apply_keypad_layer(void){
+	bool keypad_mode = keystate_is_keypad_mode();
+	if(keypad_mode == keypad_layer_applied) return;
+	keypad_layer_applied = keypad_mode;
+
+	for(uint8_t i = 0; i < KEYSTATE_COUNT; ++i){
+		key_state* key = &key_states[i];
+		logical_keycode l_key = key->l_key;
+		if(l_key == NO_KEY || SPECIAL_HID_KEY_NOREMAP(key->h_key)){
+			continue;
+		}
+		// keys pressed since the mode changed are already in the right layer
+		if((l_key >= KEYPAD_LAYER_SIZE) == keypad_mode){
+			continue;
+		}
 
-	if(prev_keypad_mode == keypad_mode){ return false; }
+		keystate_clear_key(key);
+		key->l_key = keypad_mode ? l_key + KEYPAD_LAYER_SIZE : l_key - KEYPAD_LAYER_SIZE;
+		keystate_set_key(key);
+		keystate_run_change_hook();
+	}
+}
 
-	// Otherwise, clear all currently tracked keys that are now no longer available
-	for(int i = 0; i < KEYSTATE_COUNT; ++i){
-		logical_keycode l_key = key_states[i].l_key;
-		hid_keycode h_key = config_get_definition(l_key);
+// Debounced matrix changes, from keystate_scan() to keystate_update(). The
+// scan is the only writer of cell_queue_head and the update the only writer
+// of cell_queue_tail, and each only advances its index once the entry it
+// covers is complete, so the two may run concurrently without locking.
+#define CELL_QUEUE_SIZE 16 // must be a power of two <= 128
+
+typedef struct _cell_change {
+	uint8_t matrix_row;
+	uint8_t matrix_col:7;
+	uint8_t press:1;
+} cell_change;
+
+static volatile cell_change cell_queue[CELL_QUEUE_SIZE];
+static volatile uint8_t cell_queue_head = 0;
+static volatile uint8_t cell_queue_tail = 0;
+
+// Matrix positions whose debounced state is pressed, each of which has (or
+// will have once the queue is applied) a key_states slot. Only written by
+// the scan, which queues no more presses than there are slots.
+static uint8_t matrix_pressed_count = 0;
+
+// Only written by keystate_set_debounce_mode(): the scan may run from an
+// interrupt, so mustn't read the configuration flags from eeprom.
+static uint8_t debounce_mode = DEBOUNCE_DEFAULT_MODE;
+
+void keystate_set_debounce_mode(debounce_mode_t mode){
+	debounce_mode = (mode == DEBOUNCE_DEFAULT) ? DEBOUNCE_DEFAULT_MODE : mode;
+}
 
-		// if the tracked key is valid in the new mode, continue
-		if(SPECIAL_HID_KEY_NOREMAP(h_key)){
-			continue;
+// Called for each cell whose reading differs from its debounced state, or
+// which is being tracked, with *started the stats_ticks() of this scan.
+// Returns true if the cell's debounced state should now change, setting
+// *started to the time of its first differing reading. Times are taken from
+// Timer1 rather than uptimems(), which may not advance while the main loop is
+// busy.
+static bool keystate_debounce_cell(uint8_t matrix_row, uint8_t matrix_col, bool changed, bool pressed, uint16_t* started){
+	debounce_cell* cell = 0;
+	debounce_cell* free_cell = 0;
+	for(uint8_t i = 0; i < DEBOUNCE_CELL_COUNT; ++i){
+		debounce_cell* c = &debounce_cells[i];
+		if(c->matrix_row == matrix_row && c->matrix_col == matrix_col){
+			cell = c;
+			break;
 		}
-		else if(keypad_mode){
-			if(l_key >= KEYPAD_LAYER_SIZE) continue; // safe
+		if(!free_cell && c->matrix_row == NO_KEY){
+			free_cell = c;
+		}
+	}
+
+	matrix_row_bits col_bit = (matrix_row_bits)1 << matrix_col;
+	bool settled;
+
+	if(!changed){
+		// returned to its debounced state: it was a bounce
+		settled = false;
+	}
+	else if(debounce_mode == DEBOUNCE_EAGER && pressed){
+		// report the press at once: the release is deferred, so any bounce
+		// following the press is ignored
+		settled = true;
+	}
+	else{
+		if(!cell){
+			if(!free_cell) return false; // no space: retry next scan
+			cell = free_cell;
+			cell->matrix_row = matrix_row;
+			cell->matrix_col = matrix_col;
+			cell->since = 0;
+			cell->started = *started;
+			matrix_unsettled[matrix_row] |= col_bit;
+		}
+
+		if(debounce_mode == DEBOUNCE_TIMED){
+			settled = (uint16_t)(*started - cell->started) >= DEBOUNCE_MS * STATS_TICKS_PER_MS;
 		}
 		else{
-			if(l_key < KEYPAD_LAYER_SIZE) continue;
+			settled = ++cell->since >= DEBOUNCE_SAMPLES;
 		}
 
-		// otherwise clear the key state
-		keystate_clear_key(&key_states[i]);
+		if(!settled) return false;
 	}
-	return true;
-}
 
+	if(cell){
+		*started = cell->started;
+		cell->matrix_row = NO_KEY;
+		matrix_unsettled[matrix_row] &= ~col_bit;
+	}
+	return settled;
+}
 
+void keystate_scan(void){
+	uint16_t scan_ticks = stats_ticks();
 
-void keystate_update(void){
-	// for each entry i in the matrix
 	for(uint8_t matrix_row = 0; matrix_row < MATRIX_ROWS; ++matrix_row){
+		matrix_row_bits populated = matrix_populated[matrix_row];
+		if(!populated) continue; // nothing to scan in this row
+
 		matrix_select_row(matrix_row);
+		matrix_row_bits reading = matrix_read_row() & populated;
 
-		for(uint8_t matrix_col = 0; matrix_col < MATRIX_COLS; ++matrix_col){
+		matrix_row_bits debounced = matrix_debounced[matrix_row];
+		matrix_row_bits visit = (reading ^ debounced) | matrix_unsettled[matrix_row];
 
-			// look up the logical key for the matrix code
-			// Note that only one matrix position should map to any given
-			// logical code: otherwise we won't register a keypress unless both
-			// are pressed: one position will be debouncing up and the other
-			// down.
-			logical_keycode l_key = storage_read_byte(CONSTANT_STORAGE, &matrix_to_logical_map[matrix_row][matrix_col]);
-			if(l_key == NO_KEY) goto next_matrix; // empty space in the sparse matrix
+		for(uint8_t matrix_col = 0; visit; ++matrix_col, visit >>= 1){
+			if(!(visit & 1)) continue;
 
-			hid_keycode h_key = config_get_definition(l_key);
-			bool noremap_key = SPECIAL_HID_KEY_NOREMAP(h_key);
+			uint8_t head = cell_queue_head;
+			if((uint8_t)(head - cell_queue_tail) == CELL_QUEUE_SIZE){
+				break; // queue full: the change is seen again on the next scan
+			}
 
-			// Handle layer switch. No-remap (keypad and program) keys are ignored.
-			if(keystate_is_keypad_mode() && !noremap_key){
-				l_key += KEYPAD_LAYER_SIZE;
+			matrix_row_bits col_bit = (matrix_row_bits)1 << matrix_col;
+			bool pressed = (reading & col_bit) != 0;
+			bool changed = pressed != ((debounced & col_bit) != 0);
+			if(pressed && changed && matrix_pressed_count == KEYSTATE_COUNT){
+				continue; // no slot for the key: the press is seen again on the next scan
+			}
+			uint16_t started = scan_ticks;
+			if(!keystate_debounce_cell(matrix_row, matrix_col, changed, pressed, &started)){
+				continue;
 			}
 
-			uint8_t reading = matrix_read_column(matrix_col);
+			volatile cell_change* change = &cell_queue[head & (CELL_QUEUE_SIZE - 1)];
+			change->matrix_row = matrix_row;
+			change->matrix_col = matrix_col;
+			change->press = pressed;
+			cell_queue_head = head + 1;
 
-			uint8_t free_slot = NO_KEY;
+			if(pressed){
+				++matrix_pressed_count;
+				stats_press_queued(started, head);
+			}
+			else{
+				--matrix_pressed_count;
+			}
 
-			// Scan the current keystates. If we find an entry for our key, update it.
-			// if we don't, and the key is pressed, add it to a free slot.
-			for(uint8_t j = 0; j < KEYSTATE_COUNT; ++j){
-				key_state* key = &key_states[j];
-				if(free_slot == NO_KEY && key->l_key == NO_KEY){ // found a free slot
-					free_slot = j;
-				}
-				else if(key->l_key == l_key){ //found our key
-					// update the debounce mask with the current reading
-					key->debounce = DEBOUNCE_MASK & ((key->debounce << 1) | reading);
-
-					if(key->debounce == 0x00){
-						// key is not pressed (either debounced-down or never made it up), remove it
-						uint8_t old_state = keystate_clear_key(key);
-						if(old_state && noremap_key){
-							uint8_t changed = keystate_update_keypad(h_key, false);
-							if(changed){ matrix_col = 0; matrix_row = 0; }
-						}
-					}
-					else{
-						if(key->state == 0 && key->debounce == DEBOUNCE_MASK){
-							keystate_set_key(key);
-							if(noremap_key){
-								uint8_t changed = keystate_update_keypad(h_key, true);
-								if(changed){ matrix_col = 0; matrix_row = 0; }
-							}
-						}
-					}
-					goto next_matrix; // done with this reading
-				}
+			debounced ^= col_bit;
+		}
+		matrix_debounced[matrix_row] = debounced;
+	}
+
+	stats_record(&stats_get_latency()->scan, stats_ticks() - scan_ticks);
+}
+
+// Applies a debounced change at the given matrix position to the key state.
+static void keystate_update_cell(uint8_t matrix_row, uint8_t matrix_col, uint8_t press){
+	if(press){
+		// look up the logical key for the matrix code
+		logical_keycode l_key = storage_read_byte(CONSTANT_STORAGE, &matrix_to_logical_map[matrix_row][matrix_col]);
+
+		hid_keycode h_key = config_get_definition(l_key);
+		bool noremap_key = SPECIAL_HID_KEY_NOREMAP(h_key);
+
+		// Handle layer switch. No-remap (keypad and program) keys are ignored.
+		if(keystate_is_keypad_mode() && !noremap_key){
+			l_key += KEYPAD_LAYER_SIZE;
+		}
+
+		// Record the key in a free slot. The scan doesn't queue a press unless
+		// there is one.
+		for(uint8_t i = 0; i < KEYSTATE_COUNT; ++i){
+			key_state* key = &key_states[i];
+			if(key->l_key != NO_KEY) continue;
+
+			key->l_key = l_key;
+			key->matrix_row = matrix_row;
+			key->matrix_col = matrix_col;
+			keystate_set_key(key);
+			if(noremap_key){
+				keystate_update_keypad(h_key, true);
 			}
-			// key was not in the state, so previously not pressed.
-			// If pressed now, record a new key if there's space.
-			if(reading && free_slot != NO_KEY){
-				key_state* key = &key_states[free_slot];
-				key->l_key = l_key;
-				key->state = 0;
-				key->debounce = 0x1;
+			return;
+		}
+	}
+	else{
+		for(uint8_t i = 0; i < KEYSTATE_COUNT; ++i){
+			key_state* key = &key_states[i];
+			if(key->l_key == NO_KEY || key->matrix_row != matrix_row || key->matrix_col != matrix_col){
+				continue;
 			}
-		next_matrix:;
+
+			hid_keycode h_key = key->h_key;
+			keystate_clear_key(key);
+			if(SPECIAL_HID_KEY_NOREMAP(h_key)){
+				keystate_update_keypad(h_key, false);
+			}
+			return;
 		}
 	}
 }
 
+void keystate_update(void){
+	uint8_t tail = cell_queue_tail;
+	while(tail != cell_queue_head){
+		volatile cell_change* change = &cell_queue[tail & (CELL_QUEUE_SIZE - 1)];
+		uint8_t matrix_row = change->matrix_row;
+		uint8_t matrix_col = change->matrix_col;
+		uint8_t press = change->press;
+		stats_press_applied(tail);
+		cell_queue_tail = ++tail;
+
+		keystate_update_cell(matrix_row, matrix_col, press);
+		keystate_run_change_hook();
+	}
+
+	keystate_apply_keypad_layer();
+}
+
 static inline keycode keystate_process_keycode(logical_keycode raw_key, keycode_type ktype){
 	keycode key = raw_key;
 	switch(ktype){
@@ -238,15 +495,18 @@ static inline keycode keystate_process_keycode(logical_keycode raw_key, keycode_
 }
 
 bool keystate_check_key(keycode target_key, keycode_type ktype){
-	for(int i = 0; i < KEYSTATE_COUNT; ++i){
-		logical_keycode raw_key = key_states[i].l_key;
-		keycode key = keystate_process_keycode(raw_key, ktype);
-
-		if(key == target_key){
-			return key_states[i].state;
-		}
+	switch(ktype){
+	case PHYSICAL:
+		// pressed in either layer
+		if(target_key >= KEYPAD_LAYER_SIZE) return false;
+		return key_bitmap_test(pressed_logical_keys, target_key)
+			|| key_bitmap_test(pressed_logical_keys, target_key + KEYPAD_LAYER_SIZE);
+	case HID:
+		return key_bitmap_test(pressed_hid_keys, target_key);
+	case LOGICAL:
+	default:
+		return key_bitmap_test(pressed_logical_keys, target_key);
 	}
-	return false;
 }
 
 /** returns true if all argument keys are down */
@@ -297,7 +557,7 @@ bool keystate_check_any_key(uint8_t count, keycode_type ktype, ...){
 void keystate_get_keys(keycode* keys, keycode_type ktype){
 	int ki = 0;
 	for(int i = 0; i < KEYSTATE_COUNT && ki < key_press_count; ++i){
-		if(key_states[i].state){
+		if(key_states[i].l_key != NO_KEY){
 			logical_keycode raw_key = key_states[i].l_key;
 			keycode key = keystate_process_keycode(raw_key, ktype);
 
@@ -306,39 +566,21 @@ void keystate_get_keys(keycode* keys, keycode_type ktype){
 	}
 }
 
-void keystate_Fill_KeyboardReport(KeyboardReport_Data_t* KeyboardReport){
-	uint8_t UsedKeyCodes = 0;
-	uint8_t rollover = false;
+void keystate_Fill_KeyboardReport(KeyboardReportBitmap* KeyboardReport){
 	// check key state
 	for(int i = 0; i < KEYSTATE_COUNT; ++i){
-		if(key_states[i].state){
-			if(UsedKeyCodes == KEYBOARDREPORT_KEY_COUNT){
-				rollover = true;
-				break;
-			}
-			logical_keycode l_key = key_states[i].l_key;
-			hid_keycode h_key = config_get_definition(l_key);
-
-			if(h_key == SPECIAL_HID_KEY_PROGRAM) rollover = true; // Simple way to ensure program key combinations never cause typing
+		if(key_states[i].l_key != NO_KEY){
+			hid_keycode h_key = key_states[i].h_key;
 
-			// check for special and modifier keys
-			if(h_key >= SPECIAL_HID_KEYS_START){
-				// There's no output for a special key
-				continue;
-			}
-			else if(h_key >= HID_KEYBOARD_SC_LEFT_CONTROL){
-				uint8_t shift = h_key - HID_KEYBOARD_SC_LEFT_CONTROL;
-				KeyboardReport->Modifier |= (1 << shift);
-			}
-			else{
-				KeyboardReport->KeyCode[UsedKeyCodes++] = h_key;
+			if(h_key == SPECIAL_HID_KEY_PROGRAM){
+				// Simple way to ensure program key combinations never cause typing
+				h_key = HID_KEYBOARD_SC_ERROR_ROLLOVER;
 			}
+
+			// Special keys have no output
+			KeyboardReportBitmap_add(KeyboardReport, h_key);
 		}
 	}
-	if(rollover){
-		for(int i = 0; i < KEYBOARDREPORT_KEY_COUNT; ++i)
-			KeyboardReport->KeyCode[i] = HID_KEYBOARD_SC_ERROR_ROLLOVER;
-	 }
 }
 
 static inline uint8_t ilog2_16(uint16_t n){
@@ -384,9 +626,8 @@ void keystate_Fill_MouseReport(MouseReport_Data_t* MouseReport){
 	// check key state
 	int moving = 0;
 	for(int i = 0; i < KEYSTATE_COUNT; ++i){
-		if(key_states[i].state){
-			logical_keycode l_key = key_states[i].l_key;
-			hid_keycode h_key = config_get_definition(l_key);
+		if(key_states[i].l_key != NO_KEY){
+			hid_keycode h_key = key_states[i].h_key;
 			if(h_key >= SPECIAL_HID_KEYS_MOUSE_START && h_key <= SPECIAL_HID_KEYS_MOUSE_END){
 				switch(h_key){
 				case SPECIAL_HID_KEY_MOUSE_BTN1:
@@ -435,11 +676,12 @@ void keystate_Fill_MouseReport(MouseReport_Data_t* MouseReport){
 }
 
 hid_keycode keystate_check_hid_key(hid_keycode key){
+	if(key != 0){
+		return key_bitmap_test(pressed_hid_keys, key) ? key : 0xFF;
+	}
 	for(int i = 0; i < KEYSTATE_COUNT; ++i){
-		if(key_states[i].state){
-			logical_keycode l_key = key_states[i].l_key;
-			hid_keycode h_key = config_get_definition(l_key);
-			if(key == 0 || key == h_key) return h_key;
+		if(key_states[i].l_key != NO_KEY){
+			return key_states[i].h_key;
 		}
 	}
 	return 0xFF;
@@ -453,9 +695,8 @@ hid_keycode keystate_check_hid_key(hid_keycode key){
 int keystate_get_hid_keys(hid_keycode* h_keys, bool exclude_special){
 	int ki = 0;
 	for(int i = 0; i < KEYSTATE_COUNT && ki < key_press_count; ++i){
-		if(key_states[i].state){
-			logical_keycode l_key = key_states[i].l_key;
-			hid_keycode h_key = config_get_definition(l_key);
+		if(key_states[i].l_key != NO_KEY){
+			hid_keycode h_key = key_states[i].h_key;
 			if(exclude_special && h_key >= SPECIAL_HID_KEYS_START){
 				continue;
 			}
@@ -466,6 +707,17 @@ int keystate_get_hid_keys(hid_keycode* h_keys, bool exclude_special){
 }
 
 
+void keystate_update_mapping(void){
+	memset(pressed_hid_keys, 0, sizeof(pressed_hid_keys));
+	for(uint8_t i = 0; i < KEYSTATE_COUNT; ++i){
+		key_state* key = &key_states[i];
+		if(key->l_key == NO_KEY) continue;
+		key->h_key = config_get_definition(key->l_key);
+		key_bitmap_set(pressed_hid_keys, key->h_key);
+	}
+}
+
 void keystate_register_change_hook(keystate_change_hook hook){
+	keystate_change_hook_cursor = keystate_event_cursor();
 	keystate_change_hook_fn = hook;
 }
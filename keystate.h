@@ -58,17 +58,16 @@ typedef keycode logical_keycode;
 typedef keycode hid_keycode;
 
 typedef struct _key_state {
-	logical_keycode l_key;
-	unsigned char state:1;
-	unsigned char debounce:7; // bit vector of last n physical reports: debounced state asserted when they're all the same
+	logical_keycode l_key; // NO_KEY if the slot is free
+	hid_keycode h_key;     // mapping of l_key when pressed
+	uint8_t matrix_row;    // matrix position the key was pressed at
+	uint8_t matrix_col;
 } key_state;
 
 // constants
 
 #define KEYSTATE_COUNT 14 // maximum keys we track at once
 
-#define DEBOUNCE_MASK 0x07 // care about last 3 physical reports
-
 #define NO_KEY 0xFF
 
 /* Logical keys are mapped to HID codes. We want to be able to assign some extra actions
@@ -108,8 +107,34 @@ extern uint8_t key_press_count;
 
 void keystate_init(void);
 
+/**
+ * Scans the keyboard matrix, and queues each debounced change of a matrix
+ * position for keystate_update(). Called from the matrix scan timer interrupt
+ * if the hardware defines MATRIX_SCAN_ISR, otherwise from the main loop.
+ */
+void keystate_scan(void);
+
+/**
+ * Applies queued matrix changes to the logical key state.
+ */
 void keystate_update(void);
 
+/**
+ * Debounce algorithms. A matrix position's debounced state changes:
+ * DEFERRED: when DEBOUNCE_SAMPLES consecutive readings differ from it.
+ * EAGER:    on the first pressed reading, or as for DEFERRED on release.
+ * TIMED:    when its readings have differed for DEBOUNCE_MS milliseconds.
+ * DEBOUNCE_DEFAULT selects the hardware's DEBOUNCE_DEFAULT_MODE.
+ */
+typedef enum _debounce_mode {
+	DEBOUNCE_DEFAULT = 0,
+	DEBOUNCE_DEFERRED,
+	DEBOUNCE_EAGER,
+	DEBOUNCE_TIMED
+} debounce_mode_t;
+
+void keystate_set_debounce_mode(debounce_mode_t mode);
+
 bool keystate_is_keypad_mode(void);
 
 /**
@@ -133,7 +158,7 @@ bool keystate_check_any_key(uint8_t count, keycode_type ktype, ...);
  * output buffer keys. */
 void keystate_get_keys(keycode* keys, keycode_type ktype);
 
-void keystate_Fill_KeyboardReport(KeyboardReport_Data_t* KeyboardReport);
+void keystate_Fill_KeyboardReport(KeyboardReportBitmap* KeyboardReport);
 
 void keystate_Fill_MouseReport(MouseReport_Data_t* MouseReport);
 
@@ -151,11 +176,44 @@ hid_keycode keystate_check_hid_key(hid_keycode key);
  */
 int keystate_get_hid_keys(hid_keycode* h_keys, bool exclude_special);
 
+/**
+ * Updates the HID keycodes of the currently pressed keys after the
+ * logical-to-HID mapping is changed.
+ */
+void keystate_update_mapping(void);
+
 /**
  * Check for keys bound to programs, if found call vm_start
  */
 void keystate_run_programs(void);
 
+/**
+ * Every change to the logical key state is recorded as a key_event in a
+ * fixed size ring buffer. Any number of consumers may read the events, each
+ * with its own key_event_cursor. A consumer that falls more than
+ * KEY_EVENT_COUNT (see hardware.h) events behind loses the oldest events.
+ */
+
+typedef struct _key_event {
+	logical_keycode l_key;
+	uint8_t press;
+	uint32_t time; // uptimems() when the debounced change was seen
+} key_event;
+
+typedef uint8_t key_event_cursor;
+
+/**
+ * Returns a cursor positioned after the most recent event, so that only
+ * subsequent events will be read.
+ */
+key_event_cursor keystate_event_cursor(void);
+
+/**
+ * Reads the next event for the given cursor into `event` and advances the
+ * cursor. Returns false if there are no unread events.
+ */
+bool keystate_next_event(key_event_cursor* cursor, key_event* event);
+
 /**
  * A keystate change hook function is invoked whenever the logical key
  * state is changed, passing the logical keycode and the type of event.
@@ -164,7 +222,8 @@ typedef void (*keystate_change_hook)(logical_keycode key, bool press);
 
 /**
  * Sets the given function as the keystate change hook function. Set
- * null to unregister.
+ * null to unregister. The hook is a consumer of the key event ring, and
+ * is invoked once per event at the end of each keystate_update().
  */
 void keystate_register_change_hook(keystate_change_hook hook);
 
@@ -0,0 +1,724 @@
+// Fake API for test harness. Build with
+//   gcc -DDEBUG -std=gnu99 -fshort-enums -o keystate keystate.c -lm
+// and run "keystate [trace...]" to scan a simulated Kinesis-sized matrix,
+// checking the key events it produces and measuring the host cost of each
+// scan, then to simulate the scan timing jitter caused by main loop load,
+// and finally to replay key bounce traces through each debounce algorithm.
+// Time is simulated: each scan advances it by HARNESS_SCAN_US.
+//
+// A trace file lists the contact changes of a single key, one per line, as
+// "<microseconds> <0 or 1>". The contact is open before the first change.
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <time.h>
+#include <math.h>
+#include <stdarg.h>
+
+// keystate.h's own includes are replaced by the definitions below
+#define _KEYBOARD_H_
+
+typedef struct _kbdr {uint8_t Modifier; uint8_t Keys[0xE0 / 8];} KeyboardReportBitmap;
+typedef struct _msr {int8_t X; int8_t Y; uint8_t Button;} MouseReport_Data_t;
+#define HID_KEYBOARD_SC_ERROR_ROLLOVER 0x01
+
+#include "keystate.h"
+
+// simulated time
+#define HARNESS_SCAN_US 2000
+static uint32_t harness_us = 0;
+
+static uint32_t uptimems(void){
+	return harness_us / 1000;
+}
+
+// Timer1 ticks, at 250 per millisecond
+#define STATS_TICKS_PER_MS 250
+static uint16_t stats_ticks(void){
+	return (uint16_t) (harness_us / 4);
+}
+
+typedef struct _stats_timing { uint16_t count; } stats_timing;
+typedef struct _latency_stats { stats_timing scan; } latency_stats;
+static latency_stats harness_latency;
+latency_stats* stats_get_latency(void){ return &harness_latency; }
+void stats_record(stats_timing* timing, uint16_t ticks){ ++timing->count; }
+
+// Presses are followed from the matrix to keystate_update() as in stats.c,
+// one at a time, by their cell queue entry.
+static bool harness_press_followed = false;
+static uint8_t harness_press_entry;
+static uint32_t harness_press_applied_us;
+
+void stats_press_queued(uint16_t started, uint8_t entry){
+	if(harness_press_followed) return;
+	harness_press_followed = true;
+	harness_press_entry = entry;
+}
+
+void stats_press_applied(uint8_t entry){
+	if(harness_press_followed && entry == harness_press_entry){
+		harness_press_followed = false;
+		harness_press_applied_us = harness_us;
+	}
+}
+
+void KeyboardReportBitmap_add(KeyboardReportBitmap* r, hid_keycode key){
+	if(key < 0xE0) r->Keys[key >> 3] |= 1 << (key & 0x7);
+}
+
+// Kinesis-sized matrix, with the logical keys in order from the top left
+// and the rows after the last key empty
+#define NUM_PHYSICAL_KEYS 86
+#define NUM_LOGICAL_KEYS  NUM_PHYSICAL_KEYS * 2
+#define KEYPAD_LAYER_SIZE NUM_PHYSICAL_KEYS
+
+#define MATRIX_COLS 10
+#define MATRIX_ROWS 16
+#define KEY_EVENT_COUNT 16
+typedef uint16_t matrix_row_bits;
+
+#define DEBOUNCE_DEFAULT_MODE DEBOUNCE_DEFERRED
+#define DEBOUNCE_SAMPLES 3
+#define DEBOUNCE_MS 6
+
+#define storage_read_byte(storage_type, addr) (*(addr))
+static logical_keycode matrix_to_logical_map[MATRIX_ROWS][MATRIX_COLS];
+
+static matrix_row_bits harness_matrix[MATRIX_ROWS];
+static uint8_t harness_row;
+static unsigned long harness_row_reads = 0;
+
+void matrix_select_row(uint8_t matrix_row){
+	harness_row = matrix_row;
+}
+
+matrix_row_bits matrix_read_row(void){
+	++harness_row_reads;
+	return harness_matrix[harness_row];
+}
+
+// physical key n is mapped to n + 4 in the base layer and n + 0x30 in the
+// keypad layer, except for two keypad shift keys and a keypad toggle key
+#define HARNESS_SHIFT_KEY   80
+#define HARNESS_SHIFT_KEY_2 81
+#define HARNESS_TOGGLE_KEY  82
+static hid_keycode harness_mapping[NUM_LOGICAL_KEYS];
+
+hid_keycode config_get_definition(logical_keycode l_key){
+	return harness_mapping[l_key];
+}
+
+// scans and updates for the given simulated time
+static void harness_run(uint32_t us){
+	for(uint32_t end = harness_us + us; harness_us < end; harness_us += HARNESS_SCAN_US){
+		keystate_scan();
+		keystate_update();
+	}
+}
+
+// Releases every key, and reinitializes the key state
+static void harness_init(void){
+	static bool initialized = false;
+	memset(harness_matrix, 0, sizeof(harness_matrix));
+	if(initialized){
+		harness_run(20000);
+	}
+	initialized = true;
+
+	for(int i = 0; i < MATRIX_ROWS * MATRIX_COLS; ++i){
+		matrix_to_logical_map[i / MATRIX_COLS][i % MATRIX_COLS] = (i < NUM_PHYSICAL_KEYS) ? i : NO_KEY;
+	}
+	for(int i = 0; i < KEYPAD_LAYER_SIZE; ++i){
+		harness_mapping[i] = i + 4;
+		harness_mapping[i + KEYPAD_LAYER_SIZE] = i + 0x30;
+	}
+	harness_mapping[HARNESS_SHIFT_KEY] = SPECIAL_HID_KEY_KEYPAD_SHIFT;
+	harness_mapping[HARNESS_SHIFT_KEY_2] = SPECIAL_HID_KEY_KEYPAD_SHIFT;
+	harness_mapping[HARNESS_TOGGLE_KEY] = SPECIAL_HID_KEY_KEYPAD_TOGGLE;
+	keystate_init();
+}
+
+static void harness_set_key(logical_keycode l_key, bool pressed){
+	matrix_row_bits bit = (matrix_row_bits)1 << (l_key % MATRIX_COLS);
+	if(pressed) harness_matrix[l_key / MATRIX_COLS] |= bit;
+	else        harness_matrix[l_key / MATRIX_COLS] &= ~bit;
+}
+
+static void expect_event(key_event_cursor* cursor, logical_keycode l_key, bool press){
+	key_event event;
+	if(!keystate_next_event(cursor, &event)){
+		printf("FAIL: no event, expected %s of key %d\n", press ? "press" : "release", l_key);
+		exit(1);
+	}
+	if(event.l_key != l_key || event.press != press){
+		printf("FAIL: %s of key %d, expected %s of key %d\n", event.press ? "press" : "release",
+			   event.l_key, press ? "press" : "release", l_key);
+		exit(1);
+	}
+}
+
+static void expect_no_event(key_event_cursor* cursor){
+	key_event event;
+	if(keystate_next_event(cursor, &event)){
+		printf("FAIL: unexpected %s of key %d\n", event.press ? "press" : "release", event.l_key);
+		exit(1);
+	}
+}
+
+static void test_matrix(void){
+	harness_init();
+	key_event_cursor cursor = keystate_event_cursor();
+
+	// keys in the same row, in different rows, and in the last populated row
+	const logical_keycode keys[] = { 0, 9, 12, 47, NUM_PHYSICAL_KEYS - 1 };
+	const int nkeys = sizeof(keys) / sizeof(keys[0]);
+
+	for(int i = 0; i < nkeys; ++i){
+		harness_set_key(keys[i], true);
+	}
+	harness_run(20000);
+	for(int i = 0; i < nkeys; ++i){
+		expect_event(&cursor, keys[i], true);
+		if(!keystate_check_key(keys[i], LOGICAL) || !keystate_check_key(keys[i] + 4, HID)){
+			printf("FAIL: key %d not down\n", keys[i]);
+			exit(1);
+		}
+	}
+	expect_no_event(&cursor);
+	if(key_press_count != nkeys){
+		printf("FAIL: %d keys down, expected %d\n", key_press_count, nkeys);
+		exit(1);
+	}
+
+	for(int i = 0; i < nkeys; ++i){
+		harness_set_key(keys[i], false);
+	}
+	harness_run(20000);
+	for(int i = 0; i < nkeys; ++i){
+		expect_event(&cursor, keys[i], false);
+	}
+	expect_no_event(&cursor);
+	if(key_press_count != 0 || keystate_check_key(keys[0], LOGICAL)){
+		printf("FAIL: keys still down after release\n");
+		exit(1);
+	}
+	printf("ok: simulated matrix presses and releases\n");
+}
+
+static void test_event_ring(void){
+	harness_init();
+	key_event_cursor cursor = keystate_event_cursor();
+
+	// KEY_EVENT_COUNT + 4 events: the first four are lost to this reader
+	for(int i = 0; i < (KEY_EVENT_COUNT + 4) / 2; ++i){
+		harness_set_key(i, true);
+		harness_run(10000);
+		harness_set_key(i, false);
+		harness_run(10000);
+	}
+	for(int i = 2; i < (KEY_EVENT_COUNT + 4) / 2; ++i){
+		expect_event(&cursor, i, true);
+		expect_event(&cursor, i, false);
+	}
+	expect_no_event(&cursor);
+	printf("ok: lapped event reader skips to the oldest event\n");
+}
+
+static void test_full_slots(void){
+	harness_init();
+	key_event_cursor cursor = keystate_event_cursor();
+
+	// one more key than there are slots: the last press waits for a slot
+	for(int i = 0; i <= KEYSTATE_COUNT; ++i){
+		harness_set_key(i, true);
+	}
+	harness_run(20000);
+	for(int i = 0; i < KEYSTATE_COUNT; ++i){
+		expect_event(&cursor, i, true);
+	}
+	expect_no_event(&cursor);
+
+	harness_set_key(3, false);
+	harness_run(20000);
+	expect_event(&cursor, 3, false);
+	expect_event(&cursor, KEYSTATE_COUNT, true);
+	expect_no_event(&cursor);
+	printf("ok: press with no free slot is retried once one is released\n");
+}
+
+static void expect_layer(logical_keycode key, bool keypad){
+	logical_keycode down = keypad ? key + KEYPAD_LAYER_SIZE : key;
+	logical_keycode up = keypad ? key : key + KEYPAD_LAYER_SIZE;
+	if(keystate_is_keypad_mode() != keypad || !keystate_check_key(down, LOGICAL) || keystate_check_key(up, LOGICAL)
+	   || !keystate_check_key(harness_mapping[down], HID) || keystate_check_key(harness_mapping[up], HID)
+	   || !keystate_check_key(key, PHYSICAL)){
+		printf("FAIL: key %d not in the %s layer\n", key, keypad ? "keypad" : "base");
+		exit(1);
+	}
+}
+
+// presses or releases the given keys together, and waits for them to be applied
+static void harness_change_keys(bool pressed, int count, ...){
+	va_list argp;
+	va_start(argp, count);
+	while(count--){
+		harness_set_key(va_arg(argp, int), pressed);
+	}
+	va_end(argp);
+	harness_run(10000);
+}
+
+static void test_keypad_layer(void){
+	harness_init();
+	key_event_cursor cursor = keystate_event_cursor();
+	const logical_keycode k = 20, k2 = 35;
+
+	// shifting moves a held key to the keypad layer, and back again
+	harness_change_keys(true, 1, k);
+	expect_event(&cursor, k, true);
+	expect_layer(k, false);
+
+	harness_change_keys(true, 1, HARNESS_SHIFT_KEY);
+	expect_event(&cursor, HARNESS_SHIFT_KEY, true);
+	expect_event(&cursor, k, false);
+	expect_event(&cursor, k + KEYPAD_LAYER_SIZE, true);
+	expect_no_event(&cursor);
+	expect_layer(k, true);
+
+	// a key pressed while shifted goes straight to the keypad layer
+	harness_change_keys(true, 1, k2);
+	expect_event(&cursor, k2 + KEYPAD_LAYER_SIZE, true);
+	expect_layer(k2, true);
+
+	// a second shift key: the layer changes only when both are released
+	harness_change_keys(true, 1, HARNESS_SHIFT_KEY_2);
+	expect_event(&cursor, HARNESS_SHIFT_KEY_2, true);
+	harness_change_keys(false, 1, HARNESS_SHIFT_KEY);
+	expect_event(&cursor, HARNESS_SHIFT_KEY, false);
+	expect_no_event(&cursor);
+	expect_layer(k, true);
+
+	harness_change_keys(false, 1, HARNESS_SHIFT_KEY_2);
+	expect_event(&cursor, HARNESS_SHIFT_KEY_2, false);
+	expect_event(&cursor, k + KEYPAD_LAYER_SIZE, false);
+	expect_event(&cursor, k, true);
+	expect_event(&cursor, k2 + KEYPAD_LAYER_SIZE, false);
+	expect_event(&cursor, k2, true);
+	expect_no_event(&cursor);
+	expect_layer(k, false);
+	expect_layer(k2, false);
+
+	// a key moved between layers is released from the layer it is in
+	harness_change_keys(false, 1, k2);
+	expect_event(&cursor, k2, false);
+	expect_no_event(&cursor);
+
+	// toggle: the layer stays while the toggle key is released
+	harness_change_keys(true, 1, HARNESS_TOGGLE_KEY);
+	harness_change_keys(false, 1, HARNESS_TOGGLE_KEY);
+	expect_event(&cursor, HARNESS_TOGGLE_KEY, true);
+	expect_event(&cursor, k, false);
+	expect_event(&cursor, k + KEYPAD_LAYER_SIZE, true);
+	expect_event(&cursor, HARNESS_TOGGLE_KEY, false);
+	expect_no_event(&cursor);
+	expect_layer(k, true);
+
+	// toggling off while shifting on in the same update leaves the layer
+	// unchanged, so held keys aren't moved
+	harness_change_keys(true, 2, HARNESS_TOGGLE_KEY, HARNESS_SHIFT_KEY);
+	expect_event(&cursor, HARNESS_SHIFT_KEY, true);
+	expect_event(&cursor, HARNESS_TOGGLE_KEY, true);
+	expect_no_event(&cursor);
+	expect_layer(k, true);
+
+	// and releasing both returns to the base layer, moving held keys once
+	harness_change_keys(false, 2, HARNESS_TOGGLE_KEY, HARNESS_SHIFT_KEY);
+	expect_event(&cursor, HARNESS_SHIFT_KEY, false);
+	expect_event(&cursor, HARNESS_TOGGLE_KEY, false);
+	expect_event(&cursor, k + KEYPAD_LAYER_SIZE, false);
+	expect_event(&cursor, k, true);
+	expect_no_event(&cursor);
+	expect_layer(k, false);
+
+	harness_change_keys(false, 1, k);
+	expect_event(&cursor, k, false);
+	expect_no_event(&cursor);
+	if(key_press_count != 0){
+		printf("FAIL: %d keys still down\n", key_press_count);
+		exit(1);
+	}
+	printf("ok: keypad layer transitions\n");
+}
+
+static double harness_now_ns(void){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+#define BENCH_SCANS 1000000
+
+// Reports the host time and matrix row reads per keystate_scan(), with no
+// keys down, with six keys held, and while typing a different key every
+// 40ms.
+static void benchmark(void){
+	const char* names[] = { "idle:", "held:", "typing:" };
+	for(int mode = 0; mode < 3; ++mode){
+		harness_init();
+		if(mode == 1){
+			for(int i = 0; i < 6; ++i) harness_set_key(i * 13, true);
+		}
+		harness_row_reads = 0;
+		double start = harness_now_ns();
+		for(long scan = 0; scan < BENCH_SCANS; ++scan){
+			if(mode == 2 && scan % 10 == 0){
+				harness_set_key((scan / 20) % NUM_PHYSICAL_KEYS, (scan % 20) == 0);
+			}
+			keystate_scan();
+			keystate_update();
+			harness_us += HARNESS_SCAN_US;
+		}
+		double ns = (harness_now_ns() - start) / BENCH_SCANS;
+		printf("%-8s %6.1f ns/scan, %.2f row reads/scan\n", names[mode], ns,
+			   (double) harness_row_reads / BENCH_SCANS);
+	}
+}
+
+typedef struct _harness_timing {
+	unsigned long count;
+	double total;
+	double total_sq;
+	uint32_t min;
+	uint32_t max;
+} harness_timing;
+
+static void timing_add(harness_timing* t, uint32_t us){
+	if(t->count == 0 || us < t->min) t->min = us;
+	if(us > t->max) t->max = us;
+	t->total += us;
+	t->total_sq += (double) us * us;
+	++t->count;
+}
+
+static void timing_print(const char* name, const harness_timing* t){
+	double mean = t->total / t->count;
+	double sd = t->total_sq / t->count - mean * mean;
+	printf("  %-26s mean %6.0f us, sd %6.0f us, min %6u us, max %6u us\n",
+		   name, mean, sd > 0 ? sqrt(sd) : 0, t->min, t->max);
+}
+
+static uint32_t harness_seed;
+static uint32_t harness_random(uint32_t n){
+	harness_seed = harness_seed * 1103515245 + 12345;
+	return (harness_seed >> 8) % n;
+}
+
+// Main loop iteration durations: a few hundred microseconds, with a
+// program slice every 20th iteration and an eeprom write (as when a
+// macro is recorded) every 500th.
+static uint32_t main_loop_us(unsigned long iteration){
+	uint32_t us = 150 + harness_random(100);
+	if(iteration % 20 == 0) us += 1000;
+	if(iteration % 500 == 0) us += 12000;
+	return us;
+}
+
+#define JITTER_SIMULATION_US 60000000 // a minute
+#define JITTER_ISR_LATENCY_US 20     // the timer interrupt may wait for the USB interrupt
+
+// Simulates a minute of typing with the scan driven from the main loop
+// (each time uptimems() turns even, as before MATRIX_SCAN_ISR), and from
+// a timer interrupt every HARNESS_SCAN_US. Reports the interval between
+// scans and the time from a key's press to its keystate_update().
+static void simulate_jitter(void){
+	printf("scan jitter:\n");
+	for(int isr = 0; isr < 2; ++isr){
+		harness_init();
+		harness_seed = 1;
+		harness_press_followed = false;
+
+		harness_timing interval = { 0 }, latency = { 0 };
+		uint32_t start = harness_us, end = start + JITTER_SIMULATION_US;
+		uint32_t last_scan = 0, next_scan = start, scan_at = isr ? start : UINT32_MAX;
+		uint32_t next_press = start + 1000, release = 0, pressed_at = 0;
+		bool waiting = false, update_keys = false;
+
+		for(unsigned long iteration = 0; harness_us < end; ++iteration){
+			uint32_t loop_us = harness_us;
+			uint32_t loop_end = loop_us + main_loop_us(iteration);
+
+			if(!isr){
+				uint8_t slice = uptimems() & 0x1;
+				if(!slice && update_keys){
+					if(last_scan) timing_add(&interval, harness_us - last_scan);
+					last_scan = harness_us;
+					keystate_scan();
+					update_keys = false;
+				}
+				else if(!update_keys && slice){
+					update_keys = true;
+				}
+			}
+
+			harness_press_applied_us = 0;
+			keystate_update();
+			if(harness_press_applied_us){
+				timing_add(&latency, harness_press_applied_us - pressed_at);
+			}
+
+			// a key press every 40-80ms, held for 30ms, and the scans due during this iteration
+			while(true){
+				uint32_t key_at = waiting ? release : next_press;
+				uint32_t at = scan_at < key_at ? scan_at : key_at;
+				if(at >= loop_end) break;
+				harness_us = at;
+				if(at == scan_at){
+					if(last_scan) timing_add(&interval, at - last_scan);
+					last_scan = at;
+					keystate_scan();
+					next_scan += HARNESS_SCAN_US;
+					scan_at = next_scan + harness_random(JITTER_ISR_LATENCY_US);
+				}
+				else if(!waiting){
+					harness_set_key(20, true);
+					pressed_at = at;
+					release = at + 30000;
+					waiting = true;
+				}
+				else{
+					harness_set_key(20, false);
+					next_press = at + 10000 + harness_random(40000);
+					waiting = false;
+				}
+			}
+			harness_us = loop_end;
+		}
+
+		printf(" %s:\n", isr ? "timer interrupt" : "main loop");
+		timing_print("scan interval", &interval);
+		timing_print("press to keystate_update", &latency);
+	}
+}
+
+#define TRACE_MAX_EDGES 64
+
+typedef struct _bounce_trace {
+	const char* name;
+	int count;
+	struct { uint32_t us; bool closed; } edges[TRACE_MAX_EDGES];
+} bounce_trace;
+
+// Built-in traces, modelled on typical mechanical switch bounce, used when
+// no trace files are given
+static const bounce_trace builtin_traces[] = {
+	{ "clean", 2, {{0, 1}, {50000, 0}} },
+	{ "press bounce", 6, {{0, 1}, {300, 0}, {700, 1}, {900, 0}, {1500, 1}, {50000, 0}} },
+	{ "release bounce", 6, {{0, 1}, {50000, 0}, {50400, 1}, {50900, 0}, {51200, 1}, {52000, 0}} },
+	{ "chatter", 10, {{0, 1}, {500, 0}, {1200, 1}, {2000, 0}, {2600, 1}, {3300, 0}, {4000, 1},
+					  {60000, 0}, {60700, 1}, {61500, 0}} },
+	{ "short tap", 2, {{0, 1}, {15000, 0}} },
+	{ "glitch", 2, {{0, 1}, {300, 0}} },
+};
+
+static bool trace_read(const char* filename, bounce_trace* trace){
+	FILE* f = fopen(filename, "r");
+	if(!f){
+		perror(filename);
+		return false;
+	}
+	trace->name = filename;
+	trace->count = 0;
+	unsigned long us;
+	int closed;
+	while(trace->count < TRACE_MAX_EDGES && fscanf(f, "%lu %d", &us, &closed) == 2){
+		trace->edges[trace->count].us = us;
+		trace->edges[trace->count].closed = closed != 0;
+		++trace->count;
+	}
+	fclose(f);
+	return true;
+}
+
+static bool trace_closed_at(const bounce_trace* trace, uint32_t us){
+	bool closed = false;
+	for(int i = 0; i < trace->count && trace->edges[i].us <= us; ++i){
+		closed = trace->edges[i].closed;
+	}
+	return closed;
+}
+
+// The key is taken to be pressed from the first contact to the end of the
+// longest closed period, if that is at least TRACE_MIN_PRESS_US: shorter
+// traces are noise and should produce no events.
+#define TRACE_MIN_PRESS_US 5000
+
+static bool trace_press(const bounce_trace* trace, uint32_t* press_us, uint32_t* release_us){
+	uint32_t longest = 0;
+	for(int i = 0; i < trace->count; ++i){
+		if(!trace->edges[i].closed) continue;
+		uint32_t end = (i + 1 < trace->count) ? trace->edges[i + 1].us : UINT32_MAX;
+		if(end - trace->edges[i].us > longest){
+			longest = end - trace->edges[i].us;
+			*release_us = end;
+		}
+	}
+	for(int i = 0; i < trace->count; ++i){
+		if(trace->edges[i].closed){
+			*press_us = trace->edges[i].us;
+			break;
+		}
+	}
+	return longest >= TRACE_MIN_PRESS_US;
+}
+
+#define TRACE_KEY 20
+#define TRACE_PHASES 20 // offsets of the trace from the scans, spread over a scan interval
+
+// Replays each trace against each debounce algorithm, starting at several
+// offsets from the scan, and reports the latency each algorithm added to
+// the press and release, and the events that shouldn't have been reported
+// (bounces) or that were missing.
+static void replay_traces(const bounce_trace* traces, int ntraces){
+	static const struct { debounce_mode_t mode; const char* name; } algorithms[] = {
+		{ DEBOUNCE_DEFERRED, "deferred" },
+		{ DEBOUNCE_EAGER,    "eager" },
+		{ DEBOUNCE_TIMED,    "timed" },
+	};
+	printf("debounce latency (%d scan offsets, %dus scans, %d samples or %dms):\n",
+		   TRACE_PHASES, HARNESS_SCAN_US, DEBOUNCE_SAMPLES, DEBOUNCE_MS);
+	printf("  %-16s %-9s %10s %10s %8s %8s\n", "trace", "algorithm", "press", "release", "extra", "missing");
+
+	for(int t = 0; t < ntraces; ++t){
+		const bounce_trace* trace = &traces[t];
+		uint32_t press_us = 0, release_us = 0;
+		bool real = trace_press(trace, &press_us, &release_us);
+		uint32_t length = trace->count ? trace->edges[trace->count - 1].us + 30000 : 0;
+
+		for(int a = 0; a < (int) (sizeof(algorithms) / sizeof(algorithms[0])); ++a){
+			harness_timing press = { 0 }, release = { 0 };
+			unsigned long extra = 0, missing = 0;
+
+			for(int phase = 0; phase < TRACE_PHASES; ++phase){
+				harness_init();
+				keystate_set_debounce_mode(algorithms[a].mode);
+				key_event_cursor cursor = keystate_event_cursor();
+
+				// trace time 0 falls `offset` after a scan
+				uint32_t offset = phase * HARNESS_SCAN_US / TRACE_PHASES;
+				uint32_t start = harness_us + offset;
+				int presses = 0, releases = 0;
+				for(; harness_us < start + length; harness_us += HARNESS_SCAN_US){
+					uint32_t trace_us = harness_us - start;
+					harness_set_key(TRACE_KEY, harness_us >= start && trace_closed_at(trace, trace_us));
+					keystate_scan();
+					keystate_update();
+
+					key_event event;
+					while(keystate_next_event(&cursor, &event)){
+						if(event.press){
+							if(++presses == 1 && real) timing_add(&press, trace_us - press_us);
+						}
+						else{
+							if(++releases == 1 && real) timing_add(&release, trace_us - release_us);
+						}
+					}
+				}
+				int expected = real ? 1 : 0;
+				extra += (presses > expected ? presses - expected : 0) + (releases > expected ? releases - expected : 0);
+				missing += (presses < expected ? expected - presses : 0) + (releases < expected ? expected - releases : 0);
+			}
+			keystate_set_debounce_mode(DEBOUNCE_DEFAULT);
+
+			char press_ms[16] = "-", release_ms[16] = "-";
+			if(press.count) snprintf(press_ms, sizeof(press_ms), "%.2fms", press.total / press.count / 1000);
+			if(release.count) snprintf(release_ms, sizeof(release_ms), "%.2fms", release.total / release.count / 1000);
+			printf("  %-16s %-9s %10s %10s %8lu %8lu\n", a ? "" : trace->name, algorithms[a].name,
+				   press_ms, release_ms, extra, missing);
+		}
+	}
+}
+
+#define HARNESS_HOOK_EVENTS 64
+static key_event harness_hook_events[HARNESS_HOOK_EVENTS];
+static int harness_hook_count;
+
+static void harness_hook(logical_keycode l_key, bool press){
+	if(harness_hook_count < HARNESS_HOOK_EVENTS){
+		harness_hook_events[harness_hook_count].l_key = l_key;
+		harness_hook_events[harness_hook_count].press = press;
+	}
+	++harness_hook_count;
+}
+
+static void expect_hook_event(int* next, logical_keycode l_key, bool press){
+	key_event* event = &harness_hook_events[*next];
+	if(*next >= harness_hook_count || event->l_key != l_key || event->press != press){
+		printf("FAIL: change hook event %d, expected %s of key %d\n", *next, press ? "press" : "release", l_key);
+		exit(1);
+	}
+	++*next;
+}
+
+static void test_change_hook(void){
+	harness_init();
+	const int nkeys = KEY_EVENT_COUNT / 2;
+
+	for(int i = 0; i < nkeys; ++i){
+		harness_set_key(i, true);
+	}
+	harness_run(20000);
+
+	// toggling the keypad layer moves every held key in the same update:
+	// more events than the ring holds, none of which may be lost to the hook
+	harness_hook_count = 0;
+	keystate_register_change_hook(&harness_hook);
+	harness_change_keys(true, 1, HARNESS_TOGGLE_KEY);
+	keystate_register_change_hook(0);
+
+	int next = 0;
+	expect_hook_event(&next, HARNESS_TOGGLE_KEY, true);
+	for(int i = 0; i < nkeys; ++i){
+		expect_hook_event(&next, i, false);
+		expect_hook_event(&next, i + KEYPAD_LAYER_SIZE, true);
+	}
+	if(next != harness_hook_count || next <= KEY_EVENT_COUNT){
+		printf("FAIL: change hook saw %d events\n", harness_hook_count);
+		exit(1);
+	}
+
+	harness_change_keys(false, 1, HARNESS_TOGGLE_KEY);
+	harness_change_keys(true, 1, HARNESS_TOGGLE_KEY);
+	harness_change_keys(false, 1, HARNESS_TOGGLE_KEY);
+	for(int i = 0; i < nkeys; ++i){
+		harness_set_key(i, false);
+	}
+	harness_run(20000);
+	printf("ok: change hook sees every event of a keypad layer move\n");
+}
+
+int main(int argc, const char** argv){
+	test_matrix();
+	test_event_ring();
+	test_full_slots();
+	test_keypad_layer();
+	test_change_hook();
+	benchmark();
+	simulate_jitter();
+
+	if(argc > 1){
+		bounce_trace* traces = malloc((argc - 1) * sizeof(bounce_trace));
+		for(int i = 1; i < argc; ++i){
+			if(!trace_read(argv[i], &traces[i - 1])) exit(1);
+		}
+		replay_traces(traces, argc - 1);
+		free(traces);
+	}
+	else{
+		replay_traces(builtin_traces, sizeof(builtin_traces) / sizeof(builtin_traces[0]));
+	}
+	return 0;
+}
@@ -48,6 +48,8 @@
 #include "config.h"
 #include "macro.h"
 #include "macro_index.h"
+#include "interpreter.h"
+#include "stats.h"
 
 /** LUFA HID Class driver interface configuration and state information. This structure is
  *  passed to all HID Class driver functions, so that multiple instances of the same class
@@ -63,11 +65,38 @@ USB_ClassInfo_HID_Device_t Keyboard_HID_Interface =
 				.ReportINEndpointSize         = HID_EPSIZE,
 				.ReportINEndpointDoubleBank   = false,
 
-				.PrevReportINBuffer           = (void*) &PrevKeyboardHIDReportBuffer,
-				.PrevReportINBufferSize       = sizeof(PrevKeyboardHIDReportBuffer),
+				// Reports are compared in CALLBACK_HID_Device_CreateHIDReport():
+				// the class driver would also record GET_REPORT replies as sent.
+				.PrevReportINBuffer           = NULL,
+				.PrevReportINBufferSize       = sizeof(KeyboardReport_Data_t),
 			},
 	};
 
+#if USB_NKRO
+/** LUFA HID Class driver interface configuration and state information for the NKRO keyboard
+ *  HID interface within the device. Keys are reported here instead of on the boot keyboard
+ *  interface while the host has selected the report protocol.
+ */
+USB_ClassInfo_HID_Device_t NKRO_HID_Interface =
+	{
+		.Config =
+			{
+				.InterfaceNumber              = 2,
+
+				.ReportINEndpointNumber       = NKRO_IN_EPNUM,
+				.ReportINEndpointSize         = NKRO_EPSIZE,
+				.ReportINEndpointDoubleBank   = false,
+
+				.PrevReportINBuffer           = NULL,
+				.PrevReportINBufferSize       = sizeof(KeyboardReportBitmap),
+			},
+	};
+
+#define NKRO_ACTIVE() (Keyboard_HID_Interface.State.UsingReportProtocol)
+#else
+#define NKRO_ACTIVE() false
+#endif
+
 /** LUFA HID Class driver interface configuration and state information. This structure is
  *  passed to all HID Class driver functions, so that multiple instances of the same class
  *  within a device can be differentiated from one another. This is for the mouse HID
@@ -95,6 +124,8 @@ int main(void) {
 	/* Disable clock division */
 	clock_prescale_set(clock_div_1);
 
+	TCCR1B |= ((1 << CS10) | (1 << CS11)); // Set up timer at Fcpu/64 for stats_ticks()
+
 	/* Hardware Initialization */
 	Update_USBState(NOTREADY);
 
@@ -117,10 +148,46 @@ void USB_KeepAlive(uint8_t poll){
 	}
 }
 
+void USB_FinishStorageJobs(void){
+	while(storage_job_busy()){
+		storage_job_task();
+		USB_KeepAlive(false);
+	}
+}
+
+/** Set while the class driver fills interrupt IN reports, rather than GET_REPORT replies. */
+static bool keyboard_report_task;
+
+/** Set when a keyboard report that differs from the previous one has been sent. */
+static bool keyboard_report_sent;
+
+/**
+ * Returns true to force the sending of a keyboard interrupt IN report
+ * that differs from the last one sent on its interface.
+ */
+static bool keyboard_report_changed(const void* report, void* prev, uint8_t size){
+	if(!keyboard_report_task || !memcmp(report, prev, size)){
+		return false;
+	}
+	memcpy(prev, report, size);
+	keyboard_report_sent = true;
+	return true;
+}
+
 void USB_Perform_Update(void){
 	HID_Device_USBTask(&Mouse_HID_Interface);
 
+	keyboard_report_task = true;
 	HID_Device_USBTask(&Keyboard_HID_Interface);
+#if USB_NKRO
+	HID_Device_USBTask(&NKRO_HID_Interface);
+#endif
+	keyboard_report_task = false;
+
+	if(keyboard_report_sent){
+		keyboard_report_sent = false;
+		Complete_KeyboardHIDReport();
+	}
 
 	USB_KeepAlive(true);
 }
@@ -146,6 +213,10 @@ void EVENT_USB_Device_ConfigurationChanged(void)
 
 	ConfigSuccess &= HID_Device_ConfigureEndpoints(&Mouse_HID_Interface);
 
+#if USB_NKRO
+	ConfigSuccess &= HID_Device_ConfigureEndpoints(&NKRO_HID_Interface);
+#endif
+
 	// enable the start-of-frame event (millisecond callback)
 	USB_Device_EnableSOFEvents();
 
@@ -157,6 +228,9 @@ void EVENT_USB_Device_ControlRequest(void)
 {
 	HID_Device_ProcessControlRequest(&Keyboard_HID_Interface);
 	HID_Device_ProcessControlRequest(&Mouse_HID_Interface);
+#if USB_NKRO
+	HID_Device_ProcessControlRequest(&NKRO_HID_Interface);
+#endif
 
 	// TODO: Bounds check the transfers to make sure we don't overflow our
 	// eeprom buffers.
@@ -207,6 +281,12 @@ void EVENT_USB_Device_ControlRequest(void)
 		case READ_DEFAULT_MAPPING:
 			Endpoint_Write_Control_StorageStream_LE(CONSTANT_STORAGE, (uint8_t*)logical_to_hid_map_default, USB_ControlRequest.wLength);
 			goto ack_write_status;
+		case READ_LATENCY_STATS:
+			Endpoint_Write_Control_Stream_LE(stats_get_latency(), MIN(sizeof(latency_stats), USB_ControlRequest.wLength));
+			goto ack_write_status;
+		case READ_PROGRAM_STATUS:
+			Endpoint_Write_Control_Stream_LE(vm_get_program_status(), MIN(sizeof(vm_program_status) * PROGRAM_COUNT, USB_ControlRequest.wLength));
+			goto ack_write_status;
 		case READ_MAPPING:
 			Endpoint_Write_Control_StorageStream_LE(MAPPING_STORAGE, config_get_mapping(), USB_ControlRequest.wLength);
 		ack_write_status:
@@ -227,16 +307,25 @@ void EVENT_USB_Device_ControlRequest(void)
 		switch(USB_ControlRequest.bRequest){
 			// write requests
 		case WRITE_PROGRAMS:
+			vm_stop_all();
 			Endpoint_Read_Control_StorageStream_LE(PROGRAM_STORAGE, config_get_programs(), USB_ControlRequest.wLength);
+			vm_init();
 			goto ack_read_status;
 		case WRITE_MACRO_INDEX:
+			USB_FinishStorageJobs();
+			macros_host_write();
 			Endpoint_Read_Control_StorageStream_LE(MACRO_INDEX_STORAGE, macro_idx_get_storage(), USB_ControlRequest.wLength);
+			macro_idx_init();
 			goto ack_read_status;
 		case WRITE_MACRO_STORAGE:
+			USB_FinishStorageJobs();
+			macros_host_write();
 			Endpoint_Read_Control_StorageStream_LE(MACROS_STORAGE, macros_get_storage(), USB_ControlRequest.wLength);
 			goto ack_read_status;
 		case WRITE_MAPPING:
+			USB_FinishStorageJobs();
 			Endpoint_Read_Control_StorageStream_LE(MAPPING_STORAGE, config_get_mapping(), USB_ControlRequest.wLength);
+			config_reload_mapping();
 		ack_read_status:
 			// stream read functions already waited for the host to be ready:
 			// just send the status ack
@@ -249,10 +338,17 @@ void EVENT_USB_Device_ControlRequest(void)
 			goto clear_status;
 		}
 		case RESET_DEFAULTS:
+			USB_FinishStorageJobs();
 			config_reset_defaults();
+			USB_FinishStorageJobs();
+			goto clear_status;
+		case RESET_LATENCY_STATS:
+			stats_reset();
 			goto clear_status;
 		case RESET_FULLY:
+			USB_FinishStorageJobs();
 			config_reset_fully();
+			USB_FinishStorageJobs();
 		clear_status:
 			Endpoint_ClearStatusStage();
 			break;
@@ -267,6 +363,9 @@ void EVENT_USB_Device_StartOfFrame(void)
 {
 	HID_Device_MillisecondElapsed(&Keyboard_HID_Interface);
 	HID_Device_MillisecondElapsed(&Mouse_HID_Interface);
+#if USB_NKRO
+	HID_Device_MillisecondElapsed(&NKRO_HID_Interface);
+#endif
 	Update_Millis(1);
 }
 
@@ -286,10 +385,24 @@ bool CALLBACK_HID_Device_CreateHIDReport(USB_ClassInfo_HID_Device_t* const HIDIn
 	if (HIDInterfaceInfo == &Keyboard_HID_Interface){
 		KeyboardReport_Data_t* KeyboardReport = (KeyboardReport_Data_t*)ReportData;
 
+		// Left empty while the NKRO interface is reporting keys
 		*ReportSize = sizeof(KeyboardReport_Data_t);
-		Fill_KeyboardReport(KeyboardReport);
+		if(!NKRO_ACTIVE()){
+			Fill_KeyboardHIDReport(KeyboardReport);
+		}
+		return keyboard_report_changed(KeyboardReport, &PrevKeyboardHIDReportBuffer, sizeof(KeyboardReport_Data_t));
+	}
+#if USB_NKRO
+	else if (HIDInterfaceInfo == &NKRO_HID_Interface){
+		KeyboardReportBitmap* NKROReport = (KeyboardReportBitmap*)ReportData;
 
+		*ReportSize = sizeof(KeyboardReportBitmap);
+		if(NKRO_ACTIVE()){
+			Fill_NKROHIDReport(NKROReport);
+		}
+		return keyboard_report_changed(NKROReport, &PrevNKROHIDReportBuffer, sizeof(KeyboardReportBitmap));
 	}
+#endif
 	else{
 		MouseReport_Data_t* MouseReport = (MouseReport_Data_t*)ReportData;
 		*ReportSize = sizeof(MouseReport_Data_t);
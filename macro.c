@@ -70,8 +70,24 @@ static struct _macro_recording_state {
 	macro_data* macro;
 	hid_keycode* cursor;
 	macro_idx_entry* index_entry;
+	storage_job_complete started; // callback of macros_start_macro()
+	bool prepare_failed;          // a job preparing the index entry failed
+	bool flush_failed;            // a job writing recorded events failed
+	// Recorded events not yet written to storage, which end at
+	// cursor. Flushed whenever cursor reaches a page boundary, so
+	// that each storage write is at most one full page.
+	uint8_t buffered;
+	hid_keycode buffer[EEEXT_PAGE_SIZE];
 } recording_state;
 
+// A full page of recorded events queued to be written by a storage job,
+// so that recording can continue into recording_state.buffer meanwhile.
+static struct {
+	hid_keycode* dst;
+	uint8_t len; // 0 if no flush is queued
+	hid_keycode data[EEEXT_PAGE_SIZE];
+} flush_state;
+
 static struct _macro_playback_state {
 	uint16_t remaining;
 	hid_keycode* cursor; // pointer to serial eeprom memory
@@ -101,59 +117,132 @@ static macro_data* macros_get_macro_pointer(uint16_t offset){
 	if(storage_write(MACROS_STORAGE, (uint8_t*)ptr, (uint8_t*)&var, sizeof(typeof(var))) != sizeof(typeof(var))){ goto err; }
 
 
+/////////// Deletion and Compaction /////////////
+
+// Macro data is a log of records, appended to as macros are recorded.
+// Deleted records are marked by this bit in their length header, and their
+// space is reclaimed in the background by the compaction job, which moves
+// each later live record down and rewrites only that record's index entry.
+#define MACRO_DELETED 0x8000
+
+// If less space than this is free at the end of the log when recording
+// starts, compact first rather than in the background afterwards.
+#define MACROS_MIN_FREE 64
+
+static bool compact_pending = false; // deleted records may need reclaiming
+
+static struct {
+	uint16_t read;  // offset of the next record to examine
+	uint16_t write; // offset to move the next live record down to
+	uint16_t end;   // end of the log
+	uint16_t size;  // size of the record being moved (including header), or 0
+	uint16_t moved; // bytes of that record moved so far
+} compact_state;
+
 typedef struct {
-	uint16_t offset;
-	uint16_t len;
-} macro_range;
+	uint16_t from;
+	uint16_t to;
+} macro_move;
 
-static void macro_shift_down_iterator(macro_idx_entry* entry, macro_range* range){
+static void macro_moved_iterator(macro_idx_entry* entry, macro_move* move){
 	macro_idx_entry_data d = macro_idx_get_data(entry);
-	if(d.type != MACRO) return;
-	// offset of start of macro is in d.data: if it's greater than the
-	// removed range, subtract the removed length
-	if(d.data > range->offset){
-		d.data -= range->len;
+	if(d.type == MACRO && d.data == move->from){
+		d.data = move->to;
 		macro_idx_set_data(entry, d);
 	}
 }
 
+static storage_job_status macros_compact_step(storage_job* job){
+	if(job->cursor == 0){
+		job->cursor = 1;
+		compact_pending = false;
+		macro_storage_read_var(compact_state.end, macros_end_offset);
+		compact_state.read = 0;
+		compact_state.write = 0;
+		compact_state.size = 0;
+	}
+
+	if(compact_state.size){
+		// Move the live record at read down to write, at most one storage
+		// step at a time. Once it's all moved, update its index entry.
+		uint16_t remaining = compact_state.size - compact_state.moved;
+		uint8_t* dst = &macros[compact_state.write + compact_state.moved];
+		uint16_t n = storage_step_size(MACROS_STORAGE) - ((intptr_t) dst & (storage_step_size(MACROS_STORAGE) - 1));
+		if(n > remaining) n = remaining;
+
+		if(storage_memmove(MACROS_STORAGE, dst, &macros[compact_state.read + compact_state.moved], n) != SUCCESS){ goto err; }
+		compact_state.moved += n;
+
+		if(compact_state.moved == compact_state.size){
+			macro_move move = { compact_state.read, compact_state.write };
+			macro_idx_iterate((macro_idx_iterator)macro_moved_iterator, &move);
+			compact_state.read += compact_state.size;
+			compact_state.write += compact_state.size;
+			compact_state.size = 0;
+		}
+		return STORAGE_JOB_CONTINUE;
+	}
+
+	// Skip over deleted records, and live records which needn't move, until
+	// we find one to move.
+	while(compact_state.read < compact_state.end){
+		uint16_t header;
+		macro_storage_read_var(header, &macros_get_macro_pointer(compact_state.read)->length);
+		uint16_t size = (header & ~MACRO_DELETED) + 2; // length header + data
+
+		if(header & MACRO_DELETED){
+			compact_state.read += size;
+		}
+		else if(compact_state.read == compact_state.write){
+			compact_state.read += size;
+			compact_state.write += size;
+		}
+		else{
+			compact_state.size = size;
+			compact_state.moved = 0;
+			return STORAGE_JOB_CONTINUE;
+		}
+	}
+
+	// and release the reclaimed space
+	if(compact_state.write != compact_state.end){
+		macro_storage_write_var(macros_end_offset, compact_state.write);
+	}
+	return STORAGE_JOB_DONE;
+
+ err:
+	compact_pending = true;
+	return STORAGE_JOB_FAILED;
+}
+
+/**
+ * internal function: queue a storage job to reclaim the space of
+ * deleted macros, if there may be any. Returns false if the job is
+ * needed but can't be queued: it's then retried by the next call.
+ */
+static bool macros_compact(storage_job_complete complete){
+	if(compact_pending){
+		return storage_job_submit(macros_compact_step, complete);
+	}
+	return true;
+}
+
 /**
- * internal function: remove any macro data for the given macro index
- * entry. Returns true if no error, false if error.
+ * internal function: mark any macro data for the given macro index
+ * entry as deleted. Returns true if no error, false if error.
  */
 static bool delete_macro_data(macro_idx_entry* idx_entry){
 	macro_idx_entry_data idx_data = macro_idx_get_data(idx_entry);
 	if(idx_data.type != MACRO) return true; // no data to delete, trivial success
 
-	uint16_t entry_offset = idx_data.data;
-	macro_data* entry = (macro_data*) (&macros[entry_offset]);
+	macro_data* entry = macros_get_macro_pointer(idx_data.data);
 
-	// read the macro space end offset
-	uint16_t end_offset;
-	macro_storage_read_var(end_offset, macros_end_offset);
-
-	// Read the length of the macro to be deleted
-	uint16_t entry_len;
-	macro_storage_read_var(entry_len, &entry->length);
-	entry_len += 2; // length header
-
-	uint16_t rest_offset = entry_offset + entry_len;
-	uint16_t rest_len = end_offset - rest_offset;
-	if(rest_len){
-		// if there is data after the entry, move rest_len bytes of
-		// macro data down to entry_offset from rest_offset
-		if(storage_memmove(MACROS_STORAGE, &macros[entry_offset], &macros[rest_offset], rest_len) != SUCCESS){ goto err; }
-
-		// Now scan the macro index, and move down any entries > entry_offset by entry_len
-		macro_range deleted_range;
-		deleted_range.offset = entry_offset;
-		deleted_range.len = entry_len;
-		macro_idx_iterate((macro_idx_iterator)macro_shift_down_iterator, &deleted_range);
-	}
-	// and update the saved macro end offset
-	end_offset -= entry_len;
-	macro_storage_write_var(macros_end_offset, end_offset);
+	uint16_t header;
+	macro_storage_read_var(header, &entry->length);
+	header |= MACRO_DELETED;
+	macro_storage_write_var(&entry->length, header);
 
+	compact_pending = true;
 	return true;
  err:
 	return false;
@@ -162,23 +251,51 @@ static bool delete_macro_data(macro_idx_entry* idx_entry){
 
 /////////// Macro Recording /////////////
 
+static storage_job_status macros_flush_step(storage_job* job){
+	uint8_t len = flush_state.len;
+	flush_state.len = 0;
+	if(storage_write(MACROS_STORAGE, (uint8_t*)flush_state.dst, (uint8_t*)flush_state.data, len) != len){
+		return STORAGE_JOB_FAILED;
+	}
+	return STORAGE_JOB_DONE;
+}
+
+// Completion of macros_flush_step
+static void macros_flush_complete(bool success){
+	if(!success && recording_state.macro){
+		recording_state.flush_failed = true;
+	}
+}
+
 /**
- * Starts recording a macro identified by the given key. Adds it to
- * the index, removes any existing data, and returns a pointer to the
- * macro data. Only one macro may be being recorded at once.
+ * internal function: queue a storage job to write the buffered events
+ * of the macro being recorded. Returns false if the previous page is
+ * still waiting to be written, or the job can't be queued.
  */
-bool macros_start_macro(macro_idx_key* key){
-	// Find or create a free entry:
-	macro_idx_entry* entry = macro_idx_lookup(key);
-	if(entry){
-		// There's already an entry for this key in the index: delete
-		// the old macro data if necessary and re-use this slot
-		if(!delete_macro_data(entry)) goto err;
+static bool macros_flush_recording(void){
+	uint8_t len = recording_state.buffered;
+	if(flush_state.len) return false;
+	flush_state.dst = recording_state.cursor - len;
+	flush_state.len = len;
+	memcpy(flush_state.data, recording_state.buffer, len);
+	if(!storage_job_submit(macros_flush_step, macros_flush_complete)){
+		flush_state.len = 0;
+		return false;
 	}
-	else{
-		entry = macro_idx_create(key);
-		if(!entry) goto err;
+	recording_state.buffered = 0;
+	return true;
+}
+
+// Completion of the jobs preparing storage for a new macro
+static void macros_start_job_complete(bool success){
+	if(!success){
+		recording_state.prepare_failed = true;
 	}
+}
+
+static storage_job_status macros_start_step(storage_job* job){
+	macro_idx_entry* entry = recording_state.index_entry;
+	if(recording_state.prepare_failed) goto err;
 
 	// Now store the data in the entry:
 	macro_idx_entry_data new_entry_data;
@@ -189,20 +306,109 @@ bool macros_start_macro(macro_idx_key* key){
 	// and set up the new macro for recording content
 	recording_state.macro = macros_get_macro_pointer(new_entry_data.data);
 	recording_state.cursor = &recording_state.macro->events[0];
+	return STORAGE_JOB_DONE;
+
+ err:
+	return STORAGE_JOB_FAILED;
+}
+
+// Completion of macros_start_step
+static void macros_start_complete(bool success){
+	storage_job_complete started = recording_state.started;
+	if(!success){
+		// The entry's old data has been deleted, or it's newly created and
+		// has no data: don't leave it in the index.
+		buzzer_start_f(200, BUZZER_FAILURE_TONE);
+		macro_idx_remove(recording_state.index_entry);
+		memset(&recording_state, 0x0, sizeof(recording_state));
+	}
+	if(started){
+		started(success);
+	}
+}
+
+/**
+ * Starts recording a macro identified by the given key. Adds it to
+ * the index and deletes any existing data, using storage jobs which
+ * call started when done. Only one macro may be being recorded at
+ * once.
+ */
+bool macros_start_macro(macro_idx_key* key, storage_job_complete started){
+	memset(&recording_state, 0x0, sizeof(recording_state));
+
+	// Find or create a free entry:
+	macro_idx_entry* entry = macro_idx_lookup(key);
+	if(entry){
+		// There's already an entry for this key in the index: delete
+		// the old macro data if necessary and re-use this slot
+		if(!delete_macro_data(entry)) goto err;
+	}
+	else{
+		entry = macro_idx_create(key, macros_start_job_complete);
+		if(!entry) goto err;
+	}
 	recording_state.index_entry = entry;
+
+	// Reclaim deleted macros first if there's little space left
+	uint16_t end_offset;
+	macro_storage_read_var(end_offset, macros_end_offset);
+	if(MACROS_SIZE - sizeof(uint16_t) - end_offset < MACROS_MIN_FREE){
+		if(!macros_compact(macros_start_job_complete)) goto err;
+	}
+
+	// Once the entry is ready, start recording into it
+	recording_state.started = started;
+	if(!storage_job_submit(macros_start_step, macros_start_complete)) goto err;
 	return true;
 
  err:
 	buzzer_start_f(200, BUZZER_FAILURE_TONE);
+	if(recording_state.index_entry){
+		macro_idx_remove(recording_state.index_entry);
+	}
 	memset(&recording_state, 0x0, sizeof(recording_state));
 	return false;
 }
 
+static storage_job_status macros_commit_step(storage_job* job){
+	if(!recording_state.macro || recording_state.flush_failed) goto err;
+
+	// Write the remaining events, then the header that makes them a macro
+	uint8_t len = recording_state.buffered;
+	hid_keycode* dst = recording_state.cursor - len;
+	if(len && storage_write(MACROS_STORAGE, (uint8_t*)dst, (uint8_t*)recording_state.buffer, len) != len) goto err;
+
+	uint16_t macro_len = recording_state.cursor - &recording_state.macro->events[0];
+	macro_storage_write_var(&recording_state.macro->length, macro_len);
+	uint16_t end_offset;
+	macro_storage_read_var(end_offset, macros_end_offset);
+	end_offset += macro_len + 2; // length header + data
+	macro_storage_write_var(macros_end_offset, end_offset);
+	return STORAGE_JOB_DONE;
+
+ err:
+	return STORAGE_JOB_FAILED;
+}
+
+// Completion of macros_commit_step
+static void macros_commit_complete(bool success){
+	if(success){
+		buzzer_start_f(200, BUZZER_SUCCESS_TONE);
+		memset(&recording_state, 0x0, sizeof(recording_state));
+		macros_compact(NULL);
+	}
+	else{
+		buzzer_start_f(200, BUZZER_FAILURE_TONE);
+		macros_abort_macro();
+	}
+}
+
 /**
  * Commits the current macro which was started with
  * macros_start_macro().  If len is 0, instead rolls back the macro
  * creation and removes the entry from the index.  This is also used
- * to delete a macro.
+ * to delete a macro. Any events still buffered are written by a
+ * storage job after those already queued, which buzzes the result.
  */
 void macros_commit_macro(){
 	if(!recording_state.macro){
@@ -212,34 +418,56 @@ void macros_commit_macro(){
 	uint16_t macro_len = recording_state.cursor - &recording_state.macro->events[0];
 	if(macro_len == 0){
 		// find the macro in the index and remove it.
-		macro_idx_remove(recording_state.index_entry);
-	}
-	else{
-		macro_storage_write_var(&recording_state.macro->length, macro_len);
-		uint16_t end_offset;
-		macro_storage_read_var(end_offset, macros_end_offset);
-		end_offset += macro_len + 2; // length header + data
-		macro_storage_write_var(macros_end_offset, end_offset);
-		buzzer_start_f(200, BUZZER_SUCCESS_TONE);
+		if(!macro_idx_remove(recording_state.index_entry)){
+			macros_abort_macro();
+			goto err;
+		}
+		memset(&recording_state, 0x0, sizeof(recording_state));
+		macros_compact(NULL);
+		return;
 	}
 
-	memset(&recording_state, 0x0, sizeof(recording_state));
+	if(!storage_job_submit(macros_commit_step, macros_commit_complete)){
+		macros_abort_macro();
+		goto err;
+	}
 	return;
 
  err:
 	buzzer_start_f(200, BUZZER_FAILURE_TONE);
 }
 
+void macros_host_write(){
+	// The USB layer has let any compaction or index update complete before
+	// its data is replaced: forget anything that refers to the old data. The
+	// new data may contain deleted records, so compact it when next possible.
+	memset(&recording_state, 0x0, sizeof(recording_state));
+	compact_pending = true;
+}
+
 void macros_abort_macro(){
-	macro_idx_remove(recording_state.index_entry);
+	if(recording_state.index_entry){
+		macro_idx_remove(recording_state.index_entry);
+	}
+	// discards any buffered events along with the rest of the state
 	memset(&recording_state, 0x0, sizeof(recording_state));
+	macros_compact(NULL);
 }
 
 bool macros_append(hid_keycode event){
-	macro_storage_write_var(recording_state.cursor++, event);
+	if(!recording_state.macro || recording_state.flush_failed){
+		return false; // not recording, abandoned by macros_host_write(), or failed
+	}
+	if((uint8_t*)recording_state.cursor >= &macros_storage[MACROS_SIZE]){
+		return false; // no space left
+	}
+	recording_state.buffer[recording_state.buffered++] = event;
+	++recording_state.cursor;
+
+	if(((intptr_t)recording_state.cursor & (EEEXT_PAGE_SIZE - 1)) == 0){
+		return macros_flush_recording();
+	}
 	return true;
- err:
-	return false;
 }
 
 ////// Macro Playback /////
@@ -256,7 +484,7 @@ bool macros_start_playback(uint16_t macro_offset){
 	return false;
 }
 
-bool macros_fill_next_report(KeyboardReport_Data_t* report){
+bool macros_fill_next_report(KeyboardReportBitmap* report){
 	if(playback_state.remaining){
 		--playback_state.remaining;
 		hid_keycode event;
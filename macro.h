@@ -53,7 +53,7 @@
 #include "macro_index.h"
 
 typedef struct _macro_data {
-	uint16_t length;
+	uint16_t length; // high bit set if deleted and awaiting compaction
 	hid_keycode events[1]; // When encountering a key event, if not pressed, press, else release.
 } macro_data;
 
@@ -70,16 +70,19 @@ void macros_reset_defaults(void);
 
 /**
  * Starts recording a macro identified by the given key. Adds it to
- * the index, removes any existing data, and returns a pointer to the
- * macro data. Only one macro may be being recorded at once.
+ * the index and removes any existing data using storage jobs, which
+ * call started when done: events may be appended only after a
+ * successful start. Returns false if the macro could not be started.
+ * Only one macro may be being recorded at once.
  */
-bool macros_start_macro(macro_idx_key* key);
+bool macros_start_macro(macro_idx_key* key, storage_job_complete started);
 
 /**
  * Commits the currently recording macro which was started with
  * macros_start_macro().  If no events have been appended, instead
  * rolls back the macro creation and removes the entry from the index.
- * This is also used to delete a macro.
+ * This is also used to delete a macro. The events are written by a
+ * storage job, which buzzes to signal the result.
  */
 void macros_commit_macro(void);
 
@@ -90,8 +93,16 @@ void macros_commit_macro(void);
 void macros_abort_macro(void);
 
 /**
- * Appends the argument HID keycode to the macro being recorded.
- * Returns false if no space left or write failed.
+ * To be called before the host rewrites the macro index or macro
+ * storage, once any queued storage jobs have completed: abandons any
+ * macro being recorded.
+ */
+void macros_host_write(void);
+
+/**
+ * Appends the argument HID keycode to the macro being recorded. Full
+ * pages of events are written by storage jobs. Returns false if no
+ * space left, or a write failed or can't be queued.
  */
 bool macros_append(hid_keycode event);
 
@@ -103,6 +114,6 @@ bool macros_start_playback(uint16_t macro_offset);
 /**
  * Plays the next character, returns true there's more to replay, false if finished.
  */
-bool macros_fill_next_report(KeyboardReport_Data_t* report);
+bool macros_fill_next_report(KeyboardReportBitmap* report);
 
 #endif // __MACRO_H
@@ -43,6 +43,13 @@
   this software.
 */
 
+#ifdef DEBUG
+
+// standalone binary harness
+#include "macro_index_harness.c"
+
+#else
+
 #include <stdint.h>
 
 #include "hardware.h"
@@ -58,12 +65,43 @@
 #include "sort.h"
 
 #include <stdint.h>
-#include <stdlib.h>
 #include <util/delay.h>
 
+#endif
+
 // The macro lookup index is in internal eeprom
 static macro_idx_entry macro_index[MACRO_INDEX_COUNT] STORAGE(MACRO_INDEX_STORAGE);
 
+// Lookups go through an open-addressed hash table in SRAM, rebuilt by
+// macro_idx_init() whenever the whole index is rewritten, and updated in
+// place as single entries are created or removed. Each slot holds the
+// position of an index entry and an 8-bit tag from the rest of the
+// entry's key hash, so a lookup of an absent key doesn't need to read
+// the index in storage, and a found one is confirmed by a single
+// comparison with its entry.
+#ifdef MACRO_INDEX_HASH_SIZE
+#define MACRO_IDX_HASH_SIZE MACRO_INDEX_HASH_SIZE
+#elif MACRO_INDEX_COUNT <= 16
+#define MACRO_IDX_HASH_SIZE 32
+#elif MACRO_INDEX_COUNT <= 32
+#define MACRO_IDX_HASH_SIZE 64
+#elif MACRO_INDEX_COUNT <= 64
+#define MACRO_IDX_HASH_SIZE 128
+#elif MACRO_INDEX_COUNT <= 128
+#define MACRO_IDX_HASH_SIZE 256
+#else
+#error "MACRO_INDEX_COUNT too large for hash table"
+#endif
+
+#if MACRO_IDX_HASH_SIZE <= MACRO_INDEX_COUNT || MACRO_IDX_HASH_SIZE > 256 || (MACRO_IDX_HASH_SIZE & (MACRO_IDX_HASH_SIZE - 1))
+#error "MACRO_INDEX_HASH_SIZE must be a power of two greater than MACRO_INDEX_COUNT"
+#endif
+
+#define MACRO_IDX_HASH_EMPTY 0xff
+
+static uint8_t macro_idx_hash_slots[MACRO_IDX_HASH_SIZE];
+static uint8_t macro_idx_hash_tags[MACRO_IDX_HASH_SIZE];
+
 /**
  * Get a pointer to the underlying data in storage. (To be read/written
  * as a whole by the client application)
@@ -72,18 +110,23 @@ uint8_t* macro_idx_get_storage(){
 	return (uint8_t*) &macro_index[0];
 }
 
+static storage_job_status macro_idx_reset_defaults_step(storage_job* job){
+	// Clear one byte per step: the keys to NO_KEY and the value to 0
+	if(job->cursor < MACRO_INDEX_SIZE){
+		uint8_t i = job->cursor % sizeof(macro_idx_entry);
+		uint8_t* dst = macro_idx_get_storage() + job->cursor++;
+		storage_write_byte(MACRO_INDEX_STORAGE, dst, (i < MACRO_MAX_KEYS) ? NO_KEY : 0x0);
+		return STORAGE_JOB_CONTINUE;
+	}
+	macro_idx_init();
+	return STORAGE_JOB_DONE;
+}
+
 /**
  * Erases the macro index - to be called from config_reset_fully
  */
-void macro_idx_reset_defaults(){
-	macro_idx_entry tmp;
-	memset(tmp.keys, NO_KEY, MACRO_MAX_KEYS);
-	tmp.val = 0x0;
-
-	for(uint8_t i = 0; i < MACRO_INDEX_COUNT; ++i){
-		storage_write(MACRO_INDEX_STORAGE, &macro_index[i], &tmp, sizeof(macro_idx_entry));
-		USB_KeepAlive(true);
-	}
+bool macro_idx_reset_defaults(){
+	return storage_job_submit(macro_idx_reset_defaults_step, NULL);
 }
 
 bool macro_idx_format_key(macro_idx_key* key, uint8_t key_count){
@@ -114,15 +157,89 @@ static int macro_idx_cmp(const macro_idx_key* k, const macro_idx_entry* v){
 	return 0;
 }
 
+static uint16_t macro_idx_hash(const uint8_t* keys){
+	uint16_t h = 5381;
+	for(uint8_t j = 0; j < MACRO_MAX_KEYS; ++j){
+		h = (h << 5) + h + keys[j];
+	}
+	return h;
+}
+
+// the first table slot to probe for the argument hash
+static uint8_t macro_idx_hash_home(uint16_t h){
+	return (h ^ (h >> 8)) & (MACRO_IDX_HASH_SIZE - 1);
+}
+
+// Adds index entry e, with the argument keys, to the lookup table
+static void macro_idx_hash_insert(uint8_t e, const uint8_t* keys){
+	uint16_t h = macro_idx_hash(keys);
+	uint8_t i = macro_idx_hash_home(h);
+	while(macro_idx_hash_slots[i] != MACRO_IDX_HASH_EMPTY){
+		i = (i + 1) & (MACRO_IDX_HASH_SIZE - 1);
+	}
+	macro_idx_hash_slots[i] = e;
+	macro_idx_hash_tags[i] = h >> 8;
+}
+
+// Removes index entry e, with the argument keys, from the lookup table
+static void macro_idx_hash_remove(uint8_t e, const uint8_t* keys){
+	uint8_t i = macro_idx_hash_home(macro_idx_hash(keys));
+	for(; macro_idx_hash_slots[i] != e; i = (i + 1) & (MACRO_IDX_HASH_SIZE - 1)){
+		if(macro_idx_hash_slots[i] == MACRO_IDX_HASH_EMPTY) return; // not present
+	}
+
+	// Close the gap, so that no probe sequence is cut short by it: move back
+	// each later entry in the run that can't be found from where it is
+	// without crossing the gap. Finding their home slots needs their keys,
+	// but only the entries in this run are read.
+	for(uint8_t j = i;;){
+		macro_idx_hash_slots[i] = MACRO_IDX_HASH_EMPTY;
+		uint8_t home;
+		do{
+			j = (j + 1) & (MACRO_IDX_HASH_SIZE - 1);
+			uint8_t f = macro_idx_hash_slots[j];
+			if(f == MACRO_IDX_HASH_EMPTY) return;
+
+			macro_idx_key key;
+			storage_read(MACRO_INDEX_STORAGE, &macro_index[f], &key, sizeof(macro_idx_key));
+			home = macro_idx_hash_home(macro_idx_hash(key.keys));
+			// stays if home is cyclically in (i, j]
+		} while(i <= j ? (i < home && home <= j) : (i < home || home <= j));
+
+		macro_idx_hash_slots[i] = macro_idx_hash_slots[j];
+		macro_idx_hash_tags[i] = macro_idx_hash_tags[j];
+		i = j;
+	}
+}
+
+/**
+ * Rebuilds the lookup table from the index in storage
+ */
+void macro_idx_init(){
+	memset(macro_idx_hash_slots, MACRO_IDX_HASH_EMPTY, MACRO_IDX_HASH_SIZE);
+
+	for(uint8_t e = 0; e < MACRO_INDEX_COUNT; ++e){
+		macro_idx_key key;
+		storage_read(MACRO_INDEX_STORAGE, &macro_index[e], &key, sizeof(macro_idx_key));
+		if(key.keys[0] == NO_KEY) continue; // empty slot
+
+		macro_idx_hash_insert(e, key.keys);
+	}
+}
+
 /** returns pointer to storage */
 macro_idx_entry* macro_idx_lookup(macro_idx_key* key){
-	macro_idx_entry* r =
-		(macro_idx_entry*) bsearch(key,
-								   macro_index,
-								   MACRO_INDEX_COUNT, //nelem
-								   sizeof(macro_idx_entry), // width
-								   (int(*)(const void*, const void*)) macro_idx_cmp);
-	return r;
+	uint16_t h = macro_idx_hash(key->keys);
+	uint8_t tag = h >> 8;
+	uint8_t i = macro_idx_hash_home(h);
+
+	// The table is larger than the index, so always has an empty slot
+	for(uint8_t e; (e = macro_idx_hash_slots[i]) != MACRO_IDX_HASH_EMPTY; i = (i + 1) & (MACRO_IDX_HASH_SIZE - 1)){
+		if(macro_idx_hash_tags[i] == tag && macro_idx_cmp(key, &macro_index[e]) == 0){
+			return &macro_index[e];
+		}
+	}
+	return NULL;
 }
 
 macro_idx_entry_data macro_idx_get_data(macro_idx_entry* mh){
@@ -139,76 +256,98 @@ void macro_idx_set_data(macro_idx_entry* mh, macro_idx_entry_data d){
 		store |= 0x8000;
 	}
 	storage_write_short(MACRO_INDEX_STORAGE, &mh->val, store);
-	USB_KeepAlive(true);
+}
+
+static macro_idx_entry* remove_entry = NULL; // entry queued for removal
+
+static storage_job_status macro_idx_remove_step(storage_job* job){
+	// Entries are unordered, so just mark the slot empty
+	macro_idx_key key;
+	storage_read(MACRO_INDEX_STORAGE, remove_entry, &key, sizeof(macro_idx_key));
+	if(key.keys[0] != NO_KEY){
+		macro_idx_hash_remove(remove_entry - macro_index, key.keys);
+		storage_write_byte(MACRO_INDEX_STORAGE, &remove_entry->keys[0], NO_KEY);
+	}
+	remove_entry = NULL;
+	return STORAGE_JOB_DONE;
 }
 
 /**
  * Removes an entry from the index
  */
-void macro_idx_remove(macro_idx_entry* mi){
-	// move macros down into the slot until we hit the end of the array or an empty (keys[0] == NO_KEY) entry
-	uint8_t mi_offset = mi - macro_index;
-	for(uint8_t i = mi_offset; i < MACRO_INDEX_COUNT; ++i){
-		macro_idx_entry tmp;
-		if(i == MACRO_INDEX_COUNT - 1){
-			// hit the end, fill with empty rather than moving i+1
-			memset(tmp.keys, NO_KEY, MACRO_MAX_KEYS);
-			tmp.val = 0x0;
-		}
-		else{
-			storage_read(MACRO_INDEX_STORAGE, &macro_index[i + 1], &tmp, sizeof(macro_idx_entry));
-		}
-		// and write into i
-		storage_write(MACRO_INDEX_STORAGE, &macro_index[i], &tmp, sizeof(macro_idx_entry));
+bool macro_idx_remove(macro_idx_entry* mi){
+	// only one removal may be queued at once
+	if(remove_entry){
+		return false;
+	}
+	remove_entry = mi;
+	if(!storage_job_submit(macro_idx_remove_step, NULL)){
+		remove_entry = NULL;
+		return false;
+	}
+	return true;
+}
 
-		// We're done if we've just filled with an empty entry
-		if(tmp.keys[0] == NO_KEY) break; // done
-		USB_KeepAlive(true);
+static struct {
+	macro_idx_entry entry; // new entry, with no data
+	uint8_t slot;          // index of the new entry
+	bool pending;          // the slot isn't yet in the lookup table
+} create_state;
+
+static storage_job_status macro_idx_create_step(storage_job* job){
+	create_state.pending = false;
+	// Write the whole entry at once, so that it's never seen with the new
+	// keys and the previous occupant's data
+	if(storage_write(MACRO_INDEX_STORAGE, &macro_index[create_state.slot], &create_state.entry, sizeof(macro_idx_entry)) != sizeof(macro_idx_entry)){
+		return STORAGE_JOB_FAILED;
 	}
+	macro_idx_hash_insert(create_state.slot, create_state.entry.keys);
+	return STORAGE_JOB_DONE;
 }
 
 /**
  * Adds an entry for the given key to the index, and returns a pointer
- * to the new (empty) entry, or NULL if full or error.
+ * to the new (empty) entry, or NULL if the index or storage job queue
+ * is full, another creation is still queued, or error.
  */
-macro_idx_entry* macro_idx_create(macro_idx_key* key){
-	macro_idx_entry* r;
-	// macro index does not exist: move the index up from the end until we reach
-	// a key lower than us, then insert
-	if(storage_read_byte(MACRO_INDEX_STORAGE, &macro_index[MACRO_INDEX_COUNT - 1].keys[0]) != NO_KEY){
+macro_idx_entry* macro_idx_create(macro_idx_key* key, storage_job_complete complete){
+	// only one creation may be queued at once, as it has no slot until done
+	if(create_state.pending){
+		return NULL;
+	}
+
+	// Entries are unordered: use the first free slot, which is the first
+	// not in the lookup table
+	uint8_t used[(MACRO_INDEX_COUNT + 7) / 8];
+	memset(used, 0, sizeof(used));
+	for(uint8_t i = 0; i < MACRO_IDX_HASH_SIZE; ++i){
+		uint8_t e = macro_idx_hash_slots[i];
+		if(e != MACRO_IDX_HASH_EMPTY) used[e / 8] |= 1 << (e % 8);
+	}
+	uint8_t slot = 0;
+	while(slot < MACRO_INDEX_COUNT && (used[slot / 8] & (1 << (slot % 8)))){
+		++slot;
+	}
+	if(slot == MACRO_INDEX_COUNT){
 		// then we're full, error
 		return NULL;
 	}
-	for(int i = MACRO_INDEX_COUNT - 1; i >= 0; --i){
-		// consider each slot i from the end. If it is the correct
-		// position (first or key is >= the preceding cell) then
-		// store, otherwise move the value in preceding cell up
-		// and repeat.
-		if(i == 0 || macro_idx_cmp(key, &macro_index[i-1]) >= 0){
-			r = &macro_index[i];
-			break;
-		}
-		else if(storage_read_byte(MACRO_INDEX_STORAGE, &macro_index[i-1].keys[0]) == NO_KEY){
-			continue; // Don't bother to copy empty cells.
-		}
-		else{
-			// copy up (i-1) to (i), leaving the hole at (i-1)
-			macro_idx_entry tmp;
-			storage_read (MACRO_INDEX_STORAGE, &macro_index[i-1], &tmp, sizeof(macro_idx_entry));
-			storage_write(MACRO_INDEX_STORAGE, &macro_index[i],   &tmp, sizeof(macro_idx_entry));
-			USB_KeepAlive(true);
-		}
+
+	memcpy(create_state.entry.keys, key->keys, MACRO_MAX_KEYS);
+	create_state.entry.val = 0x0;
+	create_state.slot = slot;
+	create_state.pending = true;
+	if(!storage_job_submit(macro_idx_create_step, complete)){
+		create_state.pending = false;
+		return NULL;
 	}
 
-	// we now have a correctly positioned index cell at r: write in the key
-	storage_write(MACRO_INDEX_STORAGE, r, key, sizeof(macro_idx_key)); // macro_idx_key is prefix to macro_idx
-	USB_KeepAlive(true);
-	return r;
+	return &macro_index[slot];
 }
 
 void macro_idx_iterate(macro_idx_iterator itr, void* c){
 	for(uint8_t i = 0; i < MACRO_INDEX_COUNT; ++i){
-		if(storage_read_byte(MACRO_INDEX_STORAGE, &macro_index[i].keys[0]) == NO_KEY) break;
+		if(storage_read_byte(MACRO_INDEX_STORAGE, &macro_index[i].keys[0]) == NO_KEY) continue;
 		itr(&macro_index[i], c);
 	}
 }
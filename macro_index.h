@@ -48,6 +48,8 @@
 
 #include <stdint.h>
 
+#include "storage.h"
+
 
 #define MACRO_MAX_KEYS 4
 
@@ -74,9 +76,16 @@ typedef struct _macro_idx_entry macro_idx_entry;
 uint8_t* macro_idx_get_storage(void);
 
 /**
- * Erases the macro index - to be called from config_reset_fully
+ * Erases the macro index - to be called from config_reset_fully. The
+ * index is cleared by a storage job: returns false if it can't be queued.
+ */
+bool macro_idx_reset_defaults(void);
+
+/**
+ * Builds the in-memory lookup table for the index - to be called at
+ * startup and whenever the index in storage is rewritten.
  */
-void macro_idx_reset_defaults(void);
+void macro_idx_init(void);
 
 /**
  * Given a macro_idx_key with the `keys` array populated with `key_count`
@@ -97,20 +106,25 @@ macro_idx_entry* macro_idx_lookup(macro_idx_key* key);
 macro_idx_entry_data macro_idx_get_data(macro_idx_entry* mh);
 
 /**
- * Sets the data content of a macro index entry
+ * Sets the data content of a macro index entry. This is a single short
+ * write, so is made directly: it's to be called from a storage job step.
  */
 void macro_idx_set_data(macro_idx_entry* mh, macro_idx_entry_data data);
 
 /**
- * Removes an entry from the macro index
+ * Removes an entry from the macro index, using a storage job. Returns
+ * false if the job can't be queued, or another removal is already queued.
  */
-void macro_idx_remove(macro_idx_entry* mh);
+bool macro_idx_remove(macro_idx_entry* mh);
 
 /**
  * Adds an entry for the given key to the index, and returns a pointer
- * to the new (empty) entry, or NULL if full or error.
+ * to the new (empty) entry, or NULL if the index or storage job queue
+ * is full, another entry is still being created, or error. The index
+ * is updated by a storage job, which calls complete when done: the
+ * entry may not be used until then.
  */
-macro_idx_entry* macro_idx_create(macro_idx_key* key);
+macro_idx_entry* macro_idx_create(macro_idx_key* key, storage_job_complete complete);
 
 typedef void(*macro_idx_iterator)(macro_idx_entry*, void*);
 
@@ -123,7 +137,9 @@ void macro_idx_iterate(macro_idx_iterator itr, void* c);
  * Storage representation for macro index entries
  */
 struct _macro_idx_entry {
-	// unused keycodes are NO_KEY (so an empty entry starts with NO_KEY)
+	// unused keycodes are NO_KEY (so an empty entry starts with
+	// NO_KEY). Entries are stored in no particular order, and empty
+	// entries may be anywhere in the index.
 	hid_keycode keys[MACRO_MAX_KEYS];
 	uint16_t val; // high bit indicates whether the entry is a macro
 				  // or a program. If macro, remaining bits are the
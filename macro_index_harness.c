@@ -0,0 +1,276 @@
+// Fake API for test harness. Build with
+//   gcc -DDEBUG -std=gnu99 -fshort-enums -o macro_index macro_index.c
+// and run "macro_index" to check the lookup table against a scan of the
+// index as entries are created and removed, and to count the storage
+// reads made by lookups in a full MACRO_INDEX_COUNT entry index, compared
+// with the binary search of a sorted index used before the table.
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+// macro_index.h's own includes are replaced by the definitions below
+#define __HARDWARE_H
+#define __STORAGE_H
+
+#define MACRO_INDEX_COUNT 50
+#define NO_KEY 0xFF
+#define SPECIAL_HID_KEY_KEYPAD_SHIFT 0xFC
+#define HARNESS_LOGICAL_KEYS 172
+
+typedef uint8_t logical_keycode;
+typedef uint8_t hid_keycode;
+
+// fake storage: the index is plain memory, with reads counted
+static unsigned long harness_reads = 0;
+
+#define STORAGE(storage_type)
+#define storage_read(storage_type, addr, buf, len) harness_read(addr, buf, len)
+#define storage_read_byte(storage_type, addr) (++harness_reads, *(addr))
+#define storage_read_short(storage_type, addr) (++harness_reads, *(addr))
+#define storage_write(storage_type, dst, buf, len) (memcpy(dst, buf, len), (int16_t)(len))
+#define storage_write_byte(storage_type, dst, b) (*(dst) = (b))
+#define storage_write_short(storage_type, dst, b) (*(dst) = (b))
+
+static int16_t harness_read(const void* addr, void* buf, int16_t len){
+	++harness_reads;
+	memcpy(buf, addr, len);
+	return len;
+}
+
+typedef enum _storage_job_status {
+	STORAGE_JOB_CONTINUE,
+	STORAGE_JOB_DONE,
+	STORAGE_JOB_FAILED,
+} storage_job_status;
+
+typedef struct _storage_job storage_job;
+typedef storage_job_status (*storage_job_step)(storage_job* job);
+typedef void (*storage_job_complete)(bool success);
+
+struct _storage_job {
+	storage_job_step step;
+	storage_job_complete complete;
+	uint16_t cursor;
+};
+
+// jobs are run to completion as they're submitted
+bool storage_job_submit(storage_job_step step, storage_job_complete complete){
+	storage_job job = { step, complete, 0 };
+	storage_job_status s;
+	while((s = job.step(&job)) == STORAGE_JOB_CONTINUE);
+	if(job.complete) job.complete(s == STORAGE_JOB_DONE);
+	return true;
+}
+
+hid_keycode config_get_definition(logical_keycode l_key){
+	return 4 + l_key % 0x60;
+}
+
+void insertionsort_uint8(uint8_t* base, size_t nmemb){
+	for(size_t i = 1; i < nmemb; ++i){
+		uint8_t val = base[i];
+		size_t j;
+		for(j = i; j > 0 && base[j-1] > val; --j){
+			base[j] = base[j-1];
+		}
+		base[j] = val;
+	}
+}
+
+#include "macro_index.h"
+
+static uint32_t harness_seed = 1;
+static uint32_t harness_random(uint32_t n){
+	harness_seed = harness_seed * 1103515245 + 12345;
+	return (harness_seed >> 8) % n;
+}
+
+// A random valid trigger of 1 to MACRO_MAX_KEYS distinct keys
+static void random_key(macro_idx_key* key){
+	uint8_t count;
+	do{
+		count = 1 + harness_random(MACRO_MAX_KEYS);
+		for(uint8_t i = 0; i < count; ++i){
+			logical_keycode k;
+			bool dup;
+			do{
+				k = harness_random(HARNESS_LOGICAL_KEYS);
+				dup = false;
+				for(uint8_t j = 0; j < i; ++j) dup |= (key->keys[j] == k);
+			} while(dup);
+			key->keys[i] = k;
+		}
+	} while(!macro_idx_format_key(key, count));
+}
+
+// The lookup made before the table: a scan of every entry
+static macro_idx_entry* scan_lookup(const macro_idx_key* key){
+	macro_idx_entry* index = (macro_idx_entry*) macro_idx_get_storage();
+	for(uint8_t e = 0; e < MACRO_INDEX_COUNT; ++e){
+		if(index[e].keys[0] != NO_KEY && !memcmp(index[e].keys, key->keys, MACRO_MAX_KEYS)){
+			return &index[e];
+		}
+	}
+	return NULL;
+}
+
+static void check_lookup(const macro_idx_key* key, const char* after){
+	macro_idx_key k = *key;
+	macro_idx_entry* found = macro_idx_lookup(&k);
+	macro_idx_entry* expected = scan_lookup(key);
+	if(found != expected){
+		printf("FAIL: after %s, lookup of %d %d %d %d found entry %ld, expected %ld\n",
+			   after, key->keys[0], key->keys[1], key->keys[2], key->keys[3],
+			   found ? (long)(found - (macro_idx_entry*) macro_idx_get_storage()) : -1L,
+			   expected ? (long)(expected - (macro_idx_entry*) macro_idx_get_storage()) : -1L);
+		exit(1);
+	}
+}
+
+static macro_idx_key keys[MACRO_INDEX_COUNT];
+static macro_idx_entry* entries[MACRO_INDEX_COUNT];
+
+// Checks every defined key and some absent ones
+static void check_table(const char* after){
+	for(uint8_t e = 0; e < MACRO_INDEX_COUNT; ++e){
+		if(entries[e]) check_lookup(&keys[e], after);
+	}
+	for(int i = 0; i < 1000; ++i){
+		macro_idx_key key;
+		random_key(&key);
+		check_lookup(&key, after);
+	}
+}
+
+static void create_entry(uint8_t e){
+	// leave stale data behind in any slot the entry may take
+	macro_idx_entry* index = (macro_idx_entry*) macro_idx_get_storage();
+	for(uint8_t i = 0; i < MACRO_INDEX_COUNT; ++i){
+		if(index[i].keys[0] == NO_KEY) index[i].val = 0x1234;
+	}
+	do{
+		random_key(&keys[e]);
+	} while(scan_lookup(&keys[e]));
+	entries[e] = macro_idx_create(&keys[e], NULL);
+	if(!entries[e]){
+		printf("FAIL: could not create entry %d\n", e);
+		exit(1);
+	}
+	if(entries[e]->val != 0){
+		printf("FAIL: entry %d created with stale data %d\n", e, entries[e]->val);
+		exit(1);
+	}
+}
+
+static void test_updates(void){
+	macro_idx_reset_defaults();
+	check_table("macro_idx_reset_defaults");
+
+	unsigned long reads = harness_reads;
+	for(uint8_t e = 0; e < MACRO_INDEX_COUNT; ++e){
+		create_entry(e);
+	}
+	printf("storage reads per create: %.1f\n", (double)(harness_reads - reads) / MACRO_INDEX_COUNT);
+	check_table("macro_idx_create");
+
+	macro_idx_key key;
+	random_key(&key);
+	if(!scan_lookup(&key) && macro_idx_create(&key, NULL)){
+		printf("FAIL: created an entry in a full index\n");
+		exit(1);
+	}
+
+	unsigned long removes = 0, remove_reads = 0;
+	for(int round = 0; round < 200; ++round){
+		uint8_t e = harness_random(MACRO_INDEX_COUNT);
+		if(entries[e]){
+			reads = harness_reads;
+			macro_idx_remove(entries[e]);
+			remove_reads += harness_reads - reads;
+			entries[e] = NULL;
+			++removes;
+			check_table("macro_idx_remove");
+		}
+		else{
+			create_entry(e);
+			check_table("macro_idx_create");
+		}
+	}
+
+	macro_idx_init();
+	check_table("macro_idx_init");
+	printf("storage reads per remove: %.1f\n", (double) remove_reads / removes);
+	printf("ok: lookup table matches the index after %lu removes\n", removes);
+}
+
+// bsearch over a sorted copy of the index, counting a read per key byte
+// compared, as macro_idx_cmp did
+static macro_idx_entry sorted_index[MACRO_INDEX_COUNT];
+static uint8_t sorted_count;
+
+static int sorted_cmp(const void* a, const void* b){
+	return memcmp(((const macro_idx_entry*) a)->keys, ((const macro_idx_entry*) b)->keys, MACRO_MAX_KEYS);
+}
+
+static bool bsearch_lookup(const macro_idx_key* key){
+	int lo = 0, hi = sorted_count - 1;
+	while(lo <= hi){
+		int mid = (lo + hi) / 2;
+		int d = 0;
+		for(uint8_t j = 0; j < MACRO_MAX_KEYS && !d; ++j){
+			++harness_reads;
+			d = key->keys[j] - sorted_index[mid].keys[j];
+		}
+		if(!d) return true;
+		if(d < 0) hi = mid - 1;
+		else lo = mid + 1;
+	}
+	return false;
+}
+
+#define LOOKUPS 100000
+
+static void benchmark(void){
+	macro_idx_reset_defaults();
+	for(uint8_t e = 0; e < MACRO_INDEX_COUNT; ++e){
+		create_entry(e);
+	}
+	memcpy(sorted_index, macro_idx_get_storage(), sizeof(sorted_index));
+	sorted_count = MACRO_INDEX_COUNT;
+	qsort(sorted_index, sorted_count, sizeof(macro_idx_entry), sorted_cmp);
+
+	unsigned long hash_reads[2] = { 0, 0 }, bsearch_reads[2] = { 0, 0 }, lookups[2] = { 0, 0 };
+	for(long i = 0; i < LOOKUPS; ++i){
+		macro_idx_key key;
+		if(i & 1){
+			key = keys[harness_random(MACRO_INDEX_COUNT)];
+		}
+		else{
+			random_key(&key);
+		}
+		bool present = scan_lookup(&key) != NULL;
+
+		unsigned long reads = harness_reads;
+		macro_idx_lookup(&key);
+		hash_reads[present] += harness_reads - reads;
+
+		reads = harness_reads;
+		bsearch_lookup(&key);
+		bsearch_reads[present] += harness_reads - reads;
+		++lookups[present];
+	}
+	printf("storage reads per lookup in a full %d entry index:\n", MACRO_INDEX_COUNT);
+	printf("  absent keys:  bsearch %.2f, hash %.2f\n",
+		   (double) bsearch_reads[0] / lookups[0], (double) hash_reads[0] / lookups[0]);
+	printf("  present keys: bsearch %.2f, hash %.2f\n",
+		   (double) bsearch_reads[1] / lookups[1], (double) hash_reads[1] / lookups[1]);
+}
+
+int main(int argc, const char** argv){
+	test_updates();
+	benchmark();
+	return 0;
+}
@@ -47,13 +47,19 @@
 #include "Keyboard.h"
 #include "keystate.h"
 #include "storage.h"
+#include "extrareport.h"
 
 static storage_type print_buffer_type;
 static const char* print_buffer;
 
+// Set once a report carrying the current character has been sent: reports
+// are then empty until that has been sent too.
+static bool print_key_sent;
+
 void printing_set_buffer(const char* buf, storage_type typ){
 	print_buffer = buf;
 	print_buffer_type = typ;
+	print_key_sent = false;
 }
 
 char print_buffer_get(void){
@@ -75,19 +81,33 @@ bool printing_buffer_empty(void){
 	return print_buffer_get() == '\0';
 }
 
-void printing_Fill_KeyboardReport(KeyboardReport_Data_t* ReportData){
-	// if the last report was a key, send empty. Otherwise send the
-	// next character from print_buffer
-	if(PrevKeyboardHIDReportBuffer.Modifier || PrevKeyboardHIDReportBuffer.KeyCode[0]){
+void printing_Fill_KeyboardReport(KeyboardReportBitmap* ReportData){
+	// if the last report sent was a key, send empty. Otherwise send the
+	// current character from print_buffer. Reports may be filled more than
+	// once (e.g. for GET_REPORT) before one is sent, so filling doesn't
+	// advance: printing_report_sent() does.
+	if(print_key_sent){
 		return; // empty report
 	}
-	else{
+
+	uint8_t key, mod;
+	for(;;){
 		char nextchar = print_buffer_get();
-		print_buffer++;
-		uint8_t key, mod;
 		char_to_keys(nextchar, &key, &mod);
-		ReportData->Modifier = mod;
-		ReportData->KeyCode[0] = key;
+		if(key || mod || nextchar == '\0') break;
+		print_buffer++; // no key for this character: skip it, as an empty report would not be sent
+	}
+	ReportData->Modifier = mod;
+	KeyboardReportBitmap_add(ReportData, key);
+}
+
+void printing_report_sent(void){
+	if(print_key_sent){
+		print_key_sent = false;
+	}
+	else if(!printing_buffer_empty()){
+		print_buffer++;
+		print_key_sent = true;
 	}
 }
 
@@ -55,7 +55,11 @@
 void printing_set_buffer(const char* buf, storage_type typ);
 bool printing_buffer_empty(void);
 
-void printing_Fill_KeyboardReport(KeyboardReport_Data_t* ReportData);
+void printing_Fill_KeyboardReport(KeyboardReportBitmap* ReportData);
+
+// Called when a report filled by printing_Fill_KeyboardReport has been sent
+// to the host, to advance to the next report.
+void printing_report_sent(void);
 
 void char_to_keys(const char nextchar, hid_keycode* nextkey, hid_keycode* nextmod);
 const char* byte_to_str(uint8_t byte);
@@ -5,6 +5,9 @@
 #include <exception>
 #include <QString>
 #include <QSharedPointer>
+#include <QVector>
+
+#include "keyboard.h"
 
 class DeviceSession;
 
@@ -37,6 +40,9 @@ public:
 	virtual void setMacroStorage(const QByteArray& macroStorage) = 0;
 	virtual void reset() = 0;
 	virtual void resetFully() = 0;
+	virtual LatencyStats getLatencyStats() = 0;
+	virtual void resetLatencyStats() = 0;
+	virtual QVector<ProgramStatus> getProgramStatus() = 0;
 
 	virtual ~DeviceSession(){};
 };
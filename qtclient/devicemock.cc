@@ -144,8 +144,19 @@ void DeviceSessionMock::resetFully() {
 	mDevice->mPrograms = QByteArray(mDevice->mRawProgramSpace, 0x00);
 	mDevice->mPrograms[0] = 0xff;
 
-	mDevice->mMacroIndex = QByteArray(mDevice->mMacroIndexSize, 0x00);
-	mDevice->mMacroIndex[0] = 0xff;
+	// every index entry empty, as the keyboard resets it
+	mDevice->mMacroIndex = QByteArray(mDevice->mMacroIndexSize, char(0xff));
 
 	this->reset();
 }
+LatencyStats DeviceSessionMock::getLatencyStats() {
+	LatencyStats stats = {};
+	stats.ticks_per_ms = 250;
+	return stats;
+}
+void DeviceSessionMock::resetLatencyStats() {
+}
+QVector<ProgramStatus> DeviceSessionMock::getProgramStatus() {
+	ProgramStatus status = {};
+	return QVector<ProgramStatus>(mDevice->mNumPrograms, status);
+}
@@ -46,6 +46,9 @@ public:
 	virtual void setMacroStorage(const QByteArray& macroStorage) override;
 	virtual void reset() override;
 	virtual void resetFully() override;
+	virtual LatencyStats getLatencyStats() override;
+	virtual void resetLatencyStats() override;
+	virtual QVector<ProgramStatus> getProgramStatus() override;
 };
 
 
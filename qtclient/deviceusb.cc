@@ -150,3 +150,13 @@ void DeviceSessionUSB::reset() {
 void DeviceSessionUSB::resetFully() {
 	doVendorRequest(RESET_FULLY, Write, nullptr, 0);
 }
+
+void DeviceSessionUSB::resetLatencyStats() {
+	doVendorRequest(RESET_LATENCY_STATS, Write, nullptr, 0);
+}
+
+QVector<ProgramStatus> DeviceSessionUSB::getProgramStatus() {
+	QVector<ProgramStatus> status(getNumPrograms());
+	doVendorRequest(READ_PROGRAM_STATUS, Read, (char*) status.data(), status.size() * sizeof(ProgramStatus));
+	return status;
+}
@@ -92,6 +92,14 @@ public:
 
 	void reset();
 	void resetFully();
+
+	LatencyStats getLatencyStats() {
+		return doSimpleVendorRequest<LatencyStats>(READ_LATENCY_STATS, Read);
+	}
+
+	void resetLatencyStats();
+
+	QVector<ProgramStatus> getProgramStatus();
 };
 
 class DeviceUSB : public Device {
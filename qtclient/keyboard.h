@@ -1,6 +1,8 @@
 #ifndef KEYBOARD_H
 #define KEYBOARD_H
 
+#include <stdint.h>
+
 // TODO stop copying from keyboard.c
 
 typedef enum _vendor_request {
@@ -29,7 +31,60 @@ typedef enum _vendor_request {
 	// due to configuration.
 	WRITE_OATH_STORAGE, READ_OATH_STORAGE, READ_OATH_STORAGE_SIZE,
 	OATH_SET_TIME,
+
+	READ_LATENCY_STATS,
+	RESET_LATENCY_STATS,
+
+	READ_PROGRAM_STATUS,
 } vendor_request;
 
+// Timing statistics, in ticks of latency_stats::ticks_per_ms
+#define LATENCY_HISTOGRAM_SIZE 8 // bucket n counts durations of [4^n, 4^(n+1)) ticks
+
+struct __attribute__((packed)) LatencyTiming {
+	uint16_t min;
+	uint16_t max;
+	uint32_t total;
+	uint16_t count;
+	uint16_t histogram[LATENCY_HISTOGRAM_SIZE];
+};
+
+struct __attribute__((packed)) LatencyStats {
+	uint16_t ticks_per_ms;
+	LatencyTiming scan;
+	LatencyTiming loop;
+	LatencyTiming press_report;
+	LatencyTiming vm_slice;
+	uint32_t vm_steps;
+	uint16_t vm_slice_budget;
+	uint16_t vm_slice_ticks;
+};
+
+// Result of the keyboard verifying each program when they're written
+enum ProgramVerifyResult {
+	VERIFY_OK,
+	VERIFY_NO_PROGRAM,
+	VERIFY_READ_ERROR,
+	VERIFY_BAD_HEADER,
+	VERIFY_BAD_INSTRUCTION,
+	VERIFY_BAD_JUMP,
+	VERIFY_BAD_LOCAL,
+	VERIFY_BAD_GLOBAL,
+	VERIFY_BAD_METHOD,
+	VERIFY_BAD_RETURN,
+	VERIFY_FALLS_OFF_END,
+	VERIFY_STACK_UNDERFLOW,
+	VERIFY_STACK_MISMATCH,
+	VERIFY_STACK_OVERFLOW,
+	VERIFY_TOO_COMPLEX,
+};
+
+struct __attribute__((packed)) ProgramStatus {
+	uint8_t result; // ProgramVerifyResult
+	uint8_t method;
+	uint16_t offset; // from the start of the program
+	uint8_t max_depth;
+};
+
 
 #endif
@@ -36,8 +36,13 @@ QList<Trigger> Trigger::readTriggers(const QByteArray& index,
 		rawData.mid(sizeof(uint16_t)); // skip free pointer
 
 	QList<Trigger> triggers;
-	int idxOff = 0;
-	while (uint8_t(index.at(idxOff)) != 0xff && idxOff < index.length()) {
+	const int entrySize = maxKeys + sizeof(uint16_t);
+	// Index entries are unordered, and empty entries (first key
+	// NO_KEY) may appear anywhere
+	for (int idxOff = 0; idxOff + entrySize <= index.length(); idxOff += entrySize) {
+		if (uint8_t(index.at(idxOff)) == 0xff)
+			continue;
+
 		Trigger t(maxKeys);
 		QList<LogicalKeycode> triggerKeys;
 		for (unsigned int key = 0; key < maxKeys; key++) {
@@ -67,7 +72,6 @@ QList<Trigger> Trigger::readTriggers(const QByteArray& index,
 				data.mid(dataOffset + sizeof(uint16_t), macroLength));
 		}
 		triggers << t;
-		idxOff += maxKeys + sizeof(uint16_t);
 	}
 	return triggers;
 }
@@ -187,7 +191,8 @@ QPair<QByteArray, QByteArray> Trigger::encodeTriggers(const QList<Trigger>& trig
 		throw InsufficentStorageException(storageBytesRequired, storageSize, "macro storage");
 	}
 
-	// sort etriggers using operator<
+	// The keyboard doesn't require the index to be sorted, but
+	// sort etriggers using operator< for a stable encoding
 	qSort(eTriggers.begin(), eTriggers.end());
 
 	// and build the output
@@ -1,23 +1,29 @@
 require 'libusb'
 
 class ConfigurationFlags
+  DEBOUNCE_MODES = [:default, :deferred, :eager, :timed]
+
   def initialize(args={})
     @keyBeepEnabled = args.delete(:keyBeepEnabled) || false;
+    @debounceMode = args.delete(:debounceMode) || :default;
   end
 
   def self.fromByte(b)
-    ConfigurationFlags.new(:keyBeepEnabled => ((b & 0x01) > 0))
+    ConfigurationFlags.new(:keyBeepEnabled => ((b & 0x01) > 0),
+                           :debounceMode => DEBOUNCE_MODES[(b >> 1) & 0x03])
   end
 
   def toByte()
     b = 0;
     b |= 0x01 if @keyBeepEnabled;
+    b |= DEBOUNCE_MODES.index(@debounceMode) << 1
     b
   end
 
   def to_s()
     s = "("
     s << "keyBeepEnabled: " << @keyBeepEnabled.to_s
+    s << ", debounceMode: " << @debounceMode.to_s
     s << ")"
     s
   end
@@ -72,6 +78,20 @@ class KeyboardComm
   VRQ_WRITE_MACRO_STORAGE     = 17
   VRQ_READ_MACRO_STORAGE      = 18
   VRQ_READ_MACRO_MAX_KEYS     = 19
+  # 20-23 reserved for OATH storage
+  VRQ_READ_LATENCY_STATS      = 24
+  VRQ_RESET_LATENCY_STATS     = 25
+  VRQ_READ_PROGRAM_STATUS     = 26
+
+  LATENCY_STATS_SIZE     = 114
+  LATENCY_TIMINGS        = [:scan, :loop, :press_report, :vm_slice]
+  LATENCY_HISTOGRAM_SIZE = 8
+
+  PROGRAM_STATUS_SIZE    = 5
+  PROGRAM_VERIFY_RESULTS = [:ok, :no_program, :read_error, :bad_header, :bad_instruction,
+                            :bad_jump, :bad_local, :bad_global, :bad_method, :bad_return,
+                            :falls_off_end, :stack_underflow, :stack_mismatch, :stack_overflow,
+                            :too_complex]
 
   SERIAL_VENDOR_PREFIX = "andreae.gen.nz:";
 
@@ -237,7 +257,8 @@ class KeyboardComm
       m.key.sort!
     end
 
-    # sort macros by their keys
+    # sort macros by their keys: the keyboard doesn't require the
+    # index to be ordered, but this keeps the encoding stable
     macros.sort! { |a, b| a.key <=> b.key }
 
     # Iterate macros and build binary structures
@@ -395,5 +416,49 @@ class KeyboardComm
     vendor_msg_request(VRQ_WRITE_CONFIG_FLAGS, 0, flags.toByte);
   end
 
+  # Returns a hash of timing statistics, in milliseconds. Histogram bucket n
+  # counts durations of [4^n, 4^(n+1)) timer ticks. Also includes the
+  # number of program steps run, and the program slice budget in
+  # instructions and milliseconds.
+  def get_latency_stats()
+    data = vendor_read_request(VRQ_READ_LATENCY_STATS, LATENCY_STATS_SIZE)
+    ticks_per_ms = data.unpack("S<")[0].to_f
+    fields = data[2..-1].unpack(("S<S<L<S<S<#{LATENCY_HISTOGRAM_SIZE}" * LATENCY_TIMINGS.size) + "L<S<S<")
+    stats = { :ticks_per_ms => ticks_per_ms }
+    LATENCY_TIMINGS.each do |name|
+      min, max, total, count, *histogram = fields.shift(4 + LATENCY_HISTOGRAM_SIZE)
+      stats[name] = {
+        :count => count,
+        :min => (count > 0 ? min / ticks_per_ms : nil),
+        :max => max / ticks_per_ms,
+        :avg => (count > 0 ? total / ticks_per_ms / count : nil),
+        :histogram => histogram
+      }
+    end
+    stats[:vm_steps], stats[:vm_slice_budget], vm_slice_ticks = fields
+    stats[:vm_slice_ms] = vm_slice_ticks / ticks_per_ms
+    stats
+  end
+
+  def reset_latency_stats()
+    vendor_msg_request(VRQ_RESET_LATENCY_STATS, 0, 0)
+  end
+
+  # Returns the result of the keyboard verifying each program when they
+  # were written. Programs that fail aren't run: :method and :offset (from
+  # the start of the program) locate the instruction at fault.
+  def get_program_status()
+    n = get_num_programs
+    data = vendor_read_request(VRQ_READ_PROGRAM_STATUS, n * PROGRAM_STATUS_SIZE)
+    data.unpack("CCS<C" * n).each_slice(4).map do |result, method, offset, max_depth|
+      {
+        :result => PROGRAM_VERIFY_RESULTS[result] || result,
+        :method => method,
+        :offset => offset,
+        :max_depth => max_depth
+      }
+    end
+  end
+
   private :control_transfer, :vendor_read_request, :vendor_write_request, :vendor_msg_request
 end
@@ -0,0 +1,123 @@
+/*
+  Kinesis ergonomic keyboard firmware replacement
+
+  Copyright 2012 Chris Andreae (chris (at) andreae.gen.nz)
+
+  Licensed under the GNU GPL v2 (see GPL2.txt).
+
+  See Kinesis.h for keyboard hardware documentation.
+
+  ==========================
+
+  If built for V-USB, this program includes library and sample code from:
+	 V-USB, (C) Objective Development Software GmbH
+	 Licensed under the GNU GPL v2 (see GPL2.txt)
+
+  ==========================
+
+  If built for LUFA, this program includes library and sample code from:
+			 LUFA Library
+	 Copyright (C) Dean Camera, 2011.
+
+  dean [at] fourwalledcubicle [dot] com
+		   www.lufa-lib.org
+
+  Copyright 2011  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaim all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+#include "stats.h"
+#include "hardware.h"
+
+#include <string.h>
+
+static latency_stats stats;
+
+// Followed press: written by stats_press_queued() only while
+// STATS_PRESS_NONE, and by the main loop otherwise.
+enum { STATS_PRESS_NONE, STATS_PRESS_QUEUED, STATS_PRESS_APPLIED };
+static volatile uint8_t press_state = STATS_PRESS_NONE;
+static uint16_t press_started;
+static uint8_t press_entry;
+
+latency_stats* stats_get_latency(void){
+	return &stats;
+}
+
+static void stats_reset_timing(stats_timing* timing){
+	memset(timing, 0, sizeof(stats_timing));
+	timing->min = 0xFFFF;
+}
+
+void stats_reset(void){
+	stats.ticks_per_ms = STATS_TICKS_PER_MS;
+	stats_reset_timing(&stats.scan);
+	stats_reset_timing(&stats.loop);
+	stats_reset_timing(&stats.press_report);
+	stats_reset_timing(&stats.vm_slice);
+	stats.vm_steps = 0;
+	stats.vm_slice_budget = PROGRAM_SLICE_INSTRUCTIONS;
+	stats.vm_slice_ticks = PROGRAM_SLICE_TICKS;
+}
+
+void stats_record(stats_timing* timing, uint16_t ticks){
+	if(ticks < timing->min) timing->min = ticks;
+	if(ticks > timing->max) timing->max = ticks;
+
+	// Stop accumulating once the count saturates, so the average stays valid
+	if(timing->count != 0xFFFF){
+		++timing->count;
+		timing->total += ticks;
+	}
+
+	uint8_t bucket = 0;
+	while(ticks >= 4 && bucket < STATS_HISTOGRAM_SIZE - 1){
+		ticks >>= 2;
+		++bucket;
+	}
+	if(timing->histogram[bucket] != 0xFFFF){
+		++timing->histogram[bucket];
+	}
+}
+
+void stats_press_queued(uint16_t started, uint8_t entry){
+	if(press_state != STATS_PRESS_NONE) return;
+	press_started = started;
+	press_entry = entry;
+	press_state = STATS_PRESS_QUEUED;
+}
+
+void stats_press_applied(uint8_t entry){
+	if(press_state == STATS_PRESS_QUEUED && press_entry == entry){
+		press_state = STATS_PRESS_APPLIED;
+	}
+}
+
+void stats_press_reported(void){
+	if(press_state == STATS_PRESS_APPLIED){
+		stats_record(&stats.press_report, stats_ticks() - press_started);
+		press_state = STATS_PRESS_NONE;
+	}
+}
+
+void stats_vm_slice(uint16_t ticks, uint16_t steps){
+	stats_record(&stats.vm_slice, ticks);
+	stats.vm_steps += steps;
+}
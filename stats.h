@@ -0,0 +1,122 @@
+/*
+  Kinesis ergonomic keyboard firmware replacement
+
+  Copyright 2012 Chris Andreae (chris (at) andreae.gen.nz)
+
+  Licensed under the GNU GPL v2 (see GPL2.txt).
+
+  See Kinesis.h for keyboard hardware documentation.
+
+  ==========================
+
+  If built for V-USB, this program includes library and sample code from:
+	 V-USB, (C) Objective Development Software GmbH
+	 Licensed under the GNU GPL v2 (see GPL2.txt)
+
+  ==========================
+
+  If built for LUFA, this program includes library and sample code from:
+			 LUFA Library
+	 Copyright (C) Dean Camera, 2011.
+
+  dean [at] fourwalledcubicle [dot] com
+		   www.lufa-lib.org
+
+  Copyright 2011  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaim all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+// Timing statistics, readable over USB with the READ_LATENCY_STATS vendor
+// request. They may be updated from the matrix scan interrupt while being
+// read or reset, so a read can occasionally be inconsistent.
+
+/**
+ * Free-running timer (Timer1 at F_CPU/64) for timing short intervals:
+ * durations of up to 65535 ticks are measured by subtraction.
+ */
+#define STATS_TICKS_PER_MS (F_CPU / 64000)
+
+static inline uint16_t stats_ticks(void){
+	uint16_t t;
+	// TCNT1 shares its high byte latch with the matrix scan interrupt
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		t = TCNT1;
+	}
+	return t;
+}
+
+#define STATS_HISTOGRAM_SIZE 8 // bucket n counts durations of [4^n, 4^(n+1)) ticks
+
+typedef struct _stats_timing {
+	uint16_t min;
+	uint16_t max;
+	uint32_t total; // of the first `count` durations, for the average
+	uint16_t count;
+	uint16_t histogram[STATS_HISTOGRAM_SIZE];
+} stats_timing;
+
+// All durations are in stats_ticks(). AVR structs are unpadded, so this is
+// also the little-endian layout sent to the host.
+typedef struct _latency_stats {
+	uint16_t ticks_per_ms;
+	stats_timing scan;         // keystate_scan()
+	stats_timing loop;         // main loop iteration
+	stats_timing press_report; // start of a key press's debounce to the keyboard report carrying it
+	stats_timing vm_slice;     // vm_step_all() while any program is running
+	uint32_t vm_steps;         // program instructions executed by those slices
+	uint16_t vm_slice_budget;  // PROGRAM_SLICE_INSTRUCTIONS
+	uint16_t vm_slice_ticks;   // PROGRAM_SLICE_TICKS
+} latency_stats;
+
+latency_stats* stats_get_latency(void);
+
+void stats_reset(void);
+
+void stats_record(stats_timing* timing, uint16_t ticks);
+
+/**
+ * A single key press at a time is followed from the matrix to the keyboard
+ * report, identified by its position in the keystate matrix change queue.
+ * Called from keystate_scan() when a press is queued at `entry` whose
+ * debounce began at `started`: ignored if a press is already being followed.
+ */
+void stats_press_queued(uint16_t started, uint8_t entry);
+
+/** Called from keystate_update() as it applies the queue `entry` */
+void stats_press_applied(uint8_t entry);
+
+/** Called when a keyboard report is filled */
+void stats_press_reported(void);
+
+/**
+ * Called by vm_step_all() after a slice in which any program ran, with its
+ * duration and the number of instructions executed.
+ */
+void stats_vm_slice(uint16_t ticks, uint16_t steps);
+
+#endif // __STATS_H
@@ -1,3 +1,43 @@
 #include "storage.h"
 
 storage_err storage_errno = 0;
+
+#define STORAGE_JOB_QUEUE_SIZE 4
+
+static storage_job job_queue[STORAGE_JOB_QUEUE_SIZE];
+static uint8_t job_head = 0;
+static uint8_t job_count = 0;
+
+bool storage_job_submit(storage_job_step step, storage_job_complete complete){
+	if(job_count == STORAGE_JOB_QUEUE_SIZE){
+		return false;
+	}
+	storage_job* job = &job_queue[(job_head + job_count) % STORAGE_JOB_QUEUE_SIZE];
+	job->step = step;
+	job->complete = complete;
+	job->cursor = 0;
+	++job_count;
+	return true;
+}
+
+void storage_job_task(void){
+	if(!job_count) return;
+
+	storage_job* job = &job_queue[job_head];
+	storage_job_status status = job->step(job);
+	if(status == STORAGE_JOB_CONTINUE) return;
+
+	// Remove the job before completing it, so that the completion
+	// callback may submit further jobs.
+	storage_job_complete complete = job->complete;
+	job_head = (job_head + 1) % STORAGE_JOB_QUEUE_SIZE;
+	--job_count;
+
+	if(complete){
+		complete(status == STORAGE_JOB_DONE);
+	}
+}
+
+bool storage_job_busy(void){
+	return job_count != 0;
+}
@@ -47,6 +47,7 @@
 #define __STORAGE_H
 
 #include <inttypes.h>
+#include <stdbool.h>
 
 typedef enum _storage_type {
     sram,
@@ -75,6 +76,50 @@ extern storage_err storage_errno;
 #define storage_memmove(storage_type, dst, src, count)         STORAGE_MAGIC_PREFIX(storage_type, memmove)(dst, src, count)
 #define storage_memset(storage_type, dst, c, len)              STORAGE_MAGIC_PREFIX(storage_type, memset)(dst, c, len)
 
+// Largest aligned unit written by one step of a storage job
+#define storage_step_size(storage_type)                        STORAGE_MAGIC_PREFIX(STORAGE_STEP_SIZE, storage_type)
+
+/*
+ * Long-running writes are carried out by storage jobs, which are queued and
+ * advanced by one step (writing at most storage_step_size() bytes) per main
+ * loop iteration, so that the keyboard keeps running while they complete.
+ */
+typedef enum _storage_job_status {
+	STORAGE_JOB_CONTINUE,
+	STORAGE_JOB_DONE,
+	STORAGE_JOB_FAILED,
+} storage_job_status;
+
+typedef struct _storage_job storage_job;
+
+typedef storage_job_status (*storage_job_step)(storage_job* job);
+typedef void (*storage_job_complete)(bool success);
+
+struct _storage_job {
+	storage_job_step step;
+	storage_job_complete complete; // called when the job finishes, may be NULL
+	uint16_t cursor;               // progress through the job, 0 when started
+};
+
+/**
+ * Queues a job: step will be called once per storage_job_task() until
+ * it returns STORAGE_JOB_DONE or STORAGE_JOB_FAILED. Jobs are run in
+ * order of submission. Returns false, queuing nothing, if the queue is
+ * full.
+ */
+bool storage_job_submit(storage_job_step step, storage_job_complete complete);
+
+/**
+ * Runs one step of the current job. Called from the main loop, or by the
+ * USB layer while a host request waits for all jobs to complete.
+ */
+void storage_job_task(void);
+
+/**
+ * Returns true if any jobs are queued or running.
+ */
+bool storage_job_busy(void);
+
 #include "storage/sram.h"
 #include "storage/avr_eeprom.h"
 #include "storage/i2c_eeprom.h"
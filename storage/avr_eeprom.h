@@ -7,6 +7,8 @@
 
 #define STORAGE_SECTION_avr_eeprom EEMEM
 
+#define STORAGE_STEP_SIZE_avr_eeprom 1
+
 inline int16_t avr_eeprom_write(void* dst, const void* data, size_t count){
 	eeprom_update_block(data, dst, count);
 	return count;
@@ -43,6 +43,13 @@
   this software.
 */
 
+#ifdef DEBUG
+
+// standalone binary harness
+#include "storage/i2c_eeprom_harness.c"
+
+#else
+
 #include "Keyboard.h"
 #include "twi.h"
 #include "printing.h"
@@ -50,19 +57,139 @@
 #include "storage.h"
 #include "storage/i2c_eeprom.h"
 #include "usb.h"
+#include "stats.h"
 
-#include <util/delay.h>     /* for _delay_ms() */
+#endif
 
 /* Serial eeprom support */
 
 #define I2C_EEPROM_WRITE_TIME_MS 10
 
+// How long to poll for the eeprom to finish a write cycle before giving up
+#define I2C_EEPROM_WRITE_TIMEOUT_TICKS ((I2C_EEPROM_WRITE_TIME_MS + 1) * STATS_TICKS_PER_MS)
+
+// Set when a write transaction is stopped, at which point the eeprom starts
+// its write cycle and stops responding until it is complete. Initially set
+// in case a write cycle was interrupted by a reset.
+static bool write_pending = true;
+static uint16_t write_started; // stats_ticks() at the start of the write cycle
+
+// Sequential reads wrap around at the end of each 2k device block
+#define I2C_EEPROM_BLOCK_SIZE 2048
+
+// Reads are served from a small cache of page-aligned lines. Lines stay in
+// place: cache_order lists them most recently used first. Program and macro
+// data is mostly read sequentially, so a miss that follows on from a cached
+// line also fills the next line in the same transaction. Writes through this
+// file update any cached copy of the page written.
+#ifndef I2C_EEPROM_CACHE_LINES
+#define I2C_EEPROM_CACHE_LINES 4
+#endif
+
+static uint16_t cache_tags[I2C_EEPROM_CACHE_LINES]; // page number + 1, or 0 if empty
+static uint8_t cache_data[I2C_EEPROM_CACHE_LINES][EEEXT_PAGE_SIZE];
+static uint8_t cache_order[I2C_EEPROM_CACHE_LINES];
+static bool cache_initialized = false;
+
+static bool i2c_eeprom_read_lines(uint16_t page, const uint8_t* lines, uint8_t count);
+
+// Moves the line at position `from` in cache_order to the front.
+static void i2c_eeprom_cache_promote(uint8_t from){
+	uint8_t line = cache_order[from];
+	for(; from > 0; --from){
+		cache_order[from] = cache_order[from - 1];
+	}
+	cache_order[0] = line;
+}
+
+// Returns the position in cache_order of the line caching the argument page,
+// or -1.
+static int8_t i2c_eeprom_cache_find(uint16_t page){
+	for(uint8_t i = 0; i < I2C_EEPROM_CACHE_LINES; ++i){
+		if(cache_tags[cache_order[i]] == page + 1) return i;
+	}
+	return -1;
+}
+
+/**
+ * Returns the cached contents of the argument page, reading it from the
+ * eeprom if necessary, or null if the read failed.
+ */
+static const uint8_t* i2c_eeprom_cache_get(uint16_t page){
+	if(!cache_initialized){
+		for(uint8_t i = 0; i < I2C_EEPROM_CACHE_LINES; ++i){
+			cache_order[i] = i;
+		}
+		cache_initialized = true;
+	}
+
+	int8_t i = i2c_eeprom_cache_find(page);
+	if(i > 0){
+		i2c_eeprom_cache_promote(i);
+	}
+	if(i >= 0){
+		return cache_data[cache_order[0]];
+	}
+
+	// Miss: replace the least recently used line(s). If we're reading
+	// sequentially, read ahead into the next page if it's in the same device
+	// block and not already cached.
+	uint8_t count = 1;
+	if(I2C_EEPROM_CACHE_LINES > 1
+	   && page > 0 && i2c_eeprom_cache_find(page - 1) >= 0
+	   && ((page + 1) * EEEXT_PAGE_SIZE) % I2C_EEPROM_BLOCK_SIZE != 0
+	   && i2c_eeprom_cache_find(page + 1) < 0){
+		count = 2;
+	}
+	for(uint8_t c = 0; c < count; ++c){
+		i2c_eeprom_cache_promote(I2C_EEPROM_CACHE_LINES - 1);
+	}
+
+	// the first `count` lines of cache_order now receive page, page + 1
+	if(!i2c_eeprom_read_lines(page, cache_order, count)){
+		for(uint8_t c = 0; c < count; ++c){
+			cache_tags[cache_order[c]] = 0;
+		}
+		if(storage_errno == SUCCESS) storage_errno = DATA_ERROR;
+		return 0;
+	}
+
+	for(uint8_t c = 0; c < count; ++c){
+		cache_tags[cache_order[c]] = page + 1 + c;
+	}
+	return cache_data[cache_order[0]];
+}
+
+/**
+ * Called after writing len bytes within a single page at dst: updates the
+ * cached copy of the page if the write succeeded, otherwise discards it.
+ */
+static void i2c_eeprom_cache_update(void* dst, const uint8_t* data, uint8_t len, bool success){
+	int8_t i = i2c_eeprom_cache_find((intptr_t)dst / EEEXT_PAGE_SIZE);
+	if(i < 0) return;
+	uint8_t line = cache_order[i];
+
+	if(success){
+		memcpy(&cache_data[line][(intptr_t)dst & (EEEXT_PAGE_SIZE - 1)], data, len);
+	}
+	else{
+		cache_tags[line] = 0;
+	}
+}
+
 // communicate with AT24C164 serial eeprom(s)
 
+static void i2c_eeprom_stop_write(void){
+	twi_stop(NOWAIT);
+	write_pending = true;
+	write_started = stats_ticks();
+}
+
 /**
  * Start a write (or random read dummy) transaction with the
- * eeprom. If the eeprom is not responding, keep trying for up to the
- * eeprom write delay in case it is busy.
+ * eeprom. If the eeprom is not responding because it may still be
+ * completing a write cycle, keep polling until it acknowledges or the
+ * eeprom write time has passed.
  */
 i2c_eeprom_err i2c_eeprom_start_write(void* addr){
 	const intptr_t iaddr = (intptr_t) addr;
@@ -72,19 +199,20 @@ i2c_eeprom_err i2c_eeprom_start_write(void* addr){
 	address_byte ^= ((iaddr >> 7) & 0b01111110); // select 14-bit device-and-address at once
 
 	// the eeprom may be ignoring inputs because it's writing, so we
-	// keep trying to issue our start condition for up to its write
-	// time.  We can't use uptimems here, because with the v-usb model
-	// that's not interrupt-fed, so just delay and check again
-
+	// keep reissuing our start condition until it acknowledges. If the
+	// last write cycle must have finished, it should respond at once.
 	uint8_t ack = 0;
-	for(int i = 0; i < 11; ++i){ // wait up to 11ms
+	for(;;){
 		twi_start();
 		if(twi_write_byte(address_byte) == ACK) {
 			ack = 1;
 			break;
 		}
-		_delay_ms(1);
+		if(!write_pending || (uint16_t)(stats_ticks() - write_started) > I2C_EEPROM_WRITE_TIMEOUT_TICKS){
+			break;
+		}
 	}
+	write_pending = false;
 
 	// If it timed out, return an error.
 	if(!ack) {
@@ -109,7 +237,7 @@ static uint8_t i2c_eeprom_continue_write(const uint8_t* buf, uint8_t len){
 	for(; i < len; ++i){
 		if(twi_write_byte(buf[i]) != ACK){
 			storage_errno = DATA_ERROR;
-			twi_stop(NOWAIT);
+			i2c_eeprom_stop_write(); // bytes already sent may still be written
 			break;
 		}
 	}
@@ -117,7 +245,7 @@ static uint8_t i2c_eeprom_continue_write(const uint8_t* buf, uint8_t len){
 }
 
 static inline void i2c_eeprom_end_write(void){
-	twi_stop(NOWAIT);
+	i2c_eeprom_stop_write();
 }
 
 /**
@@ -139,6 +267,7 @@ static uint8_t i2c_eeprom_write_page(void* addr, const uint8_t* buf, uint8_t len
 		// no error
 		i2c_eeprom_end_write();
 	}
+	i2c_eeprom_cache_update(addr, buf, len, wr == len);
 
 	return wr;
 }
@@ -166,7 +295,6 @@ int16_t i2c_eeprom_write(void* dst, const void* data, size_t count){
 		data += n;
 		dst += n;
 		count -= n;
-		USB_KeepAlive(true);
 	}
 	return written;
 }
@@ -206,10 +334,15 @@ i2c_eeprom_err i2c_eeprom_write_step(void* dst, const void* data, uint8_t len, u
 	if(((intptr_t)dst & (EEEXT_PAGE_SIZE-1)) == 0){
 		// page aligned: start write
 		r = i2c_eeprom_start_write(dst);
-		if(r != SUCCESS) return r;
+		if(r != SUCCESS){
+			i2c_eeprom_cache_update(dst, data, len, false);
+			return r;
+		}
 	}
 
-	if(len != i2c_eeprom_continue_write((const uint8_t*) data, len)){
+	bool success = (len == i2c_eeprom_continue_write((const uint8_t*) data, len));
+	i2c_eeprom_cache_update(dst, data, len, success);
+	if(!success){
 		return storage_errno;
 	}
 
@@ -267,7 +400,6 @@ i2c_eeprom_err i2c_eeprom_memmove(void* dst, const void* src, size_t count){
 			dst += n;
 		}
 		count -= n;
-		USB_KeepAlive(true);
 	}
 	return SUCCESS;
 }
@@ -299,6 +431,34 @@ size_t i2c_eeprom_read(const void* addr, void* buf, size_t len){
 	storage_errno = SUCCESS;
 	size_t read_bytes = 0;
 
+	while(len){
+		uint8_t page_off = ((intptr_t) addr) & (EEEXT_PAGE_SIZE - 1);
+		uint8_t page_remaining = EEEXT_PAGE_SIZE - page_off;
+		uint8_t n = (len < page_remaining) ? (uint8_t)len : page_remaining;
+
+		const uint8_t* page = i2c_eeprom_cache_get((intptr_t) addr / EEEXT_PAGE_SIZE);
+		if(!page) break;
+
+		memcpy(buf_bytes, page + page_off, n);
+		buf_bytes += n;
+		addr += n;
+		len -= n;
+		read_bytes += n;
+	}
+
+	return read_bytes ? read_bytes : -1;
+}
+
+/**
+ * Reads `count` consecutive pages starting at `page` in a single transaction,
+ * into the cache lines listed in `lines`. Returns false if the read failed.
+ */
+static bool i2c_eeprom_read_lines(uint16_t page, const uint8_t* lines, uint8_t count){
+	const void* addr = (const void*)(intptr_t)(page * EEEXT_PAGE_SIZE);
+	bool success = false;
+
+	storage_errno = SUCCESS;
+
 	// Set the current address by doing a "dummy write" to the address -
 	// set up as though writing, but then don't send the actual byte
 	uint8_t r = i2c_eeprom_start_write((void*) addr);
@@ -319,14 +479,18 @@ size_t i2c_eeprom_read(const void* addr, void* buf, size_t len){
 	}
 
 	// and start reading
-	while(len--){
-		*buf_bytes++ = twi_read_byte(len ? ACK : NACK); // nack on last byte to stop it talking to us
-		++read_bytes;
+	for(uint8_t c = 0; c < count; ++c){
+		uint8_t* buf_bytes = cache_data[lines[c]];
+		for(uint8_t i = 0; i < EEEXT_PAGE_SIZE; ++i){
+			bool last = (c == count - 1) && (i == EEEXT_PAGE_SIZE - 1);
+			*buf_bytes++ = twi_read_byte(last ? NACK : ACK); // nack on last byte to stop it talking to us
+		}
 	}
+	success = true;
 
  end:
 	twi_stop(NOWAIT);
-	return read_bytes ? read_bytes : -1;
+	return success;
 }
 
 uint8_t i2c_eeprom_read_byte(const uint8_t* addr){
@@ -56,6 +56,8 @@
 
 #define EEEXT_PAGE_SIZE 16
 
+#define STORAGE_STEP_SIZE_i2c_eeprom EEEXT_PAGE_SIZE
+
 typedef enum _i2c_eeprom_err {
 	SUCCESS = 0,
 	WSELECT_ERROR,
@@ -0,0 +1,323 @@
+// Fake API for test harness. Build with
+//   gcc -DDEBUG -std=gnu99 -fshort-enums -I. -o i2c_eeprom storage/i2c_eeprom.c
+// and run "i2c_eeprom" to replay typical access patterns against an
+// emulated AT24C164 on a 100kHz bus. Every read is checked against the
+// emulated memory, and the cache hit rate and bus time are compared with
+// reading each request in its own transaction, as without the cache. Add
+// -DI2C_EEPROM_CACHE_LINES=<n> to try other cache sizes. The write
+// throughput of i2c_eeprom_memset() and i2c_eeprom_memmove() is compared
+// with retrying the eeprom's address every 1ms while it's busy, as before
+// it was polled, for write cycles from the typical to the maximum time.
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+// i2c_eeprom.h's own includes are replaced by the definitions below
+#define __HARDWARE_H
+#include "twi.h"
+#include "storage/i2c_eeprom.h"
+
+typedef uint8_t storage_err;
+storage_err storage_errno;
+
+static void USB_KeepAlive(bool poll){}
+
+typedef enum _storage_type { sram, avr_pgm } storage_type;
+#define CONSTANT_STORAGE avr_pgm
+#define CONST_MSG(x) (x)
+static void printing_set_buffer(const char* buf, storage_type typ){}
+static const char* byte_to_str(uint8_t byte){ return ""; }
+
+// Emulated AT24C164s: eight 2k devices selected by A2-A0, with 16 byte
+// write pages and sequential reads wrapping at the end of each device.
+// Times are those of a 100kHz bus: a byte and its acknowledge take 9 bit
+// times, and a write cycle by default the datasheet maximum of 10ms, during
+// which the device doesn't acknowledge its address.
+#define AT24C164_SIZE (8 * 2048)
+#define BUS_BYTE_US 90
+#define BUS_CONDITION_US 10
+static uint32_t write_cycle_us = 10000;
+
+// Set to wait 1ms after each unacknowledged address, as the _delay_ms(1)
+// made between retries before the eeprom was polled.
+static bool harness_delay_retry = false;
+
+static uint8_t at24_memory[AT24C164_SIZE];
+static uint32_t bus_us = 0;
+static uint32_t write_busy_until = 0;
+static unsigned long bus_transactions = 0;
+
+static enum { BUS_IDLE, BUS_DEVICE, BUS_WORD_ADDRESS, BUS_WRITING, BUS_READING } bus_state = BUS_IDLE;
+static uint16_t at24_address;      // current address
+static uint8_t at24_page_buf[EEEXT_PAGE_SIZE];
+static uint16_t at24_page;         // page being written
+static uint16_t at24_page_written; // bitmap of at24_page_buf bytes written
+
+#define STATS_TICKS_PER_MS 250
+static uint16_t stats_ticks(void){
+	return (uint16_t) (bus_us / 4);
+}
+
+void twi_start(void){
+	bus_us += BUS_CONDITION_US;
+	bus_state = BUS_DEVICE;
+}
+
+void twi_stop(twi_wait wait){
+	bus_us += BUS_CONDITION_US;
+	if(bus_state == BUS_WRITING && at24_page_written){
+		for(uint8_t i = 0; i < EEEXT_PAGE_SIZE; ++i){
+			if(at24_page_written & (1 << i)) at24_memory[at24_page * EEEXT_PAGE_SIZE + i] = at24_page_buf[i];
+		}
+		write_busy_until = bus_us + write_cycle_us;
+	}
+	bus_state = BUS_IDLE;
+}
+
+twi_ack twi_write_byte(uint8_t val){
+	bus_us += BUS_BYTE_US;
+	switch(bus_state){
+	case BUS_DEVICE:
+		if(!(val & 0x80) || bus_us < write_busy_until){
+			bus_state = BUS_IDLE;
+			if(harness_delay_retry) bus_us += 1000;
+			return NACK;
+		}
+		// the device and block select bits give the upper address bits, as
+		// the devices' A2-A0 pins are wired in i2c_eeprom_start_write()
+		at24_address = ((((val ^ 0xa0) >> 1) & 0x3f) << 8) | (at24_address & 0xff);
+		if(val & 1){
+			++bus_transactions;
+			bus_state = BUS_READING;
+		}
+		else{
+			bus_state = BUS_WORD_ADDRESS;
+		}
+		return ACK;
+	case BUS_WORD_ADDRESS:
+		at24_address = (at24_address & 0xff00) | val;
+		at24_page = at24_address / EEEXT_PAGE_SIZE;
+		at24_page_written = 0;
+		bus_state = BUS_WRITING;
+		return ACK;
+	case BUS_WRITING:{
+		// the address wraps within the page
+		uint8_t offset = at24_address & (EEEXT_PAGE_SIZE - 1);
+		at24_page_buf[offset] = val;
+		at24_page_written |= 1 << offset;
+		at24_address = (at24_address & ~(EEEXT_PAGE_SIZE - 1)) | ((offset + 1) & (EEEXT_PAGE_SIZE - 1));
+		return ACK;
+	}
+	default:
+		return NACK;
+	}
+}
+
+uint8_t twi_read_byte(twi_ack ack){
+	bus_us += BUS_BYTE_US;
+	if(bus_state != BUS_READING) return 0xff;
+	uint8_t b = at24_memory[at24_address];
+	at24_address = (at24_address & ~2047) | ((at24_address + 1) & 2047);
+	return b;
+}
+
+// the read made for each request before reads were cached
+i2c_eeprom_err i2c_eeprom_start_write(void* addr);
+
+static bool uncached_read(const void* addr, void* buf, size_t len){
+	uint8_t* buf_bytes = (uint8_t*) buf;
+	bool success = false;
+	if(i2c_eeprom_start_write((void*) addr) == SUCCESS){
+		twi_start();
+		if(twi_write_byte(0b10100001 ^ ((((intptr_t)addr) >> 7) & 0b01111110)) == ACK){
+			while(len--){
+				*buf_bytes++ = twi_read_byte(len ? ACK : NACK);
+			}
+			success = true;
+		}
+	}
+	twi_stop(NOWAIT);
+	return success;
+}
+
+typedef struct _workload_stats {
+	unsigned long reads;
+	unsigned long pages; // pages looked up by the reads
+	unsigned long transactions;
+	uint32_t bus_us;
+} workload_stats;
+
+static bool harness_cached;
+static workload_stats harness_stats;
+
+static void harness_read(uint16_t addr, uint8_t len){
+	uint8_t buf[256];
+	unsigned long transactions = bus_transactions;
+	uint32_t start_us = bus_us;
+	bool success = harness_cached
+		? i2c_eeprom_read((const void*)(intptr_t) addr, buf, len) == len
+		: uncached_read((const void*)(intptr_t) addr, buf, len);
+	if(!success || memcmp(buf, &at24_memory[addr], len)){
+		printf("FAIL: read of %d bytes at %d returned the wrong data\n", len, addr);
+		exit(1);
+	}
+	++harness_stats.reads;
+	harness_stats.pages += (addr + len - 1) / EEEXT_PAGE_SIZE - addr / EEEXT_PAGE_SIZE + 1;
+	harness_stats.transactions += bus_transactions - transactions;
+	harness_stats.bus_us += bus_us - start_us;
+}
+
+static uint32_t harness_seed;
+static uint32_t harness_random(uint32_t n){
+	harness_seed = harness_seed * 1103515245 + 12345;
+	return (harness_seed >> 8) % n;
+}
+
+// A program read an instruction at a time by the interpreter: mostly
+// sequential, with loops back over a few pages and calls to functions
+// elsewhere in the program area (0x400 - 0x7ff).
+static void workload_program(void){
+	uint16_t ip = 0x400, loop_start = 0x400, ret = 0;
+	for(int i = 0; i < 20000; ++i){
+		uint8_t len = 1 + harness_random(3);
+		harness_read(ip, len);
+		ip += len;
+		uint32_t r = harness_random(100);
+		if(r < 3 && ip - loop_start > 8){
+			ip = loop_start;
+		}
+		else if(r < 4 && !ret){
+			ret = ip;
+			ip = 0x400 + harness_random(0x3e0);
+		}
+		else if(r < 8 && ret){
+			ip = ret;
+			ret = 0;
+		}
+		else if(r < 9 || ip >= 0x7f0){
+			ip = loop_start = 0x400 + harness_random(0x3e0);
+		}
+	}
+}
+
+// Macros played back from the macro storage area (0x800 - 0x1fff): the
+// record header, then its events a byte at a time.
+static void workload_macros(void){
+	for(int i = 0; i < 2000; ++i){
+		uint16_t addr = 0x800 + harness_random(0x1700);
+		harness_read(addr, 2);
+		uint8_t events = 2 + harness_random(30);
+		for(uint8_t e = 0; e < events; ++e){
+			harness_read(addr + 2 + e, 1);
+		}
+	}
+}
+
+// Program reads while a macro is recorded: each event is written to the
+// next free byte, then read back.
+static void workload_record(void){
+	uint16_t ip = 0x400;
+	uint16_t record = 0x1000;
+	for(int i = 0; i < 500; ++i){
+		uint8_t event = harness_random(256);
+		uint32_t start_us = bus_us;
+		if(i2c_eeprom_write_byte((uint8_t*)(intptr_t) record, event) != SUCCESS){
+			printf("FAIL: write at %d\n", record);
+			exit(1);
+		}
+		harness_stats.bus_us += bus_us - start_us;
+		harness_read(record, 1);
+		for(int j = 0; j < 20; ++j){
+			harness_read(ip, 1);
+			ip = (ip == 0x47f) ? 0x400 : ip + 1;
+		}
+		++record;
+	}
+}
+
+// Returns the throughput in bytes/sec of writing len bytes with write,
+// which is checked to leave the emulated memory the same as expected.
+static double harness_write(const char* name, uint16_t len, i2c_eeprom_err (*write)(void), const uint8_t* expected){
+	bus_us += write_cycle_us; // let any previous write cycle finish
+	uint32_t start_us = bus_us;
+	if(write() != SUCCESS || memcmp(at24_memory, expected, AT24C164_SIZE)){
+		printf("FAIL: %s left the wrong data\n", name);
+		exit(1);
+	}
+	return len * 1000000.0 / (bus_us - start_us);
+}
+
+// Writes of a kilobyte at unaligned addresses, as made by resetting the
+// macro index or compacting macro storage.
+#define THROUGHPUT_LEN 1024
+static uint8_t throughput_value;
+
+static i2c_eeprom_err throughput_memset(void){
+	return i2c_eeprom_memset((void*) 0x903, throughput_value, THROUGHPUT_LEN);
+}
+
+static i2c_eeprom_err throughput_memmove(void){
+	return i2c_eeprom_memmove((void*) 0x903, (const void*) 0xb47, THROUGHPUT_LEN);
+}
+
+static void workload_throughput(void){
+	static uint8_t expected[AT24C164_SIZE];
+	double memset_bps[2], memmove_bps[2];
+	for(int polled = 0; polled < 2; ++polled){
+		harness_delay_retry = !polled;
+
+		throughput_value = 0x5a + polled;
+		memcpy(expected, at24_memory, AT24C164_SIZE);
+		memset(&expected[0x903], throughput_value, THROUGHPUT_LEN);
+		memset_bps[polled] = harness_write("i2c_eeprom_memset", THROUGHPUT_LEN, throughput_memset, expected);
+
+		// moves what the memset left: changing at24_memory directly would
+		// leave the read cache stale
+		memcpy(expected, at24_memory, AT24C164_SIZE);
+		memmove(&expected[0x903], &expected[0xb47], THROUGHPUT_LEN);
+		memmove_bps[polled] = harness_write("i2c_eeprom_memmove", THROUGHPUT_LEN, throughput_memmove, expected);
+	}
+	harness_delay_retry = false;
+	printf("  %5.1fms %10.0f %10.0f %10.0f %10.0f\n", write_cycle_us / 1000.0,
+		   memset_bps[0], memset_bps[1], memmove_bps[0], memmove_bps[1]);
+}
+
+int main(int argc, const char** argv){
+	static const struct { const char* name; void (*run)(void); } workloads[] = {
+		{ "program", workload_program },
+		{ "macros", workload_macros },
+		{ "record", workload_record },
+	};
+
+	printf("AT24C164 at 100kHz:\n");
+	printf("  %-8s %8s %9s %13s %14s %14s\n", "workload", "reads", "hit rate",
+		   "transactions", "bus time", "uncached");
+	for(int w = 0; w < (int) (sizeof(workloads) / sizeof(workloads[0])); ++w){
+		workload_stats stats[2];
+		for(int cached = 0; cached < 2; ++cached){
+			for(int i = 0; i < AT24C164_SIZE; ++i){
+				at24_memory[i] = i * 7 + (i >> 8);
+			}
+			harness_seed = 1;
+			harness_cached = cached;
+			memset(&harness_stats, 0, sizeof(harness_stats));
+			workloads[w].run();
+			stats[cached] = harness_stats;
+		}
+		printf("  %-8s %8lu %8.1f%% %13lu %12.1fms %12.1fms\n", workloads[w].name, stats[1].reads,
+			   100.0 * (1.0 - (double) stats[1].transactions / stats[1].pages), stats[1].transactions,
+			   stats[1].bus_us / 1000.0, stats[0].bus_us / 1000.0);
+	}
+	printf("Bytes/sec writing %d bytes, retrying every 1ms or polling:\n", THROUGHPUT_LEN);
+	printf("  %-7s %21s %21s\n", "", "i2c_eeprom_memset", "i2c_eeprom_memmove");
+	printf("  %-7s %10s %10s %10s %10s\n", "cycle", "retrying", "polling", "retrying", "polling");
+	static const uint32_t cycles_us[] = { 3000, 5000, 7000, 10000 };
+	for(int c = 0; c < (int) (sizeof(cycles_us) / sizeof(cycles_us[0])); ++c){
+		write_cycle_us = cycles_us[c];
+		workload_throughput();
+	}
+	return 0;
+}
@@ -7,6 +7,8 @@
 
 #define STORAGE_SECTION_sram
 
+#define STORAGE_STEP_SIZE_sram 16
+
 inline int16_t sram_write(void* dst, const void* data, size_t count){
 	memcpy(dst, data, count);
 	return count;
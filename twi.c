@@ -48,6 +48,18 @@
 
 #ifndef BITBANG_TWI
 #include <util/twi.h>
+#include <util/atomic.h>
+#include <avr/interrupt.h>
+
+// Transaction queue: the head is the transaction in progress if running
+static twi_transaction* volatile queue_head = 0;
+static twi_transaction* volatile queue_tail = 0;
+static volatile bool running = false; // the interrupt is running queue_head
+static volatile bool locked = false;  // the blocking interface has the bus
+static uint8_t transfer_pos;          // bytes written or read of queue_head
+static bool reading;                  // queue_head has finished writing
+
+#define TWCR_ISR_BASE ((1<<TWINT) | (1<<TWEN) | (1<<TWIE))
 
 void twi_init(void) {
 	// 0 prescaler
@@ -57,7 +69,129 @@ void twi_init(void) {
 	TWBR = ((F_CPU / TWI_FREQ) - 16) / 2;
 }
 
+// Starts running the queue if there's a transaction and the bus is free.
+// Called with interrupts disabled.
+static void twi_queue_kick(void){
+	if(running || locked || !queue_head) return;
+	running = true;
+	reading = false;
+	while (TWCR & (1<<TWSTO)); // any previous stop must complete first
+	TWCR = TWCR_ISR_BASE | (1<<TWSTA);
+}
+
+void twi_submit(twi_transaction* t){
+	t->status = TWI_PENDING;
+	t->next = 0;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		if(queue_tail){
+			queue_tail->next = t;
+		}
+		else{
+			queue_head = t;
+		}
+		queue_tail = t;
+		twi_queue_kick();
+	}
+}
+
+twi_status twi_transfer(twi_transaction* t){
+	twi_submit(t);
+	while(t->status == TWI_PENDING);
+	return t->status;
+}
+
+// Completes queue_head from the interrupt, then starts the next
+// transaction if there is one: with a repeated start if the completed
+// transaction holds the bus, otherwise with a combined stop and start.
+static void twi_queue_finish(twi_status status){
+	twi_transaction* t = queue_head;
+	queue_head = t->next;
+	if(!queue_head) queue_tail = 0;
+
+	if(queue_head && t->hold){
+		reading = false;
+		TWCR = TWCR_ISR_BASE | (1<<TWSTA);
+	}
+	else if(queue_head && !locked){
+		reading = false;
+		TWCR = TWCR_ISR_BASE | (1<<TWSTO) | (1<<TWSTA);
+	}
+	else{
+		running = false;
+		TWCR = (1<<TWINT) | (1<<TWSTO) | (1<<TWEN);
+	}
+
+	t->status = status;
+	if(t->callback){
+		t->callback(t);
+	}
+}
+
+ISR(TWI_vect){
+	twi_transaction* t = queue_head;
+
+	switch(TW_STATUS){
+	case TW_START:
+	case TW_REP_START:
+		transfer_pos = 0;
+		if(!reading && t->write_len){
+			TWDR = t->address;
+		}
+		else{
+			reading = true;
+			TWDR = t->address | TW_READ;
+		}
+		TWCR = TWCR_ISR_BASE;
+		break;
+	case TW_MT_SLA_ACK:
+	case TW_MT_DATA_ACK:
+		if(transfer_pos < t->write_len){
+			TWDR = t->write_buf[transfer_pos++];
+			TWCR = TWCR_ISR_BASE;
+		}
+		else if(t->read_len){
+			reading = true;
+			TWCR = TWCR_ISR_BASE | (1<<TWSTA);
+		}
+		else{
+			twi_queue_finish(TWI_SUCCESS);
+		}
+		break;
+	case TW_MR_DATA_ACK:
+		t->read_buf[transfer_pos++] = TWDR;
+		// fall through
+	case TW_MR_SLA_ACK:
+		// acknowledge every byte but the last
+		if(transfer_pos + 1 < t->read_len){
+			TWCR = TWCR_ISR_BASE | (1<<TWEA);
+		}
+		else{
+			TWCR = TWCR_ISR_BASE;
+		}
+		break;
+	case TW_MR_DATA_NACK:
+		t->read_buf[transfer_pos++] = TWDR;
+		twi_queue_finish(TWI_SUCCESS);
+		break;
+	case TW_MT_SLA_NACK:
+	case TW_MT_DATA_NACK:
+	case TW_MR_SLA_NACK:
+		twi_queue_finish(TWI_NACK);
+		break;
+	default:
+		// arbitration lost or bus error: give up on this transaction
+		twi_queue_finish(TWI_ERROR);
+		break;
+	}
+}
+
 void twi_start(){
+	if(!locked){
+		// take the bus once any transaction in progress is complete
+		locked = true;
+		while(running);
+		while (TWCR & (1<<TWSTO));
+	}
 	TWCR = (1<<TWINT) | (1<<TWSTA) | (1<<TWEN);
 	while ((TWCR & (1<<TWINT)) == 0);
 }
@@ -66,6 +200,10 @@ void twi_stop(twi_wait wait){
 	if(wait == WAIT){
 		while (TWCR & (1<<TWSTO));
 	}
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		locked = false;
+		twi_queue_kick();
+	}
 }
 uint8_t twi_read_byte(twi_ack ack){
 	TWCR = (1<<TWINT) | (1<<TWEN);
@@ -48,6 +48,9 @@
 
 #include "hardware.h"
 
+#include <stdint.h>
+#include <stdbool.h>
+
 #ifndef TWI_FREQ
 // Frequency for hardware TWI: may be overridden by hardware.h
 #define TWI_FREQ 100000
@@ -64,9 +67,60 @@ typedef enum _twi_wait {
 } twi_wait;
 
 void twi_init(void);
+
+// Blocking byte-level interface. With hardware TWI, twi_start() takes the
+// bus from the transaction queue (waiting for any transaction in progress)
+// and twi_stop() gives it back.
 void twi_start(void);
 void twi_stop(twi_wait wait);
 uint8_t twi_read_byte(twi_ack ack);
 twi_ack twi_write_byte(uint8_t val);
 
+#ifndef BITBANG_TWI
+
+/*
+ * Interrupt-driven transactions (hardware TWI only). A transaction writes
+ * write_len bytes to the device, then if read_len is nonzero issues a
+ * repeated start and reads read_len bytes. Queued transactions are run in
+ * order from the TWI interrupt, and the callback (if any) is called from
+ * the interrupt when each one completes. Transactions submitted together
+ * with hold set on all but the last are run as a single bus transaction.
+ */
+typedef enum _twi_status {
+	TWI_PENDING,
+	TWI_SUCCESS,
+	TWI_NACK,  // device did not acknowledge its address or data
+	TWI_ERROR, // bus error or arbitration lost
+} twi_status;
+
+typedef struct _twi_transaction twi_transaction;
+
+typedef void (*twi_callback)(twi_transaction* t);
+
+struct _twi_transaction {
+	uint8_t address; // device address and write bit (SLA+W)
+	const uint8_t* write_buf;
+	uint8_t write_len;
+	uint8_t* read_buf;
+	uint8_t read_len;
+	bool hold; // continue into the next queued transaction with a repeated start
+	twi_callback callback;
+	volatile twi_status status;
+	twi_transaction* volatile next; // owned by the queue while pending
+};
+
+/**
+ * Queues a transaction, which must not be modified until its status is
+ * no longer TWI_PENDING.
+ */
+void twi_submit(twi_transaction* t);
+
+/**
+ * Queues a transaction and waits for it to complete. Must not be called
+ * between twi_start() and twi_stop(), or with interrupts disabled.
+ */
+twi_status twi_transfer(twi_transaction* t);
+
+#endif // !BITBANG_TWI
+
 #endif
@@ -19,6 +19,13 @@
  */
 void USB_KeepAlive(uint8_t poll);
 
+/**
+ * Runs all queued storage jobs to completion, keeping the watchdog and
+ * timers up to date (but not polling) meanwhile. For host requests which
+ * must not overlap a background storage write.
+ */
+void USB_FinishStorageJobs(void);
+
 /**
  * Performs a USB update, scanning keyboard/mouse and responding
  * to interrupt requests. Includes KeepAlive.
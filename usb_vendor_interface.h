@@ -66,7 +66,16 @@ typedef enum _vendor_request {
 	WRITE_MACRO_INDEX, READ_MACRO_INDEX,
 	READ_MACRO_STORAGE_SIZE,
 	WRITE_MACRO_STORAGE, READ_MACRO_STORAGE,
-	READ_MACRO_MAX_KEYS
+	READ_MACRO_MAX_KEYS,
+
+	// Reserved for the OATH storage requests known to clients
+	WRITE_OATH_STORAGE, READ_OATH_STORAGE, READ_OATH_STORAGE_SIZE,
+	OATH_SET_TIME,
+
+	READ_LATENCY_STATS, // latency_stats, see stats.h
+	RESET_LATENCY_STATS,
+
+	READ_PROGRAM_STATUS // vm_program_status for each program, see interpreter.h
 
 } vendor_request;
 
@@ -28,6 +28,8 @@
 #include "macro.h"
 #include "usb_vendor_interface.h"
 #include "storage.h"
+#include "usb.h"
+#include "stats.h"
 
 // Use GCC built-in memory operations
 #define memcmp(a,b,c) __builtin_memcmp(a,b,c)
@@ -67,6 +69,14 @@ static union {
 
 void(*transfer_callback)() = (void*) 0x0;
 
+// Set once the host has rewritten the programs, which are then verified
+// by vm_init() from the main loop rather than inside usbPoll().
+static bool programs_written = false;
+
+static void programs_write_complete(void){
+	programs_written = true;
+}
+
 
 /* ------------------------------------------------------------------------- */
 
@@ -85,10 +95,10 @@ usbMsgLen_t usbFunctionSetup(uchar data[8]){
 
 		case USBRQ_HID_GET_REPORT:
 			if(!rq->wIndex.word){ // wIndex specifies which interface we're talking about: 0 = kbd, 1 = mouse
-				Fill_KeyboardReport(&KeyboardReportData); // We can assume that this isn't happening at the
-														  // same time as interrupt in reports
-
-				PrevKeyboardHIDReportBuffer = KeyboardReportData;
+				// We can assume that this isn't happening at the same time as interrupt in reports.
+				// The report isn't recorded as sent: the interrupt endpoint still sends it, so
+				// that states reporting a sequence (printing) advance only on interrupt reports.
+				Fill_KeyboardHIDReport(&KeyboardReportData);
 
 				usbMsgPtr = (void*)&KeyboardReportData;
 				return sizeof(KeyboardReportData);
@@ -167,11 +177,20 @@ usbMsgLen_t usbFunctionSetup(uchar data[8]){
 			usbMsgPtr = (uint8_t*)&transfer.word;
 			return 2;
 
+		case READ_LATENCY_STATS:
+			usbMsgPtr = (uint8_t*)stats_get_latency();
+			return min_u16(sizeof(latency_stats), rq->wLength.word);
+		case READ_PROGRAM_STATUS:
+			usbMsgPtr = (uint8_t*)vm_get_program_status();
+			return min_u16(sizeof(vm_program_status) * PROGRAM_COUNT, rq->wLength.word);
+
 			/* callback transfers */
 
 		case WRITE_PROGRAMS:
+			vm_stop_all();
+			programs_written = false;
 			transfer.state.type = WRITE;
-			transfer_callback = &vm_init;
+			transfer_callback = &programs_write_complete;
 			goto programs_rw;
 		case READ_PROGRAMS:
 			transfer.state.type = READ;
@@ -183,7 +202,10 @@ usbMsgLen_t usbFunctionSetup(uchar data[8]){
 
 
 		case WRITE_MACRO_INDEX:
+			USB_FinishStorageJobs();
+			macros_host_write();
 			transfer.state.type = WRITE;
+			transfer_callback = &macro_idx_init;
 			goto macro_index_rw;
 		case READ_MACRO_INDEX:
 			transfer.state.type = READ;
@@ -194,6 +216,8 @@ usbMsgLen_t usbFunctionSetup(uchar data[8]){
 			return USB_NO_MSG;
 
 		case WRITE_MACRO_STORAGE:
+			USB_FinishStorageJobs();
+			macros_host_write();
 			transfer.state.type = WRITE;
 			goto macro_storage_rw;
 		case READ_MACRO_STORAGE:
@@ -210,7 +234,9 @@ usbMsgLen_t usbFunctionSetup(uchar data[8]){
 			break;
 		}
 		case WRITE_MAPPING:
+			USB_FinishStorageJobs();
 			transfer.state.type = WRITE;
+			transfer_callback = &config_reload_mapping;
 			goto mapping_rw1;
 		case READ_DEFAULT_MAPPING:
 			transfer.state.type = READ;
@@ -227,11 +253,19 @@ usbMsgLen_t usbFunctionSetup(uchar data[8]){
 			return USB_NO_MSG;
 
 		case RESET_DEFAULTS:
+			USB_FinishStorageJobs();
 			config_reset_defaults();
+			USB_FinishStorageJobs();
 			break;
 
 		case RESET_FULLY:
+			USB_FinishStorageJobs();
 			config_reset_fully();
+			USB_FinishStorageJobs();
+			break;
+
+		case RESET_LATENCY_STATS:
+			stats_reset();
 			break;
 		}
 	}
@@ -357,7 +391,7 @@ int main(void) {
 	odDebugInit();
 	DBG1(0x00, 0, 0);       /* debug output: main starts */
 
-	TCCR1B |= ((1 << CS10) | (1 << CS11)); // Set up timer at Fcpu/64
+	TCCR1B |= ((1 << CS10) | (1 << CS11)); // Set up timer at Fcpu/64 for uptimems and stats_ticks()
 
 	usbInit();
 	usbDeviceDisconnect();  /* enforce re-enumeration, do this while interrupts are disabled! */
@@ -380,9 +414,12 @@ void update_uptimems(){
 	// run a prescaled timer at CPU/64 (250khz) we can record up to a third of second of change, so we just
 	// work out how many millis have passed (t/250) and add to uptimems (saving the remainder between runs)
 	static uint8_t remainder = 0;
+	static uint16_t last_ticks = 0;
 
-	uint16_t elapsed_ticks = TCNT1;
-	TCNT1 = 0;
+	// The timer is left free-running for stats_ticks()
+	uint16_t ticks = stats_ticks();
+	uint16_t elapsed_ticks = ticks - last_ticks;
+	last_ticks = ticks;
 
 	elapsed_ticks += remainder;
 
@@ -432,16 +469,30 @@ void USB_KeepAlive(uint8_t poll){
 	}
 }
 
+void USB_FinishStorageJobs(void){
+	while(storage_job_busy()){
+		storage_job_task();
+		USB_KeepAlive(false);
+	}
+}
+
 void USB_Perform_Update(void){
 	USB_KeepAlive(true);
 
+	if(programs_written){
+		programs_written = false;
+		vm_init();
+	}
+
 	static bool sending_keyboard = 0;
+	static bool keyboard_new = 0; // the current keyboard report is newly filled, not an idle repeat
 	static bool sending_mouse = 0;
 
 	// Keyboard
 	if(!sending_keyboard){
 		// Update, set sending_keyboard if the report is different to last time
-		sending_keyboard = update_and_compare(&KeyboardReportData, &PrevKeyboardHIDReportBuffer, sizeof(KeyboardReport_Data_t), (void(*)(void*)) &Fill_KeyboardReport);
+		sending_keyboard = update_and_compare(&KeyboardReportData, &PrevKeyboardHIDReportBuffer, sizeof(KeyboardReport_Data_t), (void(*)(void*)) &Fill_KeyboardHIDReport);
+		keyboard_new = sending_keyboard;
 	}
 	if(!sending_keyboard && (kbd_idleRate && keyboard_idle_ms == 0)){
 		// if still not sending and expired, re-send the previous buffer
@@ -454,6 +505,9 @@ void USB_Perform_Update(void){
 		sending_keyboard = 0;
 		// now that we've sent, reset the idle timer
 		keyboard_idle_ms = kbd_idleRate * 4;
+		if(keyboard_new){
+			Complete_KeyboardHIDReport();
+		}
 	}
 
 	// Mouse